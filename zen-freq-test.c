@@ -0,0 +1,887 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * zen-freq-test.c - KUnit tests for the zen-freq helpers
+ *
+ * Included at the end of zen-freq.c when CONFIG_ZEN_FREQ_KUNIT_TEST is
+ * set, so the static helpers can be tested without exporting them. Each
+ * test works on a zen_freq_cpu of its own. None touches real MSRs: the
+ * sampling paths read APERF/MPERF/TSC through zen_rdmsrl()/zen_rdtsc(),
+ * which are redirected to fake counters, and the thermal controllers are
+ * fed temperature traces directly.
+ *
+ * Copyright (C) 2024
+ * Author: zen-freq development team
+ */
+
+#include <kunit/test.h>
+#include <kunit/static_stub.h>
+
+/* ============================================================================
+ * Helpers
+ * ============================================================================ */
+
+static struct zen_freq_cpu *zen_test_cpu(struct kunit *test)
+{
+	struct zen_freq_cpu *zcpu;
+
+	zcpu = kunit_kzalloc(test, sizeof(*zcpu), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, zcpu);
+
+	u64_stats_init(&zcpu->stats.syncp);
+	u64_stats_init(&zcpu->slow_stats.syncp);
+	u64_stats_init(&zcpu->stats.switch_syncp);
+	u64_stats_init(&zcpu->stats.phase_syncp);
+	zcpu->phase.pred = ZEN_PHASE_NO_PRED;
+
+	return zcpu;
+}
+
+static void zen_test_add_pstate(struct zen_freq_cpu *zcpu, u32 freq, u32 mv)
+{
+	struct zen_pstate *ps = &zcpu->pstates[zcpu->num_pstates];
+
+	ps->pstate = zcpu->num_pstates++;
+	ps->freq = freq;
+	ps->voltage = mv;
+	ps->en = true;
+	ps->safe = true;
+}
+
+/*
+ * A Zen 4 style table: P0 boost at 5.6 GHz and a 5.575 GHz state sharing
+ * its 32 MHz bucket, nominal 4.5 GHz and two lower states, listed out of
+ * order like the hardware may report them.
+ */
+static struct zen_pstate_index *zen_test_index(struct kunit *test,
+					       struct zen_freq_cpu *zcpu)
+{
+	struct zen_pstate_index *index;
+
+	zen_test_add_pstate(zcpu, 5600000, 1400);
+	zen_test_add_pstate(zcpu, 4500000, 1100);
+	zen_test_add_pstate(zcpu, 5575000, 1400);
+	zen_test_add_pstate(zcpu, 3000000, 900);
+	zen_test_add_pstate(zcpu, 1500000, 900);
+
+	zcpu->max_freq = 5600000;
+	zcpu->min_freq = 1500000;
+	zcpu->nominal_freq = 4500000;
+	zcpu->lowest_perf = 0;
+	zcpu->highest_perf = 255;
+
+	index = zen_pstate_index_build(zcpu);
+	KUNIT_ASSERT_NOT_NULL(test, index);
+
+	return index;
+}
+
+/* Fake counters behind zen_rdmsrl()/zen_rdtsc(), hung off test->priv */
+struct zen_test_msrs {
+	u64 aperf;
+	u64 mperf;
+	u64 tsc;
+	bool fail;
+};
+
+static int zen_test_rdmsrl(u32 msr, u64 *val)
+{
+	struct zen_test_msrs *msrs = kunit_get_current_test()->priv;
+
+	if (msrs->fail)
+		return -EIO;
+
+	switch (msr) {
+	case MSR_IA32_APERF:
+		*val = msrs->aperf;
+		return 0;
+	case MSR_IA32_MPERF:
+		*val = msrs->mperf;
+		return 0;
+	default:
+		return -EIO;
+	}
+}
+
+static u64 zen_test_rdtsc(void)
+{
+	struct zen_test_msrs *msrs = kunit_get_current_test()->priv;
+
+	return msrs->tsc;
+}
+
+static struct zen_test_msrs *zen_test_msrs(struct kunit *test)
+{
+	struct zen_test_msrs *msrs;
+
+	msrs = kunit_kzalloc(test, sizeof(*msrs), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, msrs);
+
+	test->priv = msrs;
+	kunit_activate_static_stub(test, zen_rdmsrl, zen_test_rdmsrl);
+	kunit_activate_static_stub(test, zen_rdtsc, zen_test_rdtsc);
+
+	return msrs;
+}
+
+/* ============================================================================
+ * Lookup Index
+ * ============================================================================ */
+
+static void zen_test_index_floor(struct kunit *test)
+{
+	struct zen_freq_cpu *zcpu = zen_test_cpu(test);
+	struct zen_pstate_index *index = zen_test_index(test, zcpu);
+
+	KUNIT_ASSERT_EQ(test, index->nr, 5);
+	KUNIT_EXPECT_EQ(test, index->freq[0], 1500000);
+	KUNIT_EXPECT_EQ(test, index->freq[4], 5600000);
+
+	/* Both top states land in one bucket */
+	KUNIT_EXPECT_EQ(test, index->freq[3] >> index->bucket_shift,
+			index->freq[4] >> index->bucket_shift);
+
+	KUNIT_EXPECT_EQ(test, zen_pstate_index_floor(index, 0), 0);
+	KUNIT_EXPECT_EQ(test, zen_pstate_index_floor(index, 1499999), 0);
+	KUNIT_EXPECT_EQ(test, zen_pstate_index_floor(index, 1500000), 0);
+	KUNIT_EXPECT_EQ(test, zen_pstate_index_floor(index, 2999999), 0);
+	KUNIT_EXPECT_EQ(test, zen_pstate_index_floor(index, 3000000), 1);
+	KUNIT_EXPECT_EQ(test, zen_pstate_index_floor(index, 4500000), 2);
+	KUNIT_EXPECT_EQ(test, zen_pstate_index_floor(index, 5574999), 2);
+	KUNIT_EXPECT_EQ(test, zen_pstate_index_floor(index, 5590000), 3);
+	KUNIT_EXPECT_EQ(test, zen_pstate_index_floor(index, 5600000), 4);
+	KUNIT_EXPECT_EQ(test, zen_pstate_index_floor(index, UINT_MAX), 4);
+
+	kfree(index);
+}
+
+static void zen_test_index_ceil(struct kunit *test)
+{
+	struct zen_freq_cpu *zcpu = zen_test_cpu(test);
+	struct zen_pstate_index *index = zen_test_index(test, zcpu);
+
+	KUNIT_EXPECT_EQ(test, zen_pstate_index_ceil(index, 0), 0);
+	KUNIT_EXPECT_EQ(test, zen_pstate_index_ceil(index, 1500001), 1);
+	KUNIT_EXPECT_EQ(test, zen_pstate_index_ceil(index, 4500000), 2);
+	KUNIT_EXPECT_EQ(test, zen_pstate_index_ceil(index, 5580000), 4);
+	KUNIT_EXPECT_EQ(test, zen_pstate_index_ceil(index, UINT_MAX), 4);
+
+	/* Perf levels span the table and the nominal slot is found */
+	KUNIT_EXPECT_EQ(test, index->perf_pos[0], 0);
+	KUNIT_EXPECT_EQ(test, index->perf_pos[255], 4);
+	KUNIT_EXPECT_EQ(test, index->nominal_pos, 2);
+
+	kfree(index);
+}
+
+static void zen_test_index_unsafe(struct kunit *test)
+{
+	struct zen_freq_cpu *zcpu = zen_test_cpu(test);
+	struct zen_pstate_index *index;
+	unsigned int i;
+
+	zen_test_add_pstate(zcpu, 5600000, 1550);
+	zen_test_add_pstate(zcpu, 4500000, 1100);
+	zcpu->pstates[0].safe = false;
+	zcpu->max_freq = 4500000;
+	zcpu->min_freq = 4500000;
+	zcpu->nominal_freq = 4500000;
+	zcpu->highest_perf = 255;
+
+	index = zen_pstate_index_build(zcpu);
+	KUNIT_ASSERT_NOT_NULL(test, index);
+
+	/* The unsafe state can never be resolved to */
+	KUNIT_EXPECT_EQ(test, index->nr, 1);
+	for (i = 0; i < ARRAY_SIZE(index->perf_pos); i++)
+		KUNIT_EXPECT_EQ(test, index->pstate[index->perf_pos[i]], 1);
+
+	kfree(index);
+}
+
+/* ============================================================================
+ * VID Decode
+ * ============================================================================ */
+
+static void zen_test_vid_svi2(struct kunit *test)
+{
+	KUNIT_EXPECT_EQ(test, ZEN_SVI2_VID_TO_MV(0x00), 1550);
+	KUNIT_EXPECT_EQ(test, ZEN_SVI2_VID_TO_MV(0x20), 1350);
+	KUNIT_EXPECT_EQ(test, ZEN_SVI2_VID_TO_MV(0x58), 1000);
+	KUNIT_EXPECT_EQ(test, ZEN_SVI2_VID_TO_MV(0xF7), 7);
+
+	/* VIDs 0xF8 and up switch the rail off */
+	KUNIT_EXPECT_EQ(test, ZEN_SVI2_VID_TO_MV(0xF8), 0);
+	KUNIT_EXPECT_EQ(test, ZEN_SVI2_VID_TO_MV(0xFF), 0);
+}
+
+static void zen_test_vid_svi3(struct kunit *test)
+{
+	KUNIT_EXPECT_EQ(test, ZEN_SVI3_VID_TO_MV(0x00), 245);
+	KUNIT_EXPECT_EQ(test, ZEN_SVI3_VID_TO_MV(0x97), 1000);
+	KUNIT_EXPECT_EQ(test, ZEN_SVI3_VID_TO_MV(0xFF), 1520);
+	KUNIT_EXPECT_EQ(test, ZEN_SVI3_VID_TO_MV(0x100), 1525);
+}
+
+static void zen_test_vid_extract(struct kunit *test)
+{
+	u64 val = PSTATE_DEF_EN | BIT_ULL(32) | (0x23ULL << 11);
+	bool svi3 = zfreq_driver.vid_svi3;
+
+	/* SVI2 has no ninth bit */
+	zfreq_driver.vid_svi3 = false;
+	KUNIT_EXPECT_EQ(test, zen_vf_vid(val), 0x23);
+
+	zfreq_driver.vid_svi3 = true;
+	KUNIT_EXPECT_EQ(test, zen_vf_vid(val), 0x123);
+	KUNIT_EXPECT_EQ(test, zen_vf_vid(val & ~BIT_ULL(32)), 0x23);
+
+	zfreq_driver.vid_svi3 = svi3;
+}
+
+/* ============================================================================
+ * Frequency Conversion
+ * ============================================================================ */
+
+static void zen_test_freq_from_pstate(struct kunit *test)
+{
+	/* FID only: 25 MHz steps */
+	KUNIT_EXPECT_EQ(test, zen_freq_calc_freq_from_pstate(0x0F), 375000);
+
+	/* A DID divides by (DID + 4) / 4 */
+	KUNIT_EXPECT_EQ(test, zen_freq_calc_freq_from_pstate((4 << 6) | 0x0C),
+			150000);
+
+	/* Each CurDiv step (bits 5:4, per PSTATE_DEF_CUR_DIV) halves it */
+	KUNIT_EXPECT_EQ(test, zen_freq_calc_freq_from_pstate(0x1C), 700000);
+	KUNIT_EXPECT_EQ(test, zen_freq_calc_freq_from_pstate(0x2C), 550000);
+	KUNIT_EXPECT_EQ(test, zen_freq_calc_freq_from_pstate(0x3C), 375000);
+
+	/* The enable and VID bits do not change the frequency */
+	KUNIT_EXPECT_EQ(test,
+			zen_freq_calc_freq_from_pstate(PSTATE_DEF_EN |
+						       (0x58ULL << 11) | 0x0F),
+			375000);
+}
+
+/* Perf 0-255 spread over a 1.5-5.6 GHz range */
+static u32 zen_test_perf_to_freq(u32 perf)
+{
+	return ZEN_PERF_TO_FREQ(perf, 0U, 255U, 1500000U, 5600000U);
+}
+
+static u32 zen_test_freq_to_perf(u32 freq)
+{
+	return ZEN_FREQ_TO_PERF(freq, 1500000U, 5600000U, 0U, 255U);
+}
+
+static void zen_test_perf_freq(struct kunit *test)
+{
+	u32 perf, back;
+
+	KUNIT_EXPECT_EQ(test, zen_test_perf_to_freq(0), 1500000);
+	KUNIT_EXPECT_EQ(test, zen_test_perf_to_freq(255), 5600000);
+	KUNIT_EXPECT_EQ(test, zen_test_perf_to_freq(128), 3558039);
+
+	KUNIT_EXPECT_EQ(test, zen_test_freq_to_perf(1500000), 0);
+	KUNIT_EXPECT_EQ(test, zen_test_freq_to_perf(5600000), 255);
+	KUNIT_EXPECT_EQ(test, zen_test_freq_to_perf(3558039), 127);
+
+	/* Both round down, so a round trip loses at most one level */
+	for (perf = 0; perf <= 255; perf++) {
+		back = zen_test_freq_to_perf(zen_test_perf_to_freq(perf));
+		KUNIT_EXPECT_LE(test, back, perf);
+		KUNIT_EXPECT_GE(test, back + 1, perf);
+	}
+}
+
+/* ============================================================================
+ * Counter Sampling
+ * ============================================================================ */
+
+static void zen_test_thread_sample(struct kunit *test)
+{
+	struct zen_test_msrs *msrs = zen_test_msrs(test);
+	struct zen_freq_thread *thr;
+	u64 t = NSEC_PER_SEC;
+
+	thr = kunit_kzalloc(test, sizeof(*thr), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, thr);
+
+	/* The first window only takes the baseline */
+	msrs->mperf = 1000;
+	msrs->tsc = 5000;
+	KUNIT_EXPECT_TRUE(test, zen_freq_thread_sample(thr, t));
+	KUNIT_EXPECT_EQ(test, thr->util, 0);
+
+	/* Inside the window nothing is read */
+	msrs->mperf += 30;
+	msrs->tsc += 100;
+	KUNIT_EXPECT_FALSE(test, zen_freq_thread_sample(thr, t + 1));
+
+	/* Busy is the unhalted share of the TSC */
+	t += ZEN_UTIL_SAMPLE_NS;
+	KUNIT_EXPECT_TRUE(test, zen_freq_thread_sample(thr, t));
+	KUNIT_EXPECT_EQ(test, thr->util, 30);
+
+	/* Clamped at 100 */
+	msrs->mperf += 300;
+	msrs->tsc += 100;
+	t += ZEN_UTIL_SAMPLE_NS;
+	KUNIT_EXPECT_TRUE(test, zen_freq_thread_sample(thr, t));
+	KUNIT_EXPECT_EQ(test, thr->util, 100);
+
+	/* A failed read keeps the previous window */
+	msrs->fail = true;
+	t += ZEN_UTIL_SAMPLE_NS;
+	KUNIT_EXPECT_FALSE(test, zen_freq_thread_sample(thr, t));
+	KUNIT_EXPECT_EQ(test, thr->util, 100);
+	KUNIT_EXPECT_EQ(test, thr->sample_ns, t - ZEN_UTIL_SAMPLE_NS);
+}
+
+static void zen_test_effective_freq(struct kunit *test)
+{
+	struct zen_test_msrs *msrs = zen_test_msrs(test);
+	struct zen_freq_cpu *zcpu = zen_test_cpu(test);
+	u64 rewind = 2 * ZEN_EFF_SAMPLE_MIN_MS * NSEC_PER_MSEC;
+	u32 eff_short, cap_short, eff_full, cap_full;
+	u64 failed_ns;
+
+	zcpu->nominal_freq = 4500000;
+	atomic_set(&zcpu->cur_freq, 4500000);
+
+	/* Sampling only happens on the CPU that owns zcpu */
+	zcpu->cpu = get_cpu();
+
+	zen_freq_sample_effective(zcpu);
+
+	/* Nominal asked, 80% delivered: capped at the delivered level */
+	zcpu->eff_sample_ns -= rewind;
+	msrs->aperf += 3600000;
+	msrs->mperf += 4500000;
+	zen_freq_sample_effective(zcpu);
+	eff_short = zcpu->eff_freq;
+	cap_short = zcpu->eff_cap_freq;
+
+	/* Back at full speed the cap is lifted once its hold expires */
+	zcpu->eff_sample_ns -= rewind;
+	zcpu->eff_cap_expire = jiffies - 1;
+	msrs->aperf += 4500000;
+	msrs->mperf += 4500000;
+	zen_freq_sample_effective(zcpu);
+	eff_full = zcpu->eff_freq;
+	cap_full = zcpu->eff_cap_freq;
+
+	/* A failed read leaves the window open */
+	zcpu->eff_sample_ns -= rewind;
+	failed_ns = zcpu->eff_sample_ns;
+	msrs->fail = true;
+	zen_freq_sample_effective(zcpu);
+
+	put_cpu();
+
+	KUNIT_EXPECT_EQ(test, eff_short, 3600000);
+	KUNIT_EXPECT_EQ(test, cap_short, 3600000);
+	KUNIT_EXPECT_EQ(test, eff_full, 4500000);
+	KUNIT_EXPECT_EQ(test, cap_full, 0);
+	KUNIT_EXPECT_EQ(test, zcpu->eff_sample_ns, failed_ns);
+}
+
+/* ============================================================================
+ * Thermal Controllers
+ * ============================================================================ */
+
+struct zen_test_thermal_params {
+	unsigned int model;
+	unsigned int kp;
+	unsigned int ki;
+	unsigned int kff;
+	unsigned int horizon_ms;
+	unsigned int soft_temp;
+	unsigned int hard_temp;
+};
+
+static void zen_test_thermal_set(struct zen_test_thermal_params *p)
+{
+	swap(zen_freq_thermal_model, p->model);
+	swap(zen_freq_thermal_kp, p->kp);
+	swap(zen_freq_thermal_ki, p->ki);
+	swap(zen_freq_thermal_kff, p->kff);
+	swap(zen_freq_thermal_horizon_ms, p->horizon_ms);
+	swap(zen_freq_soft_temp, p->soft_temp);
+	swap(zen_freq_hard_temp, p->hard_temp);
+}
+
+/* Synthetic sensor samples and what the guard must make of them */
+struct zen_test_thermal_step {
+	u32 temp;
+	enum zen_thermal_state state;
+	u8 max_perf;
+};
+
+/*
+ * Feed one sample per step, each step_ms after the previous one.
+ * thermal_sample_ns is wound back instead of sleeping, so the model sees
+ * the trace's own time base.
+ */
+static void zen_test_thermal_run(struct kunit *test, struct zen_freq_cpu *zcpu,
+				 const struct zen_test_thermal_step *steps,
+				 unsigned int nr, unsigned int step_ms)
+{
+	unsigned int i;
+
+	for (i = 0; i < nr; i++) {
+		if (zcpu->thermal_sample_ns)
+			zcpu->thermal_sample_ns -= step_ms * NSEC_PER_MSEC;
+
+		zen_thermal_check_cpu(zcpu, steps[i].temp);
+		KUNIT_EXPECT_EQ_MSG(test, zcpu->thermal_state, steps[i].state,
+				    "step %u (%u C)", i, steps[i].temp);
+		KUNIT_EXPECT_EQ_MSG(test, zcpu->thermal_throttle_perf,
+				    steps[i].max_perf,
+				    "step %u (%u C)", i, steps[i].temp);
+	}
+}
+
+static void zen_test_thermal_pi(struct kunit *test)
+{
+	/* 1 perf level per C over the soft limit, 0.1 per C and sample */
+	struct zen_test_thermal_params p = {
+		.model		= ZEN_THERMAL_MODEL_PI,
+		.kp		= 1000,
+		.ki		= 100,
+		.kff		= ZEN_THERMAL_KFF,
+		.horizon_ms	= ZEN_THERMAL_HORIZON_MS,
+		.soft_temp	= 80,
+		.hard_temp	= 90,
+	};
+	static const struct zen_test_thermal_step trace[] = {
+		{ 70, ZEN_THERMAL_NORMAL,		255 },
+		{ 82, ZEN_THERMAL_SOFT_THROTTLE,	253 },
+		{ 85, ZEN_THERMAL_SOFT_THROTTLE,	250 },
+		{ 85, ZEN_THERMAL_SOFT_THROTTLE,	249 },	/* Integral */
+		{ 91, ZEN_THERMAL_HARD_THROTTLE,	0 },
+		{ 88, ZEN_THERMAL_HARD_THROTTLE,	0 },	/* Hysteresis */
+		{ 86, ZEN_THERMAL_SOFT_THROTTLE,	248 },
+		{ 76, ZEN_THERMAL_RECOVERY,		248 },
+		{ 78, ZEN_THERMAL_RECOVERY,		255 },
+		{ 74, ZEN_THERMAL_NORMAL,		255 },
+	};
+	struct zen_freq_cpu *zcpu = zen_test_cpu(test);
+	struct zen_freq_stats_snapshot snap;
+	unsigned int i;
+
+	zcpu->thermal_throttle_perf = 255;
+	zen_test_thermal_set(&p);
+
+	zen_test_thermal_run(test, zcpu, trace, ARRAY_SIZE(trace), 100);
+	KUNIT_EXPECT_EQ(test, zcpu->thermal_integral, 0);
+
+	/* Every limit change counts, the repeats do not */
+	zen_freq_stats_read(zcpu, &snap);
+	KUNIT_EXPECT_EQ(test, snap.thermal_events, 6);
+
+	/* A bad read is ignored */
+	zen_thermal_check_cpu(zcpu, 0);
+	KUNIT_EXPECT_EQ(test, zcpu->last_temp, 74);
+
+	/* Anti-windup: a long soak just below the hard limit saturates */
+	for (i = 0; i < 2 * ZEN_THERMAL_INTEGRAL_MAX; i++)
+		zen_thermal_check_cpu(zcpu, 89);
+	KUNIT_EXPECT_EQ(test, zcpu->thermal_integral, ZEN_THERMAL_INTEGRAL_MAX);
+	KUNIT_EXPECT_EQ(test, zcpu->thermal_throttle_perf, 255 - 9 - 100);
+
+	zen_test_thermal_set(&p);
+}
+
+static void zen_test_thermal_predictive(struct kunit *test)
+{
+	struct zen_test_thermal_params p = {
+		.model		= ZEN_THERMAL_MODEL_PREDICTIVE,
+		.kp		= 1000,
+		.ki		= 0,
+		.kff		= 30,
+		.horizon_ms	= 500,
+		.soft_temp	= 80,
+		.hard_temp	= 90,
+	};
+	/* Rising 1 C per 100 ms: 5 C ahead over the horizon */
+	static const struct zen_test_thermal_step rise[] = {
+		{ 72, ZEN_THERMAL_NORMAL,		255 },
+		{ 73, ZEN_THERMAL_NORMAL,		255 },
+		{ 74, ZEN_THERMAL_NORMAL,		255 },
+		{ 75, ZEN_THERMAL_SOFT_THROTTLE,	255 },	/* -> 80 */
+		{ 76, ZEN_THERMAL_SOFT_THROTTLE,	254 },	/* -> 81 */
+		{ 76, ZEN_THERMAL_RECOVERY,		254 },	/* -> 76 */
+	};
+	/* The same trace without the model never leaves normal */
+	static const struct zen_test_thermal_step rise_pi[] = {
+		{ 72, ZEN_THERMAL_NORMAL,		255 },
+		{ 73, ZEN_THERMAL_NORMAL,		255 },
+		{ 74, ZEN_THERMAL_NORMAL,		255 },
+		{ 75, ZEN_THERMAL_NORMAL,		255 },
+		{ 76, ZEN_THERMAL_NORMAL,		255 },
+		{ 76, ZEN_THERMAL_NORMAL,		255 },
+	};
+	/* Flat at 78 with the domain fully busy: 3 C of feed-forward */
+	static const struct zen_test_thermal_step busy[] = {
+		{ 78, ZEN_THERMAL_SOFT_THROTTLE,	254 },
+		{ 78, ZEN_THERMAL_SOFT_THROTTLE,	254 },
+	};
+	struct zen_freq_cpu *zcpu = zen_test_cpu(test);
+
+	zen_test_thermal_set(&p);
+
+	zcpu->thermal_throttle_perf = 255;
+	zen_test_thermal_run(test, zcpu, rise, ARRAY_SIZE(rise), 100);
+	KUNIT_EXPECT_EQ(test, zcpu->thermal_slope, 0);
+
+	zcpu = zen_test_cpu(test);
+	zcpu->thermal_throttle_perf = 255;
+	zen_freq_thermal_model = ZEN_THERMAL_MODEL_PI;
+	zen_test_thermal_run(test, zcpu, rise_pi, ARRAY_SIZE(rise_pi), 100);
+	KUNIT_EXPECT_EQ(test, zcpu->thermal_slope, 0);
+
+	zcpu = zen_test_cpu(test);
+	zcpu->thermal_throttle_perf = 255;
+	zcpu->thermal_ff_util = 100;
+	zen_freq_thermal_model = ZEN_THERMAL_MODEL_PREDICTIVE;
+	zen_test_thermal_run(test, zcpu, busy, ARRAY_SIZE(busy), 100);
+
+	zen_test_thermal_set(&p);
+}
+
+/* ============================================================================
+ * Dynamic EPP
+ * ============================================================================ */
+
+static void zen_test_epp_dynamic(struct kunit *test)
+{
+	unsigned long delay = msecs_to_jiffies(ZEN_EPP_LOW_UTIL_DELAY_MS);
+	struct zen_freq_cpu *zcpu = zen_test_cpu(test);
+	unsigned int mode = zen_freq_mode;
+
+	zen_freq_mode = ZEN_FREQ_MODE_BALANCE;
+
+	/* Busy: performance */
+	zen_epp_update_dynamic(zcpu, 90);
+	KUNIT_EXPECT_EQ(test, zcpu->dynamic_epp, ZEN_EPP_PERFORMANCE);
+
+	/* In between: whatever the mode asks for */
+	zen_epp_update_dynamic(zcpu, 50);
+	KUNIT_EXPECT_EQ(test, zcpu->dynamic_epp, ZEN_EPP_BALANCE);
+	zen_freq_mode = ZEN_FREQ_MODE_POWERSAVE;
+	zen_epp_update_dynamic(zcpu, 50);
+	KUNIT_EXPECT_EQ(test, zcpu->dynamic_epp, ZEN_EPP_POWERSAVE);
+	zen_freq_mode = ZEN_FREQ_MODE_PERFORMANCE;
+	zen_epp_update_dynamic(zcpu, 50);
+	KUNIT_EXPECT_EQ(test, zcpu->dynamic_epp, ZEN_EPP_PERFORMANCE);
+
+	/* Low utilization only switches to powersave once it has lasted */
+	zen_epp_update_dynamic(zcpu, 5);
+	KUNIT_EXPECT_NE(test, zcpu->util_low_since, 0);
+	KUNIT_EXPECT_EQ(test, zcpu->dynamic_epp, ZEN_EPP_PERFORMANCE);
+	zcpu->util_low_since = jiffies - delay - 1;
+	zen_epp_update_dynamic(zcpu, 5);
+	KUNIT_EXPECT_EQ(test, zcpu->dynamic_epp, ZEN_EPP_POWERSAVE);
+
+	/* Any busier sample restarts the wait */
+	zen_epp_update_dynamic(zcpu, 50);
+	KUNIT_EXPECT_EQ(test, zcpu->util_low_since, 0);
+	KUNIT_EXPECT_EQ(test, zcpu->dynamic_epp, ZEN_EPP_PERFORMANCE);
+
+	zen_freq_mode = mode;
+}
+
+/* ============================================================================
+ * Transition Hysteresis
+ * ============================================================================ */
+
+struct zen_test_hyst_params {
+	unsigned int min_residency_us;
+	unsigned int up_rate_limit_us;
+	unsigned int down_rate_limit_us;
+};
+
+static void zen_test_hyst_set(struct zen_test_hyst_params *p)
+{
+	swap(zen_freq_min_residency_us, p->min_residency_us);
+	swap(zen_freq_up_rate_limit_us, p->up_rate_limit_us);
+	swap(zen_freq_down_rate_limit_us, p->down_rate_limit_us);
+}
+
+static void zen_test_hysteresis(struct kunit *test)
+{
+	struct zen_test_hyst_params p = {
+		.min_residency_us	= 0,
+		.up_rate_limit_us	= 0,
+		.down_rate_limit_us	= USEC_PER_SEC,
+	};
+	struct zen_freq_cpu *zcpu = zen_test_cpu(test);
+	struct zen_pstate_index *index = zen_test_index(test, zcpu);
+	struct zen_freq_stats_snapshot snap;
+
+	zen_test_hyst_set(&p);
+
+	/* Raises are granted at once */
+	zcpu->hyst_pos = 2;
+	KUNIT_EXPECT_EQ(test, zen_freq_hysteresis(zcpu, index, 4), 4);
+	KUNIT_EXPECT_EQ(test, zcpu->hyst_pos, 4);
+
+	/* A drop is held until it has persisted for the down rate limit */
+	KUNIT_EXPECT_EQ(test, zen_freq_hysteresis(zcpu, index, 1), 4);
+	KUNIT_EXPECT_NE(test, zcpu->hyst_down_since_ns, 0);
+	KUNIT_EXPECT_EQ(test, zen_freq_hysteresis(zcpu, index, 1), 4);
+
+	/* Asking for the current slot again cancels the pending drop */
+	KUNIT_EXPECT_EQ(test, zen_freq_hysteresis(zcpu, index, 4), 4);
+	KUNIT_EXPECT_EQ(test, zcpu->hyst_down_since_ns, 0);
+
+	/* Once it has persisted long enough it is taken */
+	KUNIT_EXPECT_EQ(test, zen_freq_hysteresis(zcpu, index, 1), 4);
+	zcpu->hyst_down_since_ns -= 2ULL * NSEC_PER_SEC;
+	KUNIT_EXPECT_EQ(test, zen_freq_hysteresis(zcpu, index, 1), 1);
+	KUNIT_EXPECT_EQ(test, zcpu->hyst_down_since_ns, 0);
+
+	/* A predicted trough skips the hold */
+	zcpu->hyst_pos = 3;
+	zcpu->phase.trough = true;
+	KUNIT_EXPECT_EQ(test, zen_freq_hysteresis(zcpu, index, 0), 0);
+	zcpu->phase.trough = false;
+
+	/* An up rate limit holds back a raise right after a change */
+	zen_freq_up_rate_limit_us = USEC_PER_SEC;
+	KUNIT_EXPECT_EQ(test, zen_freq_hysteresis(zcpu, index, 2), 0);
+
+	zen_test_hyst_set(&p);
+
+	zen_freq_stats_read(zcpu, &snap);
+	KUNIT_EXPECT_EQ(test, snap.suppressed_up, 1);
+	KUNIT_EXPECT_EQ(test, snap.suppressed_down, 3);
+
+	kfree(index);
+}
+
+/* ============================================================================
+ * uclamp Aggregation
+ * ============================================================================ */
+
+static void zen_test_thread_set(struct zen_freq_thread *thr, u64 time,
+				u32 util, u8 lo, u8 hi, bool busy)
+{
+	thr->sample_ns = time;
+	thr->util = util;
+	thr->uclamp_min = lo;
+	thr->uclamp_max = hi;
+	thr->busy = busy;
+}
+
+static void zen_test_uclamp_idle_sibling(struct kunit *test)
+{
+	struct zen_freq_cpu *zcpu = zen_test_cpu(test);
+	struct zen_freq_thread __percpu *threads;
+	struct zen_freq_thread *a, *b;
+	unsigned int cpu_a, cpu_b;
+	u64 t = NSEC_PER_SEC;
+
+	/* Private per-CPU state, so the live hooks are left alone */
+	cpu_a = cpumask_first(cpu_possible_mask);
+	cpu_b = cpumask_next(cpu_a, cpu_possible_mask);
+	if (cpu_b >= nr_cpu_ids)
+		kunit_skip(test, "needs two possible CPUs");
+
+	threads = alloc_percpu(struct zen_freq_thread);
+	KUNIT_ASSERT_NOT_NULL(test, threads);
+	a = per_cpu_ptr(threads, cpu_a);
+	b = per_cpu_ptr(threads, cpu_b);
+	cpumask_set_cpu(cpu_a, &zcpu->domain_cpus);
+	cpumask_set_cpu(cpu_b, &zcpu->domain_cpus);
+
+	/* A batch task capped at half speed, its sibling idle */
+	zen_test_thread_set(a, t, 100, 0, 128, true);
+	zen_test_thread_set(b, t, 0, 0, 255, false);
+	KUNIT_EXPECT_EQ(test, zen_freq_domain_clamp(zcpu, threads, t), 50);
+	KUNIT_EXPECT_EQ(test, zcpu->uclamp_max_perf, 128);
+	KUNIT_EXPECT_EQ(test, zcpu->uclamp_min_perf, 0);
+
+	/* A busy, uncapped sibling does lift the cap, but not the util */
+	zen_test_thread_set(b, t, 20, 0, 255, true);
+	KUNIT_EXPECT_EQ(test, zen_freq_domain_clamp(zcpu, threads, t), 50);
+	KUNIT_EXPECT_EQ(test, zcpu->uclamp_max_perf, 255);
+
+	/* Its busy hint goes stale once its tick stops */
+	KUNIT_EXPECT_EQ(test, zen_freq_domain_clamp(zcpu, threads,
+						    t + ZEN_UTIL_STALE_NS + 1), 0);
+	b->sample_ns = t - ZEN_UTIL_STALE_NS - 1;
+	KUNIT_EXPECT_EQ(test, zen_freq_domain_clamp(zcpu, threads, t), 50);
+	KUNIT_EXPECT_EQ(test, zcpu->uclamp_max_perf, 128);
+
+	/* A floor raises its own thread's util and the domain floor */
+	zen_test_thread_set(b, t, 20, 200, 255, true);
+	KUNIT_EXPECT_EQ(test, zen_freq_domain_clamp(zcpu, threads, t), 78);
+	KUNIT_EXPECT_EQ(test, zcpu->uclamp_min_perf, 200);
+
+	/* Nothing busy: nothing to cap */
+	zen_test_thread_set(a, t, 5, 0, 255, false);
+	zen_test_thread_set(b, t, 5, 0, 255, false);
+	KUNIT_EXPECT_EQ(test, zen_freq_domain_clamp(zcpu, threads, t), 5);
+	KUNIT_EXPECT_EQ(test, zcpu->uclamp_max_perf, 255);
+
+	free_percpu(threads);
+}
+
+/* ============================================================================
+ * I/O Boost
+ * ============================================================================ */
+
+static void zen_test_io_boost_ramp(struct kunit *test)
+{
+	u64 hold = (u64)zen_freq_io_boost_hold_ms * NSEC_PER_MSEC;
+	u64 duration = (u64)zen_freq_io_boost_duration_ms * NSEC_PER_MSEC;
+	struct zen_freq_cpu *zcpu = zen_test_cpu(test);
+	struct zen_freq_stats_snapshot snap;
+	bool enabled = zen_freq_io_boost_enabled;
+	u64 t = NSEC_PER_SEC;
+
+	zen_freq_io_boost_enabled = true;
+
+	/* Ordinary updates never boost */
+	zen_io_boost_update(zcpu, t, 0);
+	KUNIT_EXPECT_EQ(test, zcpu->io_boost_level, 0);
+
+	/* Each iowait wakeup, the owner's or a sibling's, doubles the floor */
+	zen_io_boost_update(zcpu, t, SCHED_CPUFREQ_IOWAIT);
+	KUNIT_EXPECT_EQ(test, zcpu->io_boost_level, ZEN_IO_BOOST_MIN_PERF);
+	KUNIT_EXPECT_TRUE(test, zcpu->io_boost_active);
+	t += NSEC_PER_MSEC;
+	zen_io_boost_update(zcpu, t, zen_freq_domain_iowait(zcpu, SCHED_CPUFREQ_IOWAIT));
+	KUNIT_EXPECT_EQ(test, zcpu->io_boost_level, 2 * ZEN_IO_BOOST_MIN_PERF);
+	zen_io_boost_update(zcpu, t, SCHED_CPUFREQ_IOWAIT);
+	zen_io_boost_update(zcpu, t, SCHED_CPUFREQ_IOWAIT);
+	zen_io_boost_update(zcpu, t, SCHED_CPUFREQ_IOWAIT);
+	KUNIT_EXPECT_EQ(test, zcpu->io_boost_level, ZEN_IO_BOOST_MAX_PERF);
+
+	/* Held for the hold period, then halved */
+	zen_io_boost_update(zcpu, t + hold, 0);
+	KUNIT_EXPECT_EQ(test, zcpu->io_boost_level, ZEN_IO_BOOST_MAX_PERF);
+	t += hold + 1;
+	zen_io_boost_update(zcpu, t, 0);
+	KUNIT_EXPECT_EQ(test, zcpu->io_boost_level, ZEN_IO_BOOST_MAX_PERF >> 1);
+
+	/* A wakeup after a long pause restarts the ramp */
+	t += duration + 1;
+	zen_io_boost_update(zcpu, t, SCHED_CPUFREQ_IOWAIT);
+	KUNIT_EXPECT_EQ(test, zcpu->io_boost_level, ZEN_IO_BOOST_MIN_PERF);
+
+	/* Quiet for longer than the duration drops it */
+	t += duration + 1;
+	zen_io_boost_update(zcpu, t, 0);
+	KUNIT_EXPECT_EQ(test, zcpu->io_boost_level, 0);
+	KUNIT_EXPECT_FALSE(test, zcpu->io_boost_active);
+
+	/* The knob turns it off outright */
+	zen_freq_io_boost_enabled = false;
+	zen_io_boost_update(zcpu, t, SCHED_CPUFREQ_IOWAIT);
+	KUNIT_EXPECT_EQ(test, zcpu->io_boost_level, 0);
+
+	zen_freq_io_boost_enabled = enabled;
+
+	/* Counted once per rise from zero; the restart began while boosted */
+	zen_freq_stats_read(zcpu, &snap);
+	KUNIT_EXPECT_EQ(test, snap.io_boosts, 1);
+}
+
+/* ============================================================================
+ * Workload Phase Detector
+ * ============================================================================ */
+
+static void zen_test_phase_flat(struct kunit *test)
+{
+	struct zen_freq_cpu *zcpu = zen_test_cpu(test);
+	unsigned int i;
+
+	for (i = 1; i <= 4 * ZEN_PHASE_RING_SIZE; i++)
+		zen_phase_sample(zcpu, 40, i * ZEN_PHASE_SAMPLE_NS);
+
+	KUNIT_EXPECT_EQ(test, zcpu->phase.period, 0);
+	KUNIT_EXPECT_EQ(test, zcpu->phase.pred, ZEN_PHASE_NO_PRED);
+	KUNIT_EXPECT_EQ(test, zcpu->phase.floor_perf, 0);
+}
+
+static void zen_test_phase_period(struct kunit *test)
+{
+	struct zen_freq_cpu *zcpu = zen_test_cpu(test);
+	struct zen_freq_stats_snapshot snap;
+	unsigned int i;
+
+	/* 8 ms busy, 8 ms idle: a 16 ms (8 sample) period */
+	for (i = 1; i <= 4 * ZEN_PHASE_RING_SIZE; i++)
+		zen_phase_sample(zcpu, (i & 7) < 4 ? 90 : 10,
+				 i * ZEN_PHASE_SAMPLE_NS);
+
+	KUNIT_EXPECT_EQ(test, zcpu->phase.period, 8);
+	KUNIT_EXPECT_GE(test, zcpu->phase.confidence, ZEN_PHASE_CONF_MIN);
+
+	/* The next sample, i & 7 == 1, is predicted from one period back */
+	KUNIT_EXPECT_EQ(test, zcpu->phase.pred, 90);
+
+	/* A perfectly periodic load is predicted right every time */
+	zen_freq_stats_read(zcpu, &snap);
+	KUNIT_EXPECT_GT(test, snap.phase_predictions, 0);
+	KUNIT_EXPECT_EQ(test, snap.phase_hits, snap.phase_predictions);
+}
+
+static void zen_test_phase_ring(struct kunit *test)
+{
+	struct zen_freq_cpu *zcpu = zen_test_cpu(test);
+	unsigned int i;
+
+	zen_phase_sample(zcpu, 20, ZEN_PHASE_SAMPLE_NS);
+	KUNIT_EXPECT_EQ(test, zcpu->phase.head, 1);
+
+	/* A second caller in the same slot does not sample */
+	zen_phase_sample(zcpu, 80, ZEN_PHASE_SAMPLE_NS + 1);
+	KUNIT_EXPECT_EQ(test, zcpu->phase.head, 1);
+
+	/* Slots nobody sampled are filled with the new value */
+	zen_phase_sample(zcpu, 60, 6 * ZEN_PHASE_SAMPLE_NS);
+	KUNIT_EXPECT_EQ(test, zcpu->phase.head, 6);
+	KUNIT_EXPECT_EQ(test, zcpu->phase.ring[0], 20);
+	for (i = 1; i < 6; i++)
+		KUNIT_EXPECT_EQ(test, zcpu->phase.ring[i], 60);
+
+	/* A gap longer than the ring refills it once, not repeatedly */
+	zen_phase_sample(zcpu, 30, 1000 * ZEN_PHASE_SAMPLE_NS);
+	KUNIT_EXPECT_EQ(test, zcpu->phase.head, 6 + ZEN_PHASE_RING_SIZE);
+	for (i = 0; i < ZEN_PHASE_RING_SIZE; i++)
+		KUNIT_EXPECT_EQ(test, zcpu->phase.ring[i], 30);
+}
+
+static struct kunit_case zen_freq_test_cases[] = {
+	KUNIT_CASE(zen_test_index_floor),
+	KUNIT_CASE(zen_test_index_ceil),
+	KUNIT_CASE(zen_test_index_unsafe),
+	KUNIT_CASE(zen_test_vid_svi2),
+	KUNIT_CASE(zen_test_vid_svi3),
+	KUNIT_CASE(zen_test_vid_extract),
+	KUNIT_CASE(zen_test_freq_from_pstate),
+	KUNIT_CASE(zen_test_perf_freq),
+	KUNIT_CASE(zen_test_thread_sample),
+	KUNIT_CASE(zen_test_effective_freq),
+	KUNIT_CASE(zen_test_thermal_pi),
+	KUNIT_CASE(zen_test_thermal_predictive),
+	KUNIT_CASE(zen_test_epp_dynamic),
+	KUNIT_CASE(zen_test_hysteresis),
+	KUNIT_CASE(zen_test_uclamp_idle_sibling),
+	KUNIT_CASE(zen_test_io_boost_ramp),
+	KUNIT_CASE(zen_test_phase_flat),
+	KUNIT_CASE(zen_test_phase_period),
+	KUNIT_CASE(zen_test_phase_ring),
+	{}
+};
+
+static struct kunit_suite zen_freq_test_suite = {
+	.name = "zen_freq",
+	.test_cases = zen_freq_test_cases,
+};
+
+kunit_test_suite(zen_freq_test_suite);
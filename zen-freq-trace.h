@@ -0,0 +1,195 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * zen-freq-trace.h - Tracepoints for the zen-freq driver
+ *
+ * Copyright (C) 2024
+ * Author: zen-freq development team
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM zen_freq
+
+#if !defined(_ZEN_FREQ_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _ZEN_FREQ_TRACE_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(zen_thermal_controller,
+
+	TP_PROTO(unsigned int cpu, unsigned int model, u32 temp, s32 slope,
+		 u32 util, u32 ctrl_temp, unsigned int state, u8 max_perf),
+
+	TP_ARGS(cpu, model, temp, slope, util, ctrl_temp, state, max_perf),
+
+	TP_STRUCT__entry(
+		__field(unsigned int,	cpu)
+		__field(unsigned int,	model)
+		__field(u32,		temp)
+		__field(s32,		slope)
+		__field(u32,		util)
+		__field(u32,		ctrl_temp)
+		__field(unsigned int,	state)
+		__field(u8,		max_perf)
+	),
+
+	TP_fast_assign(
+		__entry->cpu		= cpu;
+		__entry->model		= model;
+		__entry->temp		= temp;
+		__entry->slope		= slope;
+		__entry->util		= util;
+		__entry->ctrl_temp	= ctrl_temp;
+		__entry->state		= state;
+		__entry->max_perf	= max_perf;
+	),
+
+	TP_printk("cpu=%u model=%s temp=%u slope=%d util=%u ctrl_temp=%u state=%u max_perf=%u",
+		  __entry->cpu,
+		  __entry->model ? "predictive" : "pi",
+		  __entry->temp, __entry->slope, __entry->util,
+		  __entry->ctrl_temp, __entry->state, __entry->max_perf)
+);
+
+TRACE_EVENT(zen_freq_fast_switch,
+
+	TP_PROTO(unsigned int cpu, unsigned int target_freq, unsigned int freq,
+		 unsigned int pstate, u8 thermal_cap, bool io_boost,
+		 u64 latency_ns),
+
+	TP_ARGS(cpu, target_freq, freq, pstate, thermal_cap, io_boost,
+		latency_ns),
+
+	TP_STRUCT__entry(
+		__field(unsigned int,	cpu)
+		__field(unsigned int,	target_freq)
+		__field(unsigned int,	freq)
+		__field(unsigned int,	pstate)
+		__field(u8,		thermal_cap)
+		__field(bool,		io_boost)
+		__field(u64,		latency_ns)
+	),
+
+	TP_fast_assign(
+		__entry->cpu		= cpu;
+		__entry->target_freq	= target_freq;
+		__entry->freq		= freq;
+		__entry->pstate		= pstate;
+		__entry->thermal_cap	= thermal_cap;
+		__entry->io_boost	= io_boost;
+		__entry->latency_ns	= latency_ns;
+	),
+
+	TP_printk("cpu=%u target=%u freq=%u pstate=%u thermal_cap=%u io_boost=%d latency_ns=%llu",
+		  __entry->cpu, __entry->target_freq, __entry->freq,
+		  __entry->pstate, __entry->thermal_cap, __entry->io_boost,
+		  __entry->latency_ns)
+);
+
+TRACE_EVENT(zen_thermal_state,
+
+	TP_PROTO(unsigned int cpu, u32 temp, unsigned int old_state,
+		 unsigned int new_state, u8 max_perf),
+
+	TP_ARGS(cpu, temp, old_state, new_state, max_perf),
+
+	TP_STRUCT__entry(
+		__field(unsigned int,	cpu)
+		__field(u32,		temp)
+		__field(unsigned int,	old_state)
+		__field(unsigned int,	new_state)
+		__field(u8,		max_perf)
+	),
+
+	TP_fast_assign(
+		__entry->cpu		= cpu;
+		__entry->temp		= temp;
+		__entry->old_state	= old_state;
+		__entry->new_state	= new_state;
+		__entry->max_perf	= max_perf;
+	),
+
+	TP_printk("cpu=%u temp=%u state=%u->%u max_perf=%u",
+		  __entry->cpu, __entry->temp, __entry->old_state,
+		  __entry->new_state, __entry->max_perf)
+);
+
+TRACE_EVENT(zen_power_guard,
+
+	TP_PROTO(unsigned int pkg, u32 power_mw, u32 limit_mw, u8 max_perf),
+
+	TP_ARGS(pkg, power_mw, limit_mw, max_perf),
+
+	TP_STRUCT__entry(
+		__field(unsigned int,	pkg)
+		__field(u32,		power_mw)
+		__field(u32,		limit_mw)
+		__field(u8,		max_perf)
+	),
+
+	TP_fast_assign(
+		__entry->pkg		= pkg;
+		__entry->power_mw	= power_mw;
+		__entry->limit_mw	= limit_mw;
+		__entry->max_perf	= max_perf;
+	),
+
+	TP_printk("pkg=%u power=%umW limit=%umW max_perf=%u",
+		  __entry->pkg, __entry->power_mw, __entry->limit_mw,
+		  __entry->max_perf)
+);
+
+TRACE_EVENT(zen_io_boost,
+
+	TP_PROTO(unsigned int cpu, u8 old_level, u8 new_level),
+
+	TP_ARGS(cpu, old_level, new_level),
+
+	TP_STRUCT__entry(
+		__field(unsigned int,	cpu)
+		__field(u8,		old_level)
+		__field(u8,		new_level)
+	),
+
+	TP_fast_assign(
+		__entry->cpu		= cpu;
+		__entry->old_level	= old_level;
+		__entry->new_level	= new_level;
+	),
+
+	TP_printk("cpu=%u level=%u->%u", __entry->cpu,
+		  __entry->old_level, __entry->new_level)
+);
+
+TRACE_EVENT(zen_epp_update,
+
+	TP_PROTO(unsigned int cpu, u32 util, u8 old_epp, u8 new_epp),
+
+	TP_ARGS(cpu, util, old_epp, new_epp),
+
+	TP_STRUCT__entry(
+		__field(unsigned int,	cpu)
+		__field(u32,		util)
+		__field(u8,		old_epp)
+		__field(u8,		new_epp)
+	),
+
+	TP_fast_assign(
+		__entry->cpu		= cpu;
+		__entry->util		= util;
+		__entry->old_epp	= old_epp;
+		__entry->new_epp	= new_epp;
+	),
+
+	TP_printk("cpu=%u util=%u epp=%#x->%#x",
+		  __entry->cpu, __entry->util, __entry->old_epp,
+		  __entry->new_epp)
+);
+
+#endif /* _ZEN_FREQ_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE zen-freq-trace
+
+#include <trace/define_trace.h>
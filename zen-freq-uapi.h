@@ -0,0 +1,79 @@
+/* SPDX-License-Identifier: GPL-2.0-only WITH Linux-syscall-note */
+/*
+ * zen-freq-uapi.h - Userspace ABI of the zen-freq driver
+ *
+ * Shared by the driver and by tooling that drives /dev/zen_freq or reads
+ * /sys/kernel/zen_freq/residency. Only fixed-width __u32/__u64 types are
+ * used, so the layout is the same for 32-bit and 64-bit callers.
+ *
+ * Copyright (C) 2024
+ * Author: zen-freq development team
+ */
+
+#ifndef _UAPI_ZEN_FREQ_H
+#define _UAPI_ZEN_FREQ_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+/* ============================================================================
+ * Userspace Request Channel
+ * ============================================================================ */
+
+/*
+ * In userspace mode /dev/zen_freq carries per-CPU perf requests. The
+ * device maps an array of struct zen_freq_user_slot indexed by CPU number,
+ * one cache line per CPU so writers never share a line. Storing a perf
+ * level (1-255) into slot[cpu].perf is the whole request; 0 withdraws it
+ * and lets the scheduler's target through again. The owning CPU picks the
+ * value up on its next frequency update. ZEN_FREQ_IOC_SET_PERF writes the
+ * same slot for callers that cannot mmap.
+ */
+#define ZEN_USER_SLOT_SIZE              64
+
+struct zen_freq_user_slot {
+        __u32                   perf;
+        __u32                   pad[ZEN_USER_SLOT_SIZE / sizeof(__u32) - 1];
+};
+
+/**
+ * struct zen_freq_user_req - ZEN_FREQ_IOC_SET_PERF argument
+ * @cpu:                Target CPU
+ * @perf:               Requested perf level (0-255, 0 = none)
+ */
+struct zen_freq_user_req {
+        __u32                   cpu;
+        __u32                   perf;
+};
+
+#define ZEN_FREQ_IOC_MAGIC              'z'
+#define ZEN_FREQ_IOC_SET_PERF           _IOW(ZEN_FREQ_IOC_MAGIC, 1, struct zen_freq_user_req)
+
+/* ============================================================================
+ * Residency Snapshot
+ * ============================================================================ */
+
+/* P-state slots in every record, used or not */
+#define ZEN_FREQ_RESIDENCY_PSTATES      8
+
+/**
+ * struct zen_freq_residency_record - One domain in the sysfs residency snapshot
+ * @cpu:                First CPU of the frequency domain
+ * @nr_pstates:         Valid entries in @freq, @time_ns and each @trans row
+ * @freq:               Frequency of each P-state entry (kHz)
+ * @time_ns:            Residency per entry, including the current stay
+ * @trans:              Transition counts, [from][to]
+ *
+ * /sys/kernel/zen_freq/residency is a packed array of these, one per
+ * domain, in CPU order. The layout is fixed so tooling can read
+ * it without parsing text.
+ */
+struct zen_freq_residency_record {
+        __u32                   cpu;
+        __u32                   nr_pstates;
+        __u32                   freq[ZEN_FREQ_RESIDENCY_PSTATES];
+        __u64                   time_ns[ZEN_FREQ_RESIDENCY_PSTATES];
+        __u64                   trans[ZEN_FREQ_RESIDENCY_PSTATES][ZEN_FREQ_RESIDENCY_PSTATES];
+};
+
+#endif /* _UAPI_ZEN_FREQ_H */
@@ -41,7 +41,21 @@
 #include <linux/sched/clock.h>
 #include <linux/rcupdate.h>
 #include <linux/atomic.h>
-#include <linux/freezer.h>
+#include <linux/topology.h>
+#include <linux/irq_work.h>
+#include <linux/u64_stats_sync.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/jhash.h>
+#include <linux/sort.h>
+#include <linux/energy_model.h>
+#include <linux/miscdevice.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/uaccess.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 2, 0)
+#include <kunit/static_stub.h>
+#endif
 
 #include <asm/msr.h>
 #include <asm/processor.h>
@@ -49,24 +63,45 @@
 #include <asm/cpu_device_id.h>
 #include <asm/msr-index.h>
 #include <asm/io.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 15, 0)
+#include <asm/amd/node.h>
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(6, 14, 0)
+#include <asm/amd_node.h>
+#else
+#include <asm/amd_nb.h>
+#endif
 
 #include "zen-freq.h"
 
+#define CREATE_TRACE_POINTS
+#include "zen-freq-trace.h"
+
 /* ============================================================================
  * Kernel Version Compatibility
  * ============================================================================ */
 
+/* Before 6.2 there is no shutdown state; the should_run flags stop re-arming */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 2, 0)
+#define timer_shutdown_sync(timer)	del_timer_sync(timer)
+#endif
+
+/* No static stubs before 6.2; the KUnit MSR fakes need them */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 2, 0)
+#define KUNIT_STATIC_STUB_REDIRECT(real_fn_name, args...) do { } while (0)
+#endif
+
 /*
- * Kernel 6.6+ changed the cpufreq_update_util callback API:
- * - Old: callback(policy, struct cpufreq_update_util_data*, flags)
- * - New: callback(policy, util, max, flags) or uses sugov callbacks
- *
- * We detect and handle both cases.
+ * sched_set_itmt_*() are not exported, so a module cannot publish ITMT
+ * priorities; only the built-in driver does. The ranking and the boost
+ * reservation work either way.
  */
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 6, 0)
-#define ZEN_USE_NEW_UTIL_API	1
-#else
-#define ZEN_USE_NEW_UTIL_API	0
+#if IS_BUILTIN(CONFIG_X86_ZEN_FREQ) && defined(CONFIG_SCHED_MC_PRIO)
+#define ZEN_FREQ_ITMT
+#endif
+
+/* The node id moved into the topology info when amd_get_nb_id() went away */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 7, 0)
+#define topology_amd_node_id(cpu)	amd_get_nb_id(cpu)
 #endif
 
 /* ============================================================================
@@ -88,7 +123,7 @@ MODULE_LICENSE("GPL");
 
 unsigned int zen_freq_mode = ZEN_FREQ_MODE_BALANCE;
 module_param_named(mode, zen_freq_mode, uint, 0644);
-MODULE_PARM_DESC(mode, "Operating mode: 0=powersave, 1=balance, 2=performance, 3=userspace");
+MODULE_PARM_DESC(mode, "Operating mode: 0=powersave, 1=balance, 2=performance, 3=userspace, 4=efficient (needs native_governor=1)");
 
 bool zen_freq_boost_enabled = true;
 module_param_named(boost, zen_freq_boost_enabled, bool, 0644);
@@ -106,10 +141,66 @@ bool zen_freq_epp_enabled = true;
 module_param_named(epp, zen_freq_epp_enabled, bool, 0644);
 MODULE_PARM_DESC(epp, "Enable EPP control");
 
+bool zen_freq_io_boost_enabled = true;
+module_param_named(io_boost, zen_freq_io_boost_enabled, bool, 0644);
+MODULE_PARM_DESC(io_boost, "Boost on iowait wakeups (SCHED_CPUFREQ_IOWAIT)");
+
+unsigned int zen_freq_io_boost_duration_ms = ZEN_IO_BOOST_DURATION_MS;
+module_param_named(io_boost_duration_ms, zen_freq_io_boost_duration_ms, uint, 0644);
+MODULE_PARM_DESC(io_boost_duration_ms, "Drop I/O boost after this long without iowait (ms)");
+
+unsigned int zen_freq_io_boost_hold_ms = ZEN_IO_BOOST_HOLD_MS;
+module_param_named(io_boost_hold_ms, zen_freq_io_boost_hold_ms, uint, 0644);
+MODULE_PARM_DESC(io_boost_hold_ms, "Hold each I/O boost level this long before halving it (ms)");
+
 bool zen_freq_thermal_guard = true;
 module_param_named(thermal_guard, zen_freq_thermal_guard, bool, 0644);
 MODULE_PARM_DESC(thermal_guard, "Enable thermal guard with PI controller");
 
+bool zen_freq_thermal_adaptive = true;
+module_param_named(thermal_adaptive, zen_freq_thermal_adaptive, bool, 0644);
+MODULE_PARM_DESC(thermal_adaptive, "Adapt thermal sampling rate to the distance from the soft limit");
+
+unsigned int zen_freq_thermal_model = ZEN_THERMAL_MODEL_PI;
+module_param_named(thermal_model, zen_freq_thermal_model, uint, 0644);
+MODULE_PARM_DESC(thermal_model, "Thermal controller: 0=pi, 1=predictive (feed-forward util + dT/dt)");
+
+unsigned int zen_freq_thermal_kp = ZEN_THERMAL_KP;
+module_param_named(thermal_kp, zen_freq_thermal_kp, uint, 0644);
+MODULE_PARM_DESC(thermal_kp, "Thermal PI proportional gain (scaled by 1000)");
+
+unsigned int zen_freq_thermal_ki = ZEN_THERMAL_KI;
+module_param_named(thermal_ki, zen_freq_thermal_ki, uint, 0644);
+MODULE_PARM_DESC(thermal_ki, "Thermal PI integral gain (scaled by 1000)");
+
+unsigned int zen_freq_thermal_kff = ZEN_THERMAL_KFF;
+module_param_named(thermal_kff, zen_freq_thermal_kff, uint, 0644);
+MODULE_PARM_DESC(thermal_kff, "Predictive model utilization feed-forward (m°C per % util)");
+
+unsigned int zen_freq_thermal_horizon_ms = ZEN_THERMAL_HORIZON_MS;
+module_param_named(thermal_horizon_ms, zen_freq_thermal_horizon_ms, uint, 0644);
+MODULE_PARM_DESC(thermal_horizon_ms, "Predictive model dT/dt look-ahead in ms");
+
+unsigned int zen_freq_em_capacitance_pf = ZEN_EM_CAPACITANCE_PF;
+module_param_named(em_capacitance_pf, zen_freq_em_capacitance_pf, uint, 0444);
+MODULE_PARM_DESC(em_capacitance_pf, "Per-core switched capacitance for the energy model (pF)");
+
+bool zen_freq_calibrate = false;
+module_param_named(calibrate, zen_freq_calibrate, bool, 0444);
+MODULE_PARM_DESC(calibrate, "Measure P-state transition latency at load and report it to cpufreq");
+
+unsigned int zen_freq_min_residency_us = ZEN_HYST_MIN_RESIDENCY_US;
+module_param_named(min_residency_us, zen_freq_min_residency_us, uint, 0644);
+MODULE_PARM_DESC(min_residency_us, "Minimum time in a P-state before stepping down (us)");
+
+unsigned int zen_freq_up_rate_limit_us = ZEN_HYST_UP_RATE_LIMIT_US;
+module_param_named(up_rate_limit_us, zen_freq_up_rate_limit_us, uint, 0644);
+MODULE_PARM_DESC(up_rate_limit_us, "Minimum time between P-state raises (us, 0=immediate)");
+
+unsigned int zen_freq_down_rate_limit_us = ZEN_HYST_DOWN_RATE_LIMIT_US;
+module_param_named(down_rate_limit_us, zen_freq_down_rate_limit_us, uint, 0644);
+MODULE_PARM_DESC(down_rate_limit_us, "How long a lower request must persist before stepping down (us)");
+
 unsigned int zen_freq_soft_temp = ZEN_THERMAL_SOFT_LIMIT;
 module_param_named(soft_temp, zen_freq_soft_temp, uint, 0644);
 MODULE_PARM_DESC(soft_temp, "Soft thermal limit in Celsius (throttling begins)");
@@ -122,6 +213,38 @@ unsigned int zen_freq_voltage_max = ZEN_VOLTAGE_MAX_SAFE;
 module_param_named(voltage_max, zen_freq_voltage_max, uint, 0644);
 MODULE_PARM_DESC(voltage_max, "Maximum safe voltage in mV (default: 1450)");
 
+bool zen_freq_cppc = false;
+module_param_named(cppc, zen_freq_cppc, bool, 0444);
+MODULE_PARM_DESC(cppc, "Drive CPPC_REQ (desired/min/max perf + EPP) instead of P-states");
+
+bool zen_freq_prefcore = true;
+module_param_named(prefcore, zen_freq_prefcore, bool, 0444);
+MODULE_PARM_DESC(prefcore, "Steer the top boost P-state to the highest-ranked cores");
+
+unsigned int zen_freq_boost_credits = 0;
+module_param_named(boost_credits, zen_freq_boost_credits, uint, 0644);
+MODULE_PARM_DESC(boost_credits, "Max cores per package in boost P-states at once (0=unlimited)");
+
+bool zen_freq_native_governor = false;
+module_param_named(native_governor, zen_freq_native_governor, bool, 0644);
+MODULE_PARM_DESC(native_governor, "Pick the P-state from the util hook instead of waiting for a governor");
+
+bool zen_freq_phase_predict = false;
+module_param_named(phase_predict, zen_freq_phase_predict, bool, 0644);
+MODULE_PARM_DESC(phase_predict, "Pre-raise ahead of predicted bursts and drop early in predicted troughs");
+
+unsigned int zen_freq_power_limit_w = 0;
+module_param_named(power_limit_w, zen_freq_power_limit_w, uint, 0644);
+MODULE_PARM_DESC(power_limit_w, "Per-package power cap from RAPL in watts (0=off)");
+
+unsigned int zen_freq_power_kp = ZEN_POWER_KP;
+module_param_named(power_kp, zen_freq_power_kp, uint, 0644);
+MODULE_PARM_DESC(power_kp, "Power PI proportional gain, perf per watt (scaled by 1000)");
+
+unsigned int zen_freq_power_ki = ZEN_POWER_KI;
+module_param_named(power_ki, zen_freq_power_ki, uint, 0644);
+MODULE_PARM_DESC(power_ki, "Power PI integral gain, perf per watt-sample (scaled by 1000)");
+
 /* ============================================================================
  * Global Driver State
  * ============================================================================ */
@@ -133,90 +256,385 @@ static struct zen_freq_driver zfreq_driver = {
 	.features = 0,
 };
 
-static DEFINE_PER_CPU(struct zen_freq_cpu *, zfreq_cpu_data);
+static DEFINE_PER_CPU(struct zen_freq_cpu __rcu *, zfreq_cpu_data);
+static DEFINE_PER_CPU(struct zen_freq_thread, zfreq_thread);
+static DEFINE_PER_CPU(bool, zfreq_pstate_defs_match);
 static DEFINE_MUTEX(zfreq_driver_mutex);
 
+/* Userspace request page, NULL until /dev/zen_freq is registered */
+static struct zen_freq_user_slot *zfreq_user_slots;
+
+static inline bool zen_cppc_active(void)
+{
+	return zfreq_driver.features & ZEN_FEAT_FAST_CPPC;
+}
+
+/*
+ * Per-policy init sets the same bits on every CPU; only write when one is
+ * missing so hotplug on one socket does not bounce the fast path's
+ * features line on the other.
+ */
+static inline void zen_freq_feature_set(u32 feat)
+{
+	if ((READ_ONCE(zfreq_driver.features) & feat) != feat)
+		zfreq_driver.features |= feat;
+}
+
+/*
+ * ->init publishes a domain's zen_freq_cpu on each of its threads and
+ * ->exit clears it and waits for a grace period before freeing it. The
+ * timers and the sysfs/debugfs walkers run outside the policy lock and
+ * look it up under rcu_read_lock(); policy callbacks and hotplug, which
+ * cannot race with ->exit, use zen_freq_cpu_get().
+ */
+static inline struct zen_freq_cpu *zen_freq_cpu_rcu(unsigned int cpu)
+{
+	return rcu_dereference(per_cpu(zfreq_cpu_data, cpu));
+}
+
+static inline struct zen_freq_cpu *zen_freq_cpu_get(unsigned int cpu)
+{
+	return rcu_dereference_protected(per_cpu(zfreq_cpu_data, cpu), true);
+}
+
+/*
+ * One zen_freq_cpu is shared by every logical CPU of a frequency domain;
+ * per-CPU iterators use this to visit each domain once.
+ */
+static inline bool zen_freq_domain_leader(struct zen_freq_cpu *zcpu,
+					  unsigned int cpu)
+{
+	return cpu == cpumask_first(&zcpu->domain_cpus);
+}
+
 /* ============================================================================
  * MSR Access Functions - Zero IPI Implementation
  * ============================================================================ */
 
+/**
+ * zen_freq_stats_account - Account a P-state change on the owning CPU
+ * @zcpu:	Per-CPU data, with cur_pstate already written to hardware
+ *
+ * Charges the time spent in the previous P-state to total_time_ns and its
+ * time_in_state slot, and counts the from->to transition.
+ */
+static void zen_freq_stats_account(struct zen_freq_cpu *zcpu)
+{
+	unsigned int prev = zcpu->stats_pstate, cur = zcpu->cur_pstate;
+	u64 now = sched_clock();
+
+	u64_stats_update_begin(&zcpu->stats.syncp);
+	if (prev < ZEN_MAX_PSTATES) {
+		u64_stats_add(&zcpu->stats.total_time_ns,
+			      now - zcpu->stats_since_ns);
+		u64_stats_add(&zcpu->stats.time_in_state[prev],
+			      now - zcpu->stats_since_ns);
+		if (cur < ZEN_MAX_PSTATES)
+			u64_stats_inc(&zcpu->stats.trans[prev][cur]);
+	}
+	u64_stats_inc(&zcpu->stats.transitions);
+	u64_stats_update_end(&zcpu->stats.syncp);
+
+	WRITE_ONCE(zcpu->stats_since_ns, now);
+	WRITE_ONCE(zcpu->stats_pstate, zcpu->cur_pstate);
+}
+
+static void zen_freq_stats_write_avoided(struct zen_freq_cpu *zcpu)
+{
+	u64_stats_update_begin(&zcpu->stats.syncp);
+	u64_stats_inc(&zcpu->stats.writes_avoided);
+	u64_stats_update_end(&zcpu->stats.syncp);
+}
+
 /**
  * zen_write_pstate_local - Write P-state MSR on local CPU
  * @info:	Pointer to struct zen_freq_cpu
  *
- * This function runs on the target CPU via smp_call_function_single(),
- * eliminating IPI overhead for MSR writes. The MSR write happens locally.
+ * This function must run on the target CPU. The fast path calls it
+ * directly; slow paths and remote callers reach it through
+ * smp_call_function_single() or the deferred irq_work.
  */
 void zen_write_pstate_local(void *info)
 {
 	struct zen_freq_cpu *zcpu = info;
 	u64 pstate_val;
 
-	/* Read current P-state control MSR */
-	rdmsrl(MSR_AMD_PSTATE_DEF_BASE, pstate_val);
+	/* Start from the shadow; only read the MSR when it is unknown */
+	pstate_val = zcpu->pstate_ctl_cached;
+	if (pstate_val == U64_MAX)
+		rdmsrl(MSR_AMD_PSTATE_DEF_BASE, pstate_val);
 
 	/* Clear and set P-state bits (bits 0-5) */
 	pstate_val &= ~0x3FULL;
 	pstate_val |= zcpu->cur_pstate | BIT(6);  /* Set P-state and enable */
 
+	/* Nothing changed since the last write: skip the MSR access */
+	if (pstate_val == zcpu->pstate_ctl_cached) {
+		zen_freq_stats_write_avoided(zcpu);
+		return;
+	}
+
 	/* Write locally - no IPI! */
 	wrmsrl(MSR_AMD_PSTATE_DEF_BASE, pstate_val);
+	zcpu->pstate_ctl_cached = pstate_val;
 
 	/* Update current frequency atomically */
 	if (zcpu->cur_pstate < zcpu->num_pstates)
 		atomic_set(&zcpu->cur_freq, zcpu->pstates[zcpu->cur_pstate].freq);
+
+	if (zcpu->cur_pstate != zcpu->stats_pstate)
+		zen_freq_stats_account(zcpu);
+}
+
+/**
+ * zen_freq_remote_work_fn - Apply a deferred P-state on the owning CPU
+ * @work:	irq_work embedded in struct zen_freq_cpu
+ *
+ * Runs in hard-irq context on zcpu->cpu. Only the latest request queued
+ * since the last run is applied; intermediate requests are dropped.
+ */
+static void zen_freq_remote_work_fn(struct irq_work *work)
+{
+	struct zen_freq_cpu *zcpu = container_of(work, struct zen_freq_cpu,
+						 remote_work);
+
+	atomic_set(&zcpu->remote_pending, 0);
+	if (zen_cppc_active()) {
+		zen_cppc_update_local(zcpu);
+	} else {
+		zcpu->cur_pstate = READ_ONCE(zcpu->remote_pstate);
+		zen_write_pstate_local(zcpu);
+	}
+
+	u64_stats_update_begin(&zcpu->stats.syncp);
+	u64_stats_inc(&zcpu->stats.remote_writes);
+	u64_stats_update_end(&zcpu->stats.syncp);
 }
 
 /**
- * zen_freq_set_pstate_zero_ipi - Set P-state with zero-IPI
+ * zen_freq_commit_pstate - Apply a P-state from the fast path
  * @zcpu:	Per-CPU data
- * @pstate:	Target P-state
+ * @pstate:	Target P-state index
  *
- * Uses smp_call_function_single() to execute the MSR write on the
- * target CPU, eliminating cross-core IPI latency.
+ * fast_switch normally runs on the CPU it targets, in which case the MSR
+ * is written directly without any cross-CPU call. Remote callers publish
+ * the request and queue a single irq_work on the target CPU; further
+ * requests arriving before it runs only overwrite the pending P-state.
  *
- * Return: 0 on success, negative error code on failure
+ * Must be called with preemption disabled.
  */
-int zen_freq_set_pstate_zero_ipi(struct zen_freq_cpu *zcpu, unsigned int pstate)
+void zen_freq_commit_pstate(struct zen_freq_cpu *zcpu, unsigned int pstate)
 {
-	int ret;
+	if (likely(zcpu->cpu == smp_processor_id())) {
+		zcpu->cur_pstate = pstate;
+		zen_write_pstate_local(zcpu);
+		return;
+	}
 
-	if (!zcpu || pstate >= zcpu->num_pstates)
-		return -EINVAL;
+	WRITE_ONCE(zcpu->remote_pstate, pstate);
+	if (atomic_xchg(&zcpu->remote_pending, 1))
+		return;
 
-	zcpu->cur_pstate = pstate;
+	irq_work_queue_on(&zcpu->remote_work, zcpu->cpu);
+}
 
-	/* Execute MSR write on target CPU - zero IPI overhead */
-	ret = smp_call_function_single(zcpu->cpu, zen_write_pstate_local,
-				       zcpu, 1);
+/**
+ * zen_freq_park_thread_local - Drop a non-owner thread's request to the floor
+ * @info:	Pointer to struct zen_freq_cpu
+ *
+ * The core runs at the highest request of its threads, so siblings that do
+ * not own the domain request are parked at the lowest P-state (and lowest
+ * CPPC perf) and the owner's request alone sets the domain frequency. The
+ * owner's shadows are not touched.
+ */
+static void zen_freq_park_thread_local(void *info)
+{
+	struct zen_freq_cpu *zcpu = info;
+	u64 val;
 
-	if (ret == 0)
-		zcpu->stats.transitions++;
+	if (zcpu->num_pstates &&
+	    !rdmsrl_safe(MSR_AMD_PSTATE_DEF_BASE, &val)) {
+		val &= ~0x3FULL;
+		val |= (zcpu->num_pstates - 1) | BIT(6);
+		wrmsrl_safe(MSR_AMD_PSTATE_DEF_BASE, val);
+	}
 
-	return ret;
+	if (zen_cppc_active())
+		wrmsrl_safe(MSR_AMD_CPPC_REQ,
+			    CPPC_MAX_PERF(zcpu->lowest_perf) |
+			    CPPC_MIN_PERF(zcpu->lowest_perf) |
+			    CPPC_DES_PERF(zcpu->lowest_perf) |
+			    CPPC_EPP(ZEN_EPP_POWERSAVE));
 }
 
 /**
- * zen_read_temperature - Read CPU temperature from MSR
- * @cpu:	CPU number
+ * zen_freq_domain_park - Park every online non-owner thread of a domain
+ * @zcpu:	Domain data
+ */
+static void zen_freq_domain_park(struct zen_freq_cpu *zcpu)
+{
+	unsigned int cpu;
+
+	for_each_cpu(cpu, &zcpu->domain_cpus) {
+		if (cpu != zcpu->cpu && cpu_online(cpu))
+			smp_call_function_single(cpu, zen_freq_park_thread_local,
+						 zcpu, 1);
+	}
+}
+
+/**
+ * zen_freq_thread_hints - Record what the running task asks of its thread
+ * @thr:	Hook state of the current CPU
+ *
+ * The hook only acts for its own runqueue, so current is the task this
+ * thread serves. Its effective clamps (task, cgroup and system limits
+ * already combined by the scheduler) become the thread's window; the
+ * idle task imposes nothing and marks the thread idle.
+ */
+static void zen_freq_thread_hints(struct zen_freq_thread *thr)
+{
+	struct task_struct *p = current;
+	unsigned long lo = 0, hi = SCHED_CAPACITY_SCALE;
+
+#ifdef CONFIG_UCLAMP_TASK
+	if (!is_idle_task(p)) {
+		lo = p->uclamp[UCLAMP_MIN].value;
+		hi = p->uclamp[UCLAMP_MAX].value;
+	}
+#endif
+
+	WRITE_ONCE(thr->uclamp_min, (lo * 255) >> SCHED_CAPACITY_SHIFT);
+	WRITE_ONCE(thr->uclamp_max, (hi * 255) >> SCHED_CAPACITY_SHIFT);
+	WRITE_ONCE(thr->busy, !is_idle_task(p));
+}
+
+/**
+ * zen_freq_domain_clamp - Combine the threads' util and uclamp hints
+ * @zcpu:	Domain data
+ * @threads:	Per-CPU hook state the domain's threads record into
+ * @time:	Scheduler time of the update (ns)
+ *
+ * As in schedutil, each thread's utilization is clamped by its own
+ * uclamp window before the domain takes the highest, so one idle sibling
+ * cannot talk the shared EPP down while the other is busy. The domain
+ * floor is the highest thread floor. The cap is the highest among busy
+ * threads only: an idle sibling serves nothing and must not lift a busy
+ * thread's uclamp.max; with every thread idle nothing is capped. A thread
+ * that has not sampled for ZEN_UTIL_STALE_NS has its tick stopped and is
+ * left out altogether.
+ *
+ * Return: Domain utilization (%)
+ */
+static u32 zen_freq_domain_clamp(struct zen_freq_cpu *zcpu,
+				 struct zen_freq_thread __percpu *threads,
+				 u64 time)
+{
+	struct zen_freq_thread *thr;
+	u32 util, lo, hi, max_util = 0;
+	u8 min_perf = 0, max_perf = 0;
+	bool busy = false;
+	unsigned int cpu;
+
+	for_each_cpu(cpu, &zcpu->domain_cpus) {
+		thr = per_cpu_ptr(threads, cpu);
+		if ((s64)(time - READ_ONCE(thr->sample_ns)) > ZEN_UTIL_STALE_NS)
+			continue;
+
+		lo = READ_ONCE(thr->uclamp_min);
+		hi = READ_ONCE(thr->uclamp_max);
+		util = clamp_t(u32, READ_ONCE(thr->util), lo * 100 / 255,
+			       hi * 100 / 255);
+
+		max_util = max(max_util, util);
+		min_perf = max_t(u8, min_perf, lo);
+		if (READ_ONCE(thr->busy)) {
+			max_perf = max_t(u8, max_perf, hi);
+			busy = true;
+		}
+	}
+
+	WRITE_ONCE(zcpu->uclamp_min_perf, min_perf);
+	WRITE_ONCE(zcpu->uclamp_max_perf, busy ? max_perf : 255);
+
+	return max_util;
+}
+
+/**
+ * zen_freq_domain_user - Refresh the domain's userspace-mode request
+ * @zcpu:	Domain data
+ *
+ * Called from the util hook on the local CPU. Any thread of the domain may
+ * be the one userspace asked for, and the core serves the highest request.
+ * Outside userspace mode the request is dropped.
+ */
+static void zen_freq_domain_user(struct zen_freq_cpu *zcpu)
+{
+	struct zen_freq_user_slot *slots = READ_ONCE(zfreq_user_slots);
+	unsigned int cpu;
+	u32 perf = 0;
+
+	if (slots && READ_ONCE(zen_freq_mode) == ZEN_FREQ_MODE_USERSPACE) {
+		for_each_cpu(cpu, &zcpu->domain_cpus)
+			perf = max(perf, READ_ONCE(slots[cpu].perf));
+	}
+
+	WRITE_ONCE(zcpu->user_perf, min(perf, 255U));
+}
+
+/**
+ * zen_smn_temp - Decode the SMU reported-temperature register
+ * @val:	Raw value of ZEN_SMN_REPORTED_TEMP_CTRL
+ *
+ * Same decoding as k10temp: Tctl in 0.125 C steps, shifted down by 49 C
+ * when the extended range is selected.
+ *
+ * Return: Tctl in Celsius, or 0 if the reading is not usable
+ */
+static u32 zen_smn_temp(u32 val)
+{
+	s32 temp_mc = (val >> ZEN_CUR_TEMP_SHIFT) * 125;
+
+	if ((val & ZEN_CUR_TEMP_RANGE_SEL) ||
+	    (val & ZEN_CUR_TEMP_TJ_SEL_MASK) == ZEN_CUR_TEMP_TJ_SEL_MASK)
+		temp_mc -= ZEN_CUR_TEMP_RANGE_OFFSET_MC;
+
+	if (temp_mc <= 0)
+		return 0;
+
+	return DIV_ROUND_CLOSEST(temp_mc, 1000);
+}
+
+/**
+ * zen_read_temperature_node - Read Tctl of one AMD node over SMN
+ * @node:	AMD node id
+ *
+ * The SMN index/data pair is serialized by a mutex, so this may sleep.
  *
  * Return: Temperature in Celsius, or 0 on error
  */
-u32 zen_read_temperature(unsigned int cpu)
+static u32 zen_read_temperature_node(u16 node)
 {
-	u64 therm_status;
-	u32 temp = 0;
+	u32 val;
 
-	/* Read thermal status MSR on target CPU */
-	if (rdmsrl_safe_on_cpu(cpu, MSR_IA32_THERM_STATUS, &therm_status))
+	if (amd_smn_read(node, ZEN_SMN_REPORTED_TEMP_CTRL, &val) || val == ~0U)
 		return 0;
 
-	/* Check if reading is valid */
-	if (therm_status & THERM_STATUS_VALID) {
-		temp = THERM_STATUS_TEMP(therm_status);
-	}
+	return zen_smn_temp(val);
+}
 
-	return temp;
+/**
+ * zen_read_temperature - Read the temperature of a CPU's package
+ * @cpu:	CPU number
+ *
+ * Tctl is the control temperature the SMU itself throttles on. It is
+ * one value per node, and on Zen 2 and later a node is a package. May
+ * sleep.
+ *
+ * Return: Temperature in Celsius, or 0 on error
+ */
+u32 zen_read_temperature(unsigned int cpu)
+{
+	return zen_read_temperature_node(topology_amd_node_id(cpu));
 }
 
 /* ============================================================================
@@ -240,10 +658,11 @@ static u8 zen_thermal_pi_controller(struct zen_freq_cpu *zcpu, u32 temp)
 	u8 max_perf = 255;
 
 	/* Calculate error from soft limit */
-	error = (s32)temp - (s32)zen_freq_soft_temp;
+	error = (s32)temp - (s32)ZEN_PKG_VALUE(zcpu->pkg, soft_temp,
+					       zen_freq_soft_temp);
 
 	/* Proportional term */
-	proportional = (error * ZEN_THERMAL_KP) / 1000;
+	proportional = (error * (s32)READ_ONCE(zen_freq_thermal_kp)) / 1000;
 
 	/* Integral term with anti-windup */
 	zcpu->thermal_integral += error;
@@ -252,7 +671,8 @@ static u8 zen_thermal_pi_controller(struct zen_freq_cpu *zcpu, u32 temp)
 	else if (zcpu->thermal_integral < -ZEN_THERMAL_INTEGRAL_MAX)
 		zcpu->thermal_integral = -ZEN_THERMAL_INTEGRAL_MAX;
 
-	integral = (zcpu->thermal_integral * ZEN_THERMAL_KI) / 1000;
+	integral = (zcpu->thermal_integral *
+		    (s32)READ_ONCE(zen_freq_thermal_ki)) / 1000;
 
 	/* Combined adjustment */
 	adjustment = proportional + integral;
@@ -266,33 +686,81 @@ static u8 zen_thermal_pi_controller(struct zen_freq_cpu *zcpu, u32 temp)
 	return max_perf;
 }
 
+/**
+ * zen_thermal_model_temp - Temperature the controller should act on
+ * @zcpu:	Per-CPU data, last_temp still holding the previous sample
+ * @temp:	Current temperature
+ *
+ * Updates the dT/dt estimate. With the predictive model the result is
+ * the temperature expected thermal_horizon_ms from now, plus a
+ * feed-forward term for the domain's utilization, so throttling can
+ * start before the soft limit is actually reached.
+ *
+ * Return: Controller input temperature in Celsius
+ */
+static u32 zen_thermal_model_temp(struct zen_freq_cpu *zcpu, u32 temp)
+{
+	u64 now = sched_clock();
+	u64 dt_ms = 0;
+	s64 pred_mc;
+
+	if (zcpu->thermal_sample_ns && zcpu->last_temp &&
+	    now > zcpu->thermal_sample_ns)
+		dt_ms = div_u64(now - zcpu->thermal_sample_ns, NSEC_PER_MSEC);
+
+	if (dt_ms)
+		zcpu->thermal_slope = div64_s64(((s64)temp - zcpu->last_temp) *
+						1000000, dt_ms);
+	zcpu->thermal_sample_ns = now;
+
+	if (READ_ONCE(zen_freq_thermal_model) != ZEN_THERMAL_MODEL_PREDICTIVE)
+		return temp;
+
+	pred_mc = (s64)temp * 1000 +
+		  div_s64((s64)zcpu->thermal_slope *
+			  READ_ONCE(zen_freq_thermal_horizon_ms), 1000) +
+		  (s64)READ_ONCE(zen_freq_thermal_kff) * zcpu->thermal_ff_util;
+
+	if (pred_mc <= 0)
+		return 0;
+
+	return DIV_ROUND_CLOSEST_ULL(pred_mc, 1000);
+}
+
 /**
  * zen_thermal_check_cpu - Check and handle thermal state for one CPU
  * @zcpu:	Per-CPU data
+ * @temp:	Temperature of the domain in Celsius, 0 if it could not be read
+ *
+ * Hard limits always act on the measured temperature; soft throttling
+ * and recovery act on the controller model's temperature.
  */
-void zen_thermal_check_cpu(struct zen_freq_cpu *zcpu)
+void zen_thermal_check_cpu(struct zen_freq_cpu *zcpu, u32 temp)
 {
-	u32 temp;
+	u32 ctrl_temp, soft, hard;
 	u8 new_max_perf;
 	enum zen_thermal_state new_state;
 
-	temp = zen_read_temperature(zcpu->cpu);
 	if (temp == 0)
 		return;
 
+	ctrl_temp = zen_thermal_model_temp(zcpu, temp);
 	zcpu->last_temp = temp;
 
+	soft = ZEN_PKG_VALUE(zcpu->pkg, soft_temp, zen_freq_soft_temp);
+	hard = ZEN_PKG_VALUE(zcpu->pkg, hard_temp, zen_freq_hard_temp);
+
 	/* State machine */
 	switch (zcpu->thermal_state) {
 	case ZEN_THERMAL_NORMAL:
-		if (temp >= zen_freq_hard_temp) {
+		if (temp >= hard) {
 			new_state = ZEN_THERMAL_HARD_THROTTLE;
-			new_max_perf = zcpu->lowest_perf;
+			new_max_perf = 0;
 			pr_warn("CPU %u: Hard thermal throttle! Temp: %u°C\n",
 				zcpu->cpu, temp);
-		} else if (temp >= zen_freq_soft_temp) {
+		} else if (ctrl_temp >= soft) {
 			new_state = ZEN_THERMAL_SOFT_THROTTLE;
-			new_max_perf = zen_thermal_pi_controller(zcpu, temp);
+			new_max_perf = zen_thermal_pi_controller(zcpu, ctrl_temp);
 			pr_debug("CPU %u: Soft thermal throttle. Temp: %u°C, max_perf: %u\n",
 				 zcpu->cpu, temp, new_max_perf);
 		} else {
@@ -302,35 +770,36 @@ void zen_thermal_check_cpu(struct zen_freq_cpu *zcpu)
 		break;
 
 	case ZEN_THERMAL_SOFT_THROTTLE:
-		if (temp >= zen_freq_hard_temp) {
+		if (temp >= hard) {
 			new_state = ZEN_THERMAL_HARD_THROTTLE;
-			new_max_perf = zcpu->lowest_perf;
-		} else if (temp < zen_freq_soft_temp - ZEN_THERMAL_HYSTERESIS) {
+			new_max_perf = 0;
+		} else if (ctrl_temp < soft - ZEN_THERMAL_HYSTERESIS) {
 			new_state = ZEN_THERMAL_RECOVERY;
+			new_max_perf = zcpu->thermal_throttle_perf;
 			zcpu->thermal_integral = 0;
 		} else {
 			new_state = ZEN_THERMAL_SOFT_THROTTLE;
-			new_max_perf = zen_thermal_pi_controller(zcpu, temp);
+			new_max_perf = zen_thermal_pi_controller(zcpu, ctrl_temp);
 		}
 		break;
 
 	case ZEN_THERMAL_HARD_THROTTLE:
-		if (temp < zen_freq_hard_temp - ZEN_THERMAL_HYSTERESIS) {
+		if (temp < hard - ZEN_THERMAL_HYSTERESIS) {
 			new_state = ZEN_THERMAL_SOFT_THROTTLE;
-			new_max_perf = zen_thermal_pi_controller(zcpu, temp);
+			new_max_perf = zen_thermal_pi_controller(zcpu, ctrl_temp);
 		} else {
 			new_state = ZEN_THERMAL_HARD_THROTTLE;
-			new_max_perf = zcpu->lowest_perf;
+			new_max_perf = 0;
 		}
 		break;
 
 	case ZEN_THERMAL_RECOVERY:
-		if (temp < ZEN_THERMAL_SAFE_LIMIT) {
+		if (ctrl_temp < ZEN_THERMAL_SAFE_LIMIT) {
 			new_state = ZEN_THERMAL_NORMAL;
 			new_max_perf = zen_freq_max_perf;
-		} else if (temp >= zen_freq_soft_temp) {
+		} else if (ctrl_temp >= soft) {
 			new_state = ZEN_THERMAL_SOFT_THROTTLE;
-			new_max_perf = zen_thermal_pi_controller(zcpu, temp);
+			new_max_perf = zen_thermal_pi_controller(zcpu, ctrl_temp);
 		} else {
 			new_state = ZEN_THERMAL_RECOVERY;
 			new_max_perf = min(zcpu->thermal_throttle_perf + 10, 255);
@@ -345,188 +814,1272 @@ void zen_thermal_check_cpu(struct zen_freq_cpu *zcpu)
 	/* Apply new thermal throttle limit */
 	if (new_max_perf != zcpu->thermal_throttle_perf) {
 		zcpu->thermal_throttle_perf = new_max_perf;
-		zcpu->stats.thermal_events++;
+
+		u64_stats_update_begin(&zcpu->slow_stats.syncp);
+		u64_stats_inc(&zcpu->slow_stats.thermal_events);
+		u64_stats_update_end(&zcpu->slow_stats.syncp);
 	}
 
+	if (new_state != zcpu->thermal_state)
+		trace_zen_thermal_state(zcpu->cpu, temp, zcpu->thermal_state,
+					new_state, new_max_perf);
+
 	zcpu->thermal_state = new_state;
+
+	trace_zen_thermal_controller(zcpu->cpu, zen_freq_thermal_model, temp,
+				     zcpu->thermal_slope, zcpu->thermal_ff_util,
+				     ctrl_temp, new_state, new_max_perf);
 }
 
 /**
- * zen_thermal_thread - Background thread for thermal monitoring
- * @data:	Unused
+ * zen_thermal_domain_id - Thermal domain key for a CPU
+ * @cpu:	CPU number
  *
- * Continuously monitors all CPUs and applies thermal throttling
- * when necessary.
+ * Return: AMD node id, the granularity Tctl is reported at
+ */
+static unsigned int zen_thermal_domain_id(unsigned int cpu)
+{
+	return topology_amd_node_id(cpu);
+}
+
+/**
+ * zen_thermal_domain_fanout - Copy thermal guard state to siblings
+ * @dom:	Thermal domain
+ * @src:	CPU data the state machine ran on
  *
- * Return: 0 on exit
+ * Called under rcu_read_lock().
  */
-int zen_thermal_thread(void *data)
+static void zen_thermal_domain_fanout(struct zen_thermal_domain *dom,
+				      struct zen_freq_cpu *src)
 {
 	struct zen_freq_cpu *zcpu;
 	unsigned int cpu;
 
-	pr_info("Thermal guard thread started\n");
-
-	while (!kthread_should_stop()) {
-		/* Check all CPUs */
-		for_each_online_cpu(cpu) {
-			zcpu = per_cpu(zfreq_cpu_data, cpu);
-			if (!zcpu)
-				continue;
-
-			zen_thermal_check_cpu(zcpu);
-		}
+	for_each_cpu(cpu, &dom->cpus) {
+		zcpu = zen_freq_cpu_rcu(cpu);
+		if (!zcpu || zcpu == src)
+			continue;
 
-		/* Sleep with freezer support */
-		freezable_schedule_timeout_interruptible(
-			msecs_to_jiffies(ZEN_THERMAL_POLL_INTERVAL_MS));
+		WRITE_ONCE(zcpu->last_temp, src->last_temp);
+		WRITE_ONCE(zcpu->thermal_sample_ns, src->thermal_sample_ns);
+		WRITE_ONCE(zcpu->thermal_slope, src->thermal_slope);
+		WRITE_ONCE(zcpu->thermal_integral, src->thermal_integral);
+		WRITE_ONCE(zcpu->thermal_throttle_perf, src->thermal_throttle_perf);
+		WRITE_ONCE(zcpu->thermal_state, src->thermal_state);
 	}
-
-	pr_info("Thermal guard thread stopped\n");
-	return 0;
 }
 
-int zen_thermal_guard_init(void)
+/**
+ * zen_thermal_domain_util - Average utilization across a thermal domain
+ * @dom:	Thermal domain
+ *
+ * Called under rcu_read_lock().
+ *
+ * Return: Mean of the last utilization seen by each CPU's util callback
+ */
+static u32 zen_thermal_domain_util(struct zen_thermal_domain *dom)
 {
-	if (!zen_freq_thermal_guard)
-		return 0;
+	struct zen_freq_cpu *zcpu;
+	unsigned int cpu, nr = 0;
+	u32 sum = 0;
 
-	init_waitqueue_head(&zfreq_driver.thermal_wq);
-	atomic_set(&zfreq_driver.thermal_should_run, 1);
+	for_each_cpu(cpu, &dom->cpus) {
+		zcpu = zen_freq_cpu_rcu(cpu);
+		if (!zcpu)
+			continue;
 
-	zfreq_driver.thermal_thread = kthread_create(zen_thermal_thread, NULL,
-						     "zen-freq-thermal");
-	if (IS_ERR(zfreq_driver.thermal_thread)) {
-		pr_err("Failed to create thermal guard thread\n");
-		return PTR_ERR(zfreq_driver.thermal_thread);
+		sum += READ_ONCE(zcpu->last_util);
+		nr++;
 	}
 
-	wake_up_process(zfreq_driver.thermal_thread);
-	zfreq_driver.features |= ZEN_FEAT_THERMAL_GUARD;
-
-	return 0;
+	return nr ? sum / nr : 0;
 }
 
-void zen_thermal_guard_exit(void)
+/**
+ * zen_thermal_next_interval - Pick the next sampling interval for a domain
+ * @dom:	Thermal domain
+ * @zcpu:	CPU data the state machine just ran on
+ *
+ * Cool domains are sampled rarely. The interval shrinks linearly as the
+ * temperature approaches the soft limit, and further when it is rising
+ * fast enough to cross the limit before the next sample. While any
+ * throttling is active the fastest rate is used.
+ *
+ * Return: Interval in milliseconds
+ */
+static unsigned int zen_thermal_next_interval(struct zen_thermal_domain *dom,
+					      struct zen_freq_cpu *zcpu)
 {
-	if (zfreq_driver.thermal_thread) {
-		atomic_set(&zfreq_driver.thermal_should_run, 0);
-		kthread_stop(zfreq_driver.thermal_thread);
-		zfreq_driver.thermal_thread = NULL;
+	u32 temp = zcpu->last_temp;
+	u32 soft = ZEN_PKG_VALUE(zcpu->pkg, soft_temp, zen_freq_soft_temp);
+	unsigned int interval, headroom, rise;
+
+	if (!zen_freq_thermal_adaptive || temp == 0)
+		return ZEN_THERMAL_POLL_INTERVAL_MS;
+
+	if (zcpu->thermal_state != ZEN_THERMAL_NORMAL || temp >= soft)
+		return ZEN_THERMAL_POLL_MIN_MS;
+
+	headroom = soft - temp;
+	if (headroom >= ZEN_THERMAL_POLL_MARGIN)
+		interval = ZEN_THERMAL_POLL_MAX_MS;
+	else
+		interval = ZEN_THERMAL_POLL_MIN_MS +
+			   (ZEN_THERMAL_POLL_MAX_MS - ZEN_THERMAL_POLL_MIN_MS) *
+			   headroom / ZEN_THERMAL_POLL_MARGIN;
+
+	/* Sample at least twice before a steady rise reaches the limit */
+	if (dom->prev_temp && temp > dom->prev_temp) {
+		rise = temp - dom->prev_temp;
+		interval = min(interval, dom->interval_ms * headroom / (2 * rise));
 	}
-}
 
-/* ============================================================================
- * Voltage Safety Verification
- * ============================================================================ */
+	return max_t(unsigned int, interval, ZEN_THERMAL_POLL_MIN_MS);
+}
 
 /**
- * zen_voltage_verify_pstate - Verify voltage safety for a P-state
- * @ps:	P-state to verify
+ * zen_thermal_work_fn - Sample one thermal domain
+ * @work:	Work embedded in struct zen_thermal_domain
  *
- * Return: true if safe, false if voltage exceeds safe limits
+ * The SMN read sleeps, so sampling runs from deferrable delayed work
+ * that does not wake idle cores. The read itself works from any CPU; the
+ * work is queued on a CPU inside the domain to keep it package-local.
  */
-bool zen_voltage_verify_pstate(struct zen_pstate *ps)
+static void zen_thermal_work_fn(struct work_struct *work)
 {
-	u32 voltage_mv;
+	struct zen_thermal_domain *dom = container_of(to_delayed_work(work),
+						      struct zen_thermal_domain,
+						      work);
+	struct zen_freq_cpu *zcpu;
+	unsigned int cpu;
+	u32 temp;
 
-	/* Extract voltage from VID */
-	voltage_mv = ZEN_VID_TO_MV(ps->vid);
-	ps->voltage = voltage_mv;
+	if (!atomic_read(&zfreq_driver.thermal_should_run))
+		return;
 
-	/* Check against safety limit */
-	if (voltage_mv > zen_freq_voltage_max) {
-		/* Allow higher voltage for boost states with warning */
-		if (ps->boost && voltage_mv <= ZEN_VOLTAGE_BOOST_MAX) {
-			pr_warn("P-state %u boost voltage %umV is high but acceptable\n",
-				ps->pstate, voltage_mv);
-			return true;
-		}
+	temp = zen_read_temperature_node(dom->id);
 
-		pr_warn("P-state %u voltage %umV exceeds safe limit %umV - CLAMPING\n",
-			ps->pstate, voltage_mv, zen_freq_voltage_max);
-		ps->safe = false;
-		return false;
+	/* An unplugged sample CPU hands the domain to an online sibling */
+	cpu = dom->sample_cpu;
+	if (!cpu_online(cpu)) {
+		cpu = cpumask_any_and(&dom->cpus, cpu_online_mask);
+		if (cpu < nr_cpu_ids)
+			WRITE_ONCE(dom->sample_cpu, cpu);
+		else
+			cpu = dom->sample_cpu;
 	}
 
-	ps->safe = true;
-	return true;
+	rcu_read_lock();
+	zcpu = zen_freq_cpu_rcu(cpu);
+	if (zcpu) {
+		zcpu->thermal_ff_util = zen_thermal_domain_util(dom);
+		zen_thermal_check_cpu(zcpu, temp);
+		zen_thermal_domain_fanout(dom, zcpu);
+
+		WRITE_ONCE(dom->interval_ms, zen_thermal_next_interval(dom, zcpu));
+		WRITE_ONCE(dom->prev_temp, zcpu->last_temp);
+	}
+	rcu_read_unlock();
+
+	queue_delayed_work_on(cpu, system_wq, &dom->work,
+			      msecs_to_jiffies(dom->interval_ms));
 }
 
 /**
- * zen_voltage_check_all_pstates - Check all P-states for voltage safety
- * @zcpu:	Per-CPU data
+ * zen_thermal_domains_build - Split a package into its thermal domains
+ * @pkg:	Package domain, CPUs populated
+ *
+ * The domains of a package live in one array on the package's node, next
+ * to the rest of its state, so the package's timers never touch another
+ * socket's memory.
  *
- * Return: 0 if all safe, -EINVAL if any unsafe states found
+ * Return: 0 on success, -ENOMEM on allocation failure
  */
-int zen_voltage_check_all_pstates(struct zen_freq_cpu *zcpu)
+static int zen_thermal_domains_build(struct zen_freq_pkg *pkg)
 {
-	unsigned int i;
-	bool has_unsafe = false;
-
-	for (i = 0; i < zcpu->num_pstates; i++) {
-		if (!zen_voltage_verify_pstate(&zcpu->pstates[i])) {
-			has_unsafe = true;
-			zcpu->stats.voltage_clamps++;
+	struct zen_thermal_domain *dom;
+	unsigned int cpu, i, id, nr = 0, max = 0;
+	unsigned int last = UINT_MAX;
+
+	/* Every node starts at least one run of equal keys in CPU order */
+	for_each_cpu(cpu, &pkg->cpus) {
+		id = zen_thermal_domain_id(cpu);
+		if (id != last) {
+			last = id;
+			max++;
 		}
 	}
 
-	/* Also check boost states */
-	for (i = 0; i < zcpu->num_boost; i++) {
-		if (!zen_voltage_verify_pstate(&zcpu->boost_states[i])) {
+	pkg->thermal = kcalloc_node(max, sizeof(*dom), GFP_KERNEL, pkg->node);
+	if (!pkg->thermal)
+		return -ENOMEM;
+
+	for_each_cpu(cpu, &pkg->cpus) {
+		id = zen_thermal_domain_id(cpu);
+
+		for (i = 0; i < nr; i++) {
+			if (pkg->thermal[i].id == id)
+				break;
+		}
+
+		dom = &pkg->thermal[i];
+		if (i == nr) {
+			dom->id = id;
+			dom->sample_cpu = cpu;
+			cpumask_clear(&dom->cpus);
+			nr++;
+		}
+
+		cpumask_set_cpu(cpu, &dom->cpus);
+	}
+
+	pkg->nr_thermal = nr;
+	return 0;
+}
+
+/* Free every package's thermal domains; their work must be cancelled */
+static void zen_thermal_domains_free(void)
+{
+	struct zen_freq_pkg *pkg;
+	unsigned int i;
+
+	for (i = 0; i < zfreq_driver.nr_pkgs; i++) {
+		pkg = zfreq_driver.pkgs[i];
+		if (!pkg)
+			continue;
+
+		kfree(pkg->thermal);
+		pkg->thermal = NULL;
+		pkg->nr_thermal = 0;
+	}
+}
+
+int zen_thermal_guard_init(void)
+{
+	struct zen_thermal_domain *dom;
+	struct zen_freq_pkg *pkg;
+	unsigned int i, j, nr = 0;
+	int ret;
+
+	if (!zen_freq_thermal_guard)
+		return 0;
+
+	/* Without SMN access there is no sensor to act on */
+	if (!zen_read_temperature(cpumask_first(cpu_online_mask))) {
+		pr_warn("Tctl not readable over SMN, thermal guard disabled\n");
+		return 0;
+	}
+
+	for (i = 0; i < zfreq_driver.nr_pkgs; i++) {
+		pkg = zfreq_driver.pkgs[i];
+		if (!pkg)
+			continue;
+
+		ret = zen_thermal_domains_build(pkg);
+		if (ret) {
+			pr_err("Failed to allocate thermal domains\n");
+			zen_thermal_domains_free();
+			return ret;
+		}
+	}
+
+	atomic_set(&zfreq_driver.thermal_should_run, 1);
+
+	for (i = 0; i < zfreq_driver.nr_pkgs; i++) {
+		pkg = zfreq_driver.pkgs[i];
+		if (!pkg)
+			continue;
+
+		for (j = 0; j < pkg->nr_thermal; j++) {
+			dom = &pkg->thermal[j];
+			dom->interval_ms = ZEN_THERMAL_POLL_INTERVAL_MS;
+			INIT_DEFERRABLE_WORK(&dom->work, zen_thermal_work_fn);
+			queue_delayed_work_on(dom->sample_cpu, system_wq,
+					      &dom->work,
+					      msecs_to_jiffies(dom->interval_ms));
+		}
+		nr += pkg->nr_thermal;
+	}
+
+	zfreq_driver.features |= ZEN_FEAT_THERMAL_GUARD;
+
+	pr_info("Thermal guard started on %u domain(s)\n", nr);
+
+	return 0;
+}
+
+void zen_thermal_guard_exit(void)
+{
+	struct zen_freq_pkg *pkg;
+	unsigned int i, j;
+
+	if (!(zfreq_driver.features & ZEN_FEAT_THERMAL_GUARD))
+		return;
+
+	atomic_set(&zfreq_driver.thermal_should_run, 0);
+
+	for (i = 0; i < zfreq_driver.nr_pkgs; i++) {
+		pkg = zfreq_driver.pkgs[i];
+		if (!pkg)
+			continue;
+
+		for (j = 0; j < pkg->nr_thermal; j++)
+			cancel_delayed_work_sync(&pkg->thermal[j].work);
+	}
+
+	zen_thermal_domains_free();
+	zfreq_driver.features &= ~ZEN_FEAT_THERMAL_GUARD;
+}
+
+/* ============================================================================
+ * Power Guard
+ * ============================================================================ */
+
+/**
+ * zen_power_pi_controller - PI controller for package power
+ * @pkg:	Package state, power_mw already updated
+ * @limit_mw:	Power cap
+ *
+ * Same shape as the thermal controller, but the integral is only allowed
+ * to build up throttling, so a package that idled below its cap reacts
+ * to the next overshoot at once.
+ *
+ * Return: Recommended max_perf value (0-255)
+ */
+static u8 zen_power_pi_controller(struct zen_power_pkg *pkg, u32 limit_mw)
+{
+	s64 error, adjustment;
+
+	error = (s64)pkg->power_mw - limit_mw;
+
+	pkg->integral = ZEN_CLAMP((s64)pkg->integral + error, 0,
+				  ZEN_POWER_INTEGRAL_MAX);
+
+	adjustment = div_s64(error * READ_ONCE(zen_freq_power_kp) +
+			     (s64)pkg->integral * READ_ONCE(zen_freq_power_ki),
+			     1000000);
+
+	return 255 - ZEN_CLAMP(adjustment, 0, 255);
+}
+
+/**
+ * zen_power_sample - Read the package energy counter and update power_mw
+ * @pkg:	Package state, must run on a CPU inside it
+ *
+ * Return: true once two samples are available
+ */
+static bool zen_power_sample(struct zen_power_pkg *pkg)
+{
+	u64 raw, now = sched_clock(), uj;
+	bool valid = pkg->sample_ns && now > pkg->sample_ns;
+	u32 delta;
+
+	if (rdmsrl_safe(MSR_AMD_PKG_ENERGY_STATUS, &raw))
+		return false;
+
+	if (valid) {
+		/* 32-bit counter; the unsigned difference handles wrap */
+		delta = (u32)raw - pkg->energy_raw;
+		uj = ((u64)delta * USEC_PER_SEC) >> pkg->energy_unit;
+		pkg->power_mw = div64_u64(uj * NSEC_PER_MSEC,
+					  now - pkg->sample_ns);
+	}
+
+	pkg->energy_raw = raw;
+	pkg->sample_ns = now;
+
+	return valid;
+}
+
+/**
+ * zen_power_timer_fn - Run the power loop for one package
+ * @t:		Timer embedded in struct zen_power_pkg
+ *
+ * Runs on a CPU inside the package so the RAPL read is local, and
+ * re-homes itself like the thermal sampling work when that CPU goes away.
+ */
+static void zen_power_timer_fn(struct timer_list *t)
+{
+	struct zen_power_pkg *pkg = from_timer(pkg, t, timer);
+	struct zen_freq_pkg *zpkg = container_of(pkg, struct zen_freq_pkg, power);
+	u32 limit_mw = ZEN_PKG_VALUE(zpkg, power_limit_w, zen_freq_power_limit_w) * 1000;
+	unsigned int cpu = smp_processor_id();
+	unsigned int interval = ZEN_POWER_IDLE_POLL_MS;
+	struct zen_freq_cpu *zcpu;
+	u8 max_perf = 255;
+	bool valid;
+
+	if (!atomic_read(&zfreq_driver.power_should_run))
+		return;
+
+	if (!cpumask_test_cpu(cpu, &pkg->cpus)) {
+		cpu = cpumask_any_and(&pkg->cpus, cpu_online_mask);
+		if (cpu >= nr_cpu_ids)
+			cpu = smp_processor_id();
+
+		pkg->sample_cpu = cpu;
+		pkg->sample_ns = 0;
+		pkg->timer.expires = jiffies + msecs_to_jiffies(interval);
+		add_timer_on(&pkg->timer, cpu);
+		return;
+	}
+
+	valid = zen_power_sample(pkg);
+	if (limit_mw) {
+		max_perf = valid ? zen_power_pi_controller(pkg, limit_mw) :
+				   pkg->max_perf;
+		interval = ZEN_POWER_POLL_MS;
+	} else {
+		pkg->integral = 0;
+	}
+
+	if (max_perf != pkg->max_perf) {
+		trace_zen_power_guard(pkg->id, pkg->power_mw, limit_mw, max_perf);
+		pkg->max_perf = max_perf;
+	}
+
+	rcu_read_lock();
+	for_each_cpu(cpu, &pkg->cpus) {
+		zcpu = zen_freq_cpu_rcu(cpu);
+		if (zcpu)
+			WRITE_ONCE(zcpu->power_throttle_perf, max_perf);
+	}
+	rcu_read_unlock();
+
+	mod_timer(&pkg->timer, jiffies + msecs_to_jiffies(interval));
+}
+
+/**
+ * zen_power_guard_init - Start one power loop per package
+ *
+ * Nothing is started when the RAPL MSRs cannot be read. The loop keeps
+ * sampling without a cap, so power_limit_w can be set at runtime.
+ *
+ * Return: 0 (the timers live in the package domains)
+ */
+int zen_power_guard_init(void)
+{
+	struct zen_power_pkg *pkg;
+	unsigned int i;
+	u64 unit, raw;
+
+	if (!zfreq_driver.pkgs)
+		return 0;
+
+	if (rdmsrl_safe(MSR_AMD_RAPL_POWER_UNIT, &unit) ||
+	    rdmsrl_safe(MSR_AMD_PKG_ENERGY_STATUS, &raw)) {
+		pr_info("RAPL not available, power guard disabled\n");
+		return 0;
+	}
+
+	atomic_set(&zfreq_driver.power_should_run, 1);
+
+	for (i = 0; i < zfreq_driver.nr_pkgs; i++) {
+		if (!zfreq_driver.pkgs[i])
+			continue;
+
+		pkg = &zfreq_driver.pkgs[i]->power;
+		pkg->energy_unit = RAPL_ENERGY_UNIT(unit);
+		pkg->timer.expires = jiffies + msecs_to_jiffies(ZEN_POWER_POLL_MS);
+		add_timer_on(&pkg->timer, pkg->sample_cpu);
+	}
+
+	zfreq_driver.features |= ZEN_FEAT_POWER_GUARD;
+
+	return 0;
+}
+
+void zen_power_guard_exit(void)
+{
+	unsigned int i;
+
+	if (!(zfreq_driver.features & ZEN_FEAT_POWER_GUARD))
+		return;
+
+	atomic_set(&zfreq_driver.power_should_run, 0);
+
+	for (i = 0; i < zfreq_driver.nr_pkgs; i++) {
+		if (zfreq_driver.pkgs[i])
+			timer_shutdown_sync(&zfreq_driver.pkgs[i]->power.timer);
+	}
+
+	zfreq_driver.features &= ~ZEN_FEAT_POWER_GUARD;
+}
+
+/* ============================================================================
+ * P-state Definition Cache
+ * ============================================================================ */
+
+static void zen_pstate_defs_read_local(u64 *raw)
+{
+	unsigned int i;
+
+	for (i = 0; i < ZEN_MAX_PSTATES; i++) {
+		if (rdmsrl_safe(MSR_AMD_PSTATE_DEF_BASE + i, &raw[i]))
+			raw[i] = 0;
+	}
+}
+
+static void zen_pstate_defs_fill_local(void *unused)
+{
+	unsigned int pkg = topology_logical_package_id(smp_processor_id());
+	struct zen_pstate_defs *defs = &zfreq_driver.pstate_defs[pkg];
+
+	zen_pstate_defs_read_local(defs->raw);
+	defs->checksum = jhash(defs->raw, sizeof(defs->raw), 0);
+	defs->valid = true;
+}
+
+static void zen_pstate_defs_verify_local(void *unused)
+{
+	unsigned int pkg = topology_logical_package_id(smp_processor_id());
+	struct zen_pstate_defs *defs = &zfreq_driver.pstate_defs[pkg];
+	u64 raw[ZEN_MAX_PSTATES];
+
+	zen_pstate_defs_read_local(raw);
+	this_cpu_write(zfreq_pstate_defs_match,
+		       defs->valid &&
+		       jhash(raw, sizeof(raw), 0) == defs->checksum);
+}
+
+/**
+ * zen_pstate_defs_get - Cached P-state definitions for a CPU
+ * @cpu:	CPU number
+ *
+ * Return: The package's definitions if @cpu was verified against them at
+ * load, NULL if the CPU must read its own MSRs.
+ */
+static struct zen_pstate_defs *zen_pstate_defs_get(unsigned int cpu)
+{
+	unsigned int pkg;
+
+	if (!zfreq_driver.pstate_defs || !per_cpu(zfreq_pstate_defs_match, cpu))
+		return NULL;
+
+	pkg = topology_logical_package_id(cpu);
+	if (pkg >= zfreq_driver.nr_pstate_defs)
+		return NULL;
+
+	return &zfreq_driver.pstate_defs[pkg];
+}
+
+/**
+ * zen_pstate_defs_init - Read P-state definitions once per package
+ *
+ * One CPU per package reads the definition MSRs locally, then every CPU
+ * checksums its own definitions in parallel. Both passes are a single
+ * broadcast each, replacing ZEN_MAX_PSTATES serialized cross-CPU reads
+ * per CPU. CPUs whose checksum differs, or that come online later, fall
+ * back to reading their own MSRs.
+ *
+ * Return: 0 on success, -ENOMEM if the cache could not be allocated
+ */
+int zen_pstate_defs_init(void)
+{
+	cpumask_var_t leaders;
+	unsigned int cpu, nr_leaders, nr_match = 0;
+
+	zfreq_driver.nr_pstate_defs = topology_max_packages();
+	zfreq_driver.pstate_defs = kcalloc(zfreq_driver.nr_pstate_defs,
+					   sizeof(*zfreq_driver.pstate_defs),
+					   GFP_KERNEL);
+	if (!zfreq_driver.pstate_defs)
+		return -ENOMEM;
+
+	if (!zalloc_cpumask_var(&leaders, GFP_KERNEL)) {
+		zen_pstate_defs_exit();
+		return -ENOMEM;
+	}
+
+	cpus_read_lock();
+
+	for_each_online_cpu(cpu) {
+		if (cpu == cpumask_first(topology_core_cpumask(cpu)))
+			cpumask_set_cpu(cpu, leaders);
+	}
+
+	nr_leaders = cpumask_weight(leaders);
+	on_each_cpu_mask(leaders, zen_pstate_defs_fill_local, NULL, true);
+	on_each_cpu(zen_pstate_defs_verify_local, NULL, 1);
+
+	for_each_online_cpu(cpu)
+		nr_match += per_cpu(zfreq_pstate_defs_match, cpu);
+
+	cpus_read_unlock();
+	free_cpumask_var(leaders);
+
+	pr_info("P-state definitions cached for %u packages, %u/%u CPUs match\n",
+		nr_leaders,
+		nr_match, num_online_cpus());
+
+	return 0;
+}
+
+void zen_pstate_defs_exit(void)
+{
+	unsigned int cpu;
+
+	for_each_possible_cpu(cpu)
+		per_cpu(zfreq_pstate_defs_match, cpu) = false;
+
+	kfree(zfreq_driver.pstate_defs);
+	zfreq_driver.pstate_defs = NULL;
+	zfreq_driver.nr_pstate_defs = 0;
+}
+
+/* ============================================================================
+ * Voltage Safety Verification
+ * ============================================================================ */
+
+/*
+ * Zen 4 (family 19h models 10h-1Fh and 60h-AFh) moved to SVI3, as did
+ * everything from family 1Ah on.
+ */
+static bool zen_vf_uses_svi3(void)
+{
+	struct cpuinfo_x86 *c = &boot_cpu_data;
+
+	if (c->x86 >= 0x1A)
+		return true;
+	if (c->x86 != 0x19)
+		return false;
+
+	return (c->x86_model >= 0x10 && c->x86_model <= 0x1F) ||
+	       (c->x86_model >= 0x60 && c->x86_model <= 0xAF);
+}
+
+/**
+ * zen_vf_vid - Extract the VID from a P-state definition
+ * @pstate_val:	P-state definition MSR value
+ *
+ * SVI3 VIDs are 9 bits wide; bit 8 lives outside the 8-bit CpuVid field.
+ *
+ * Return: VID in the encoding of this CPU generation
+ */
+static u16 zen_vf_vid(u64 pstate_val)
+{
+	u16 vid = PSTATE_DEF_VID(pstate_val);
+
+	if (zfreq_driver.vid_svi3)
+		vid |= PSTATE_DEF_VID_HI(pstate_val) << 8;
+
+	return vid;
+}
+
+/**
+ * zen_vf_vid_to_mv - Decode a P-state VID for this CPU generation
+ * @vid:	Voltage ID from the P-state definition
+ *
+ * Return: Voltage in mV, 0 if the VID means the rail is off
+ */
+u32 zen_vf_vid_to_mv(u16 vid)
+{
+	if (zfreq_driver.vid_svi3)
+		return ZEN_SVI3_VID_TO_MV(vid);
+
+	return ZEN_SVI2_VID_TO_MV(vid);
+}
+
+/**
+ * zen_voltage_verify_pstate - Verify voltage safety for a P-state
+ * @ps:		P-state to verify
+ * @report:	Print warnings for unsafe or high-voltage states
+ *
+ * Sets @ps->safe; states that fail are left out of the frequency table
+ * and the fast-path index.
+ *
+ * Return: true if safe, false if voltage exceeds safe limits
+ */
+bool zen_voltage_verify_pstate(struct zen_pstate *ps, bool report)
+{
+	u32 voltage_mv;
+
+	/* Extract voltage from VID */
+	voltage_mv = zen_vf_vid_to_mv(ps->vid);
+	ps->voltage = voltage_mv;
+
+	/* Check against safety limit */
+	if (voltage_mv > zen_freq_voltage_max) {
+		/* Allow higher voltage for boost states with warning */
+		if (ps->boost && voltage_mv <= ZEN_VOLTAGE_BOOST_MAX) {
+			if (report)
+				pr_warn("P-state %u boost voltage %umV is high but acceptable\n",
+					ps->pstate, voltage_mv);
+			ps->safe = true;
+			return true;
+		}
+
+		if (report)
+			pr_warn("P-state %u voltage %umV exceeds safe limit %umV - EXCLUDED\n",
+				ps->pstate, voltage_mv, zen_freq_voltage_max);
+		ps->safe = false;
+		return false;
+	}
+
+	ps->safe = true;
+	return true;
+}
+
+/**
+ * zen_voltage_check_all_pstates - Check all P-states for voltage safety
+ * @zcpu:	Per-CPU data
+ *
+ * If no P-state is within the limit, the slowest one is kept so the CPU
+ * still has something to run at.
+ *
+ * Return: 0 (the driver continues with the safe subset)
+ */
+int zen_voltage_check_all_pstates(struct zen_freq_cpu *zcpu)
+{
+	struct zen_pstate_defs *defs = zen_pstate_defs_get(zcpu->cpu);
+	unsigned int i, nr_safe = 0, slowest = 0;
+	bool has_unsafe = false;
+	bool report;
+
+	/* Identical definitions give identical results: warn once per package */
+	report = !defs || !READ_ONCE(defs->reported);
+
+	for (i = 0; i < zcpu->num_pstates; i++) {
+		if (zcpu->pstates[i].freq < zcpu->pstates[slowest].freq)
+			slowest = i;
+
+		if (zen_voltage_verify_pstate(&zcpu->pstates[i], report)) {
+			nr_safe++;
+			continue;
+		}
+
+		has_unsafe = true;
+
+		u64_stats_update_begin(&zcpu->slow_stats.syncp);
+		u64_stats_inc(&zcpu->slow_stats.voltage_clamps);
+		u64_stats_update_end(&zcpu->slow_stats.syncp);
+	}
+
+	if (!nr_safe && zcpu->num_pstates) {
+		if (report)
+			pr_warn("CPU %u: No P-state within %umV, keeping the slowest\n",
+				zcpu->cpu, zen_freq_voltage_max);
+		zcpu->pstates[slowest].safe = true;
+	}
+
+	/* The policy limits only cover what the table will offer */
+	if (has_unsafe) {
+		zcpu->max_freq = 0;
+		zcpu->min_freq = UINT_MAX;
+		for (i = 0; i < zcpu->num_pstates; i++) {
+			if (!zcpu->pstates[i].safe)
+				continue;
+			zcpu->max_freq = max(zcpu->max_freq, zcpu->pstates[i].freq);
+			zcpu->min_freq = min(zcpu->min_freq, zcpu->pstates[i].freq);
+		}
+		zcpu->nominal_freq = min(zcpu->nominal_freq, zcpu->max_freq);
+	}
+
+	/* Also check boost states */
+	for (i = 0; i < zcpu->num_boost; i++) {
+		if (!zen_voltage_verify_pstate(&zcpu->boost_states[i], report)) {
 			has_unsafe = true;
 		}
 	}
 
-	if (has_unsafe) {
-		pr_warn("CPU %u: Some P-states have been voltage-clamped for safety\n",
-			zcpu->cpu);
+	if (has_unsafe && report) {
+		if (defs)
+			pr_warn("Package %u: Unsafe P-states excluded from the frequency table\n",
+				topology_logical_package_id(zcpu->cpu));
+		else
+			pr_warn("CPU %u: Unsafe P-states excluded from the frequency table\n",
+				zcpu->cpu);
+	}
+
+	if (defs)
+		WRITE_ONCE(defs->reported, true);
+
+	return 0;  /* Continue even with clamped states */
+}
+
+/* ============================================================================
+ * I/O Wait Performance Boost
+ * ============================================================================ */
+
+/**
+ * zen_io_boost_update - Track iowait wakeups and decay the boost level
+ * @zcpu:	Per-CPU data
+ * @time:	Current scheduler time in nanoseconds
+ * @flags:	SCHED_CPUFREQ_* flags from the scheduler hook
+ *
+ * Mirrors schedutil: the first iowait wakeup raises the perf floor to
+ * ZEN_IO_BOOST_MIN_PERF and each further one doubles it up to
+ * ZEN_IO_BOOST_MAX_PERF. Without iowait the level is held for
+ * @zen_freq_io_boost_hold_ms, then halved every hold period, and dropped
+ * after @zen_freq_io_boost_duration_ms. Only tasks that actually sleep on
+ * I/O get boosted. Called on the domain owner only; siblings' wakeups
+ * arrive folded into @flags.
+ */
+void zen_io_boost_update(struct zen_freq_cpu *zcpu, u64 time, unsigned int flags)
+{
+	u64 hold = (u64)READ_ONCE(zen_freq_io_boost_hold_ms) * NSEC_PER_MSEC;
+	u64 duration = (u64)READ_ONCE(zen_freq_io_boost_duration_ms) * NSEC_PER_MSEC;
+	u8 old = READ_ONCE(zcpu->io_boost_level);
+	unsigned int level = old;
+
+	if (!zen_freq_io_boost_enabled) {
+		level = 0;
+	} else if (flags & SCHED_CPUFREQ_IOWAIT) {
+		/* A long pause since the last wakeup restarts the ramp */
+		if (level && time - zcpu->io_boost_last_ns > duration)
+			level = 0;
+		level = level ? min(level << 1, ZEN_IO_BOOST_MAX_PERF) :
+				ZEN_IO_BOOST_MIN_PERF;
+		zcpu->io_boost_last_ns = time;
+	} else if (level && time - zcpu->io_boost_last_ns > hold) {
+		level = (time - zcpu->io_boost_last_ns > duration) ? 0 : level >> 1;
+		if (level < ZEN_IO_BOOST_MIN_PERF)
+			level = 0;
+		zcpu->io_boost_last_ns = time;
+	}
+
+	if (level == old)
+		return;
+
+	WRITE_ONCE(zcpu->io_boost_level, level);
+	WRITE_ONCE(zcpu->io_boost_active, level != 0);
+	trace_zen_io_boost(zcpu->cpu, old, level);
+
+	if (!old) {
+		u64_stats_update_begin(&zcpu->stats.syncp);
+		u64_stats_inc(&zcpu->stats.io_boosts);
+		u64_stats_update_end(&zcpu->stats.syncp);
+	}
+}
+
+/* ============================================================================
+ * Preferred Core Steering
+ * ============================================================================ */
+
+static void zen_prefcore_set_itmt_prio(struct zen_freq_cpu *zcpu)
+{
+#ifdef ZEN_FREQ_ITMT
+	unsigned int cpu;
+
+	for_each_cpu(cpu, &zcpu->domain_cpus)
+		sched_set_itmt_core_prio(zcpu->prefcore_ranking, cpu);
+#endif
+}
+
+/**
+ * zen_prefcore_apply - Apply preferred-core policy to one CPU
+ * @zcpu:	Per-CPU data with P-state information populated
+ *
+ * Publishes the CPU's ranking as its ITMT priority (built-in driver
+ * only) and, for cores below the preferred threshold, caps requests one
+ * P-state below the top so the package boost budget goes to the fastest
+ * cores.
+ */
+void zen_prefcore_apply(struct zen_freq_cpu *zcpu)
+{
+	u32 cap = 0;
+	unsigned int i;
+
+	if (!(zfreq_driver.features & ZEN_FEAT_PREFCORE))
+		return;
+
+	if (zcpu->prefcore_ranking < zfreq_driver.prefcore_threshold) {
+		for (i = 0; i < zcpu->num_pstates; i++) {
+			if (zcpu->pstates[i].safe &&
+			    zcpu->pstates[i].freq < zcpu->max_freq &&
+			    zcpu->pstates[i].freq > cap)
+				cap = zcpu->pstates[i].freq;
+		}
+	}
+
+	WRITE_ONCE(zcpu->prefcore_cap_freq, cap);
+
+	zen_prefcore_set_itmt_prio(zcpu);
+}
+
+/**
+ * zen_prefcore_init - Rank cores and enable preferred-core steering
+ *
+ * Called once every online CPU has registered. Nothing is enabled when
+ * firmware reports the same ranking for all cores.
+ */
+void zen_prefcore_init(void)
+{
+	struct zen_freq_cpu *zcpu;
+	unsigned int cpu;
+	u8 lo = U8_MAX, hi = 0;
+
+	if (!zen_freq_prefcore)
+		return;
+
+	cpus_read_lock();
+
+	for_each_online_cpu(cpu) {
+		zcpu = zen_freq_cpu_get(cpu);
+		if (!zcpu || !zcpu->prefcore_ranking)
+			continue;
+		lo = min(lo, zcpu->prefcore_ranking);
+		hi = max(hi, zcpu->prefcore_ranking);
+	}
+
+	if (hi <= lo) {
+		cpus_read_unlock();
+		return;
+	}
+
+	zfreq_driver.prefcore_threshold = max_t(int, hi - ZEN_PREFCORE_BAND, lo + 1);
+	zfreq_driver.features |= ZEN_FEAT_PREFCORE;
+
+	for_each_online_cpu(cpu) {
+		zcpu = zen_freq_cpu_get(cpu);
+		if (zcpu && zen_freq_domain_leader(zcpu, cpu))
+			zen_prefcore_apply(zcpu);
+	}
+
+	cpus_read_unlock();
+
+#ifdef ZEN_FREQ_ITMT
+	sched_set_itmt_support();
+	zfreq_driver.itmt_enabled = true;
+#else
+	pr_info("Preferred cores: ITMT priorities need the driver built in\n");
+#endif
+
+	pr_info("Preferred cores: ranking %u-%u, boost reserved for >= %u\n",
+		lo, hi, zfreq_driver.prefcore_threshold);
+}
+
+void zen_prefcore_exit(void)
+{
+#ifdef ZEN_FREQ_ITMT
+	if (zfreq_driver.itmt_enabled) {
+		sched_clear_itmt_support();
+		zfreq_driver.itmt_enabled = false;
+	}
+#endif
+	zfreq_driver.features &= ~ZEN_FEAT_PREFCORE;
+}
+
+/* ============================================================================
+ * Boost Credits
+ * ============================================================================ */
+
+static int zen_boost_demand_cmp(const void *a, const void *b)
+{
+	const struct zen_boost_demand *da = a, *db = b;
+
+	return db->demand > da->demand ? 1 : db->demand < da->demand ? -1 : 0;
+}
+
+/**
+ * zen_boost_credit_timer_fn - Reallocate a package's boost credits
+ * @t:		Timer embedded in struct zen_boost_pkg
+ *
+ * Ranks the package's domains by their last utilization, with a small bonus
+ * for current holders so near-ties do not swap credits every round, and
+ * grants boost to the top boost_credits of the package. Grant changes are
+ * picked up by each domain's next frequency update. The timer is pinned
+ * inside the package, so the scan only touches the package's own lines,
+ * and it re-homes itself like the power timer.
+ */
+static void zen_boost_credit_timer_fn(struct timer_list *t)
+{
+	struct zen_boost_pkg *pkg = from_timer(pkg, t, timer);
+	struct zen_freq_pkg *zpkg = container_of(pkg, struct zen_freq_pkg, boost);
+	unsigned int credits = ZEN_PKG_VALUE(zpkg, boost_credits,
+					     zen_freq_boost_credits);
+	unsigned long expires = jiffies +
+				msecs_to_jiffies(ZEN_BOOST_CREDIT_INTERVAL_MS);
+	struct zen_freq_cpu *zcpu;
+	unsigned int cpu = smp_processor_id(), i, nr = 0;
+	u32 demand;
+
+	if (!atomic_read(&zfreq_driver.boost_should_run))
+		return;
+
+	if (!cpumask_test_cpu(cpu, &pkg->cpus)) {
+		cpu = cpumask_any_and(&pkg->cpus, cpu_online_mask);
+		if (cpu >= nr_cpu_ids)
+			cpu = smp_processor_id();
+
+		pkg->timer_cpu = cpu;
+		pkg->timer.expires = expires;
+		add_timer_on(&pkg->timer, cpu);
+		return;
+	}
+
+	/* pkg->demand[] only holds zcpu pointers until the unlock below */
+	rcu_read_lock();
+	for_each_cpu(cpu, &pkg->cpus) {
+		zcpu = zen_freq_cpu_rcu(cpu);
+		if (!zcpu || !zen_freq_domain_leader(zcpu, cpu))
+			continue;
+
+		demand = READ_ONCE(zcpu->last_util);
+		if (zcpu->boost_granted)
+			demand += ZEN_BOOST_CREDIT_STICKY;
+
+		pkg->demand[nr].demand = demand;
+		pkg->demand[nr].zcpu = zcpu;
+		nr++;
+	}
+
+	if (!credits || credits > nr)
+		credits = nr;
+	else
+		sort(pkg->demand, nr, sizeof(*pkg->demand),
+		     zen_boost_demand_cmp, NULL);
+
+	for (i = 0; i < nr; i++)
+		WRITE_ONCE(pkg->demand[i].zcpu->boost_granted, i < credits);
+	rcu_read_unlock();
+
+	pkg->nr_domains = nr;
+	pkg->nr_granted = credits;
+
+	mod_timer(&pkg->timer, expires);
+}
+
+/**
+ * zen_boost_credit_init - Start one credit allocator per package
+ *
+ * Every domain starts out holding a credit, so nothing changes until the
+ * first round with boost_credits set.
+ *
+ * Return: 0 on success, -ENOMEM on allocation failure
+ */
+int zen_boost_credit_init(void)
+{
+	struct zen_freq_pkg *zpkg;
+	struct zen_boost_pkg *pkg;
+	unsigned int i;
+
+	if (!zfreq_driver.pkgs)
+		return -ENOMEM;
+
+	for (i = 0; i < zfreq_driver.nr_pkgs; i++) {
+		zpkg = zfreq_driver.pkgs[i];
+		if (!zpkg)
+			continue;
+
+		pkg = &zpkg->boost;
+		pkg->demand = kcalloc_node(max(cpumask_weight(&pkg->cpus), 1U),
+					   sizeof(*pkg->demand), GFP_KERNEL,
+					   zpkg->node);
+		if (!pkg->demand) {
+			zen_boost_credit_exit();
+			return -ENOMEM;
+		}
+	}
+
+	atomic_set(&zfreq_driver.boost_should_run, 1);
+
+	for (i = 0; i < zfreq_driver.nr_pkgs; i++) {
+		if (!zfreq_driver.pkgs[i])
+			continue;
+
+		pkg = &zfreq_driver.pkgs[i]->boost;
+		pkg->timer.expires = jiffies +
+				     msecs_to_jiffies(ZEN_BOOST_CREDIT_INTERVAL_MS);
+		add_timer_on(&pkg->timer, pkg->timer_cpu);
 	}
 
-	return 0;  /* Continue even with clamped states */
+	return 0;
+}
+
+void zen_boost_credit_exit(void)
+{
+	struct zen_boost_pkg *pkg;
+	unsigned int i;
+
+	if (!zfreq_driver.pkgs)
+		return;
+
+	atomic_set(&zfreq_driver.boost_should_run, 0);
+
+	for (i = 0; i < zfreq_driver.nr_pkgs; i++) {
+		if (!zfreq_driver.pkgs[i])
+			continue;
+
+		pkg = &zfreq_driver.pkgs[i]->boost;
+		timer_shutdown_sync(&pkg->timer);
+		kfree(pkg->demand);
+		pkg->demand = NULL;
+	}
 }
 
 /* ============================================================================
- * I/O Wait Performance Boost
+ * Package Domains
  * ============================================================================ */
 
 /**
- * zen_io_boost_check - Check if I/O boost should be activated
- * @zcpu:	Per-CPU data
- * @io_wait:	I/O wait time in nanoseconds
+ * zen_freq_pkg_get - Package domain of a CPU
+ * @cpu:	CPU
+ *
+ * Return: Package domain, NULL if none was built for @cpu's package
  */
-void zen_io_boost_check(struct zen_freq_cpu *zcpu, u64 io_wait)
+struct zen_freq_pkg *zen_freq_pkg_get(unsigned int cpu)
 {
-	unsigned long now = jiffies;
-	u64 delta;
+	unsigned int id = topology_logical_package_id(cpu);
 
-	delta = io_wait - zcpu->last_io_wait;
-	zcpu->last_io_wait = io_wait;
+	if (!zfreq_driver.pkgs || id >= zfreq_driver.nr_pkgs)
+		return NULL;
 
-	/* Significant I/O wait increase detected */
-	if (delta > (NSEC_PER_USEC * 100)) {  /* > 100us delta */
-		/* Activate boost to nominal frequency */
-		zcpu->io_boost_active = true;
-		zcpu->io_boost_expire = now + msecs_to_jiffies(ZEN_IO_BOOST_DURATION_MS);
-		zcpu->stats.io_boosts++;
-	}
+	return zfreq_driver.pkgs[id];
+}
+
+/**
+ * zen_freq_pkgs_init - Build one driver domain per package
+ *
+ * Each domain is allocated on the node of its first online CPU, and its
+ * boost and power timers are set up (not yet armed) pinned to that CPU.
+ * Every tunable starts out following its module parameter.
+ *
+ * Return: 0 on success, -ENOMEM on allocation failure
+ */
+int zen_freq_pkgs_init(void)
+{
+	struct zen_freq_pkg *pkg;
+	unsigned int cpu, i, nr = topology_max_packages();
+
+	zfreq_driver.pkgs = kcalloc(nr, sizeof(*zfreq_driver.pkgs), GFP_KERNEL);
+	if (!zfreq_driver.pkgs)
+		return -ENOMEM;
+	zfreq_driver.nr_pkgs = nr;
+
+	for_each_online_cpu(cpu) {
+		i = topology_logical_package_id(cpu);
+		if (i >= nr)
+			continue;
 
-	/* Check if boost should expire */
-	if (zcpu->io_boost_active && time_after(now, zcpu->io_boost_expire)) {
-		zcpu->io_boost_active = false;
+		pkg = zfreq_driver.pkgs[i];
+		if (!pkg) {
+			pkg = kzalloc_node(sizeof(*pkg), GFP_KERNEL,
+					   cpu_to_node(cpu));
+			if (!pkg) {
+				zen_freq_pkgs_exit();
+				return -ENOMEM;
+			}
+
+			pkg->id = i;
+			pkg->node = cpu_to_node(cpu);
+			pkg->soft_temp = ZEN_PKG_INHERIT;
+			pkg->hard_temp = ZEN_PKG_INHERIT;
+			pkg->power_limit_w = ZEN_PKG_INHERIT;
+			pkg->boost_credits = ZEN_PKG_INHERIT;
+
+			pkg->boost.id = i;
+			pkg->boost.timer_cpu = cpu;
+			timer_setup(&pkg->boost.timer, zen_boost_credit_timer_fn,
+				    TIMER_DEFERRABLE | TIMER_PINNED);
+
+			pkg->power.id = i;
+			pkg->power.sample_cpu = cpu;
+			pkg->power.max_perf = 255;
+			timer_setup(&pkg->power.timer, zen_power_timer_fn,
+				    TIMER_DEFERRABLE | TIMER_PINNED);
+
+			zfreq_driver.pkgs[i] = pkg;
+		}
+
+		cpumask_set_cpu(cpu, &pkg->cpus);
+		cpumask_set_cpu(cpu, &pkg->boost.cpus);
+		cpumask_set_cpu(cpu, &pkg->power.cpus);
 	}
+
+	return 0;
 }
 
-bool zen_io_boost_should_boost(u64 io_wait, u64 total)
+/* Only once the boost and power loops have been stopped */
+void zen_freq_pkgs_exit(void)
 {
-	u32 io_util;
+	unsigned int i;
 
-	if (total == 0)
-		return false;
+	if (!zfreq_driver.pkgs)
+		return;
+
+	for (i = 0; i < zfreq_driver.nr_pkgs; i++)
+		kfree(zfreq_driver.pkgs[i]);
+
+	kfree(zfreq_driver.pkgs);
+	zfreq_driver.pkgs = NULL;
+	zfreq_driver.nr_pkgs = 0;
+}
+
+/* ============================================================================
+ * Effective Frequency Feedback
+ * ============================================================================ */
+
+/*
+ * The APERF/MPERF/TSC reads of the sampling paths go through these two
+ * so the KUnit suite can feed them synthetic counters. Without a running
+ * test the redirect costs one static branch.
+ */
+static int zen_rdmsrl(u32 msr, u64 *val)
+{
+	KUNIT_STATIC_STUB_REDIRECT(zen_rdmsrl, msr, val);
+
+	return rdmsrl_safe(msr, val);
+}
+
+static u64 zen_rdtsc(void)
+{
+	KUNIT_STATIC_STUB_REDIRECT(zen_rdtsc);
+
+	return rdtsc();
+}
+
+/**
+ * zen_freq_sample_effective - Measure delivered frequency from APERF/MPERF
+ * @zcpu:	Per-CPU data, must belong to the current CPU
+ *
+ * Called opportunistically from the util callback; windows shorter than
+ * ZEN_EFF_SAMPLE_MIN_MS are skipped so the MSR reads stay cheap. When the
+ * request was stable over the window but the core delivered noticeably
+ * less (PBO/PPT/firmware limits), the request is capped at the delivered
+ * level for ZEN_EFF_CAP_HOLD_MS before probing higher again.
+ */
+void zen_freq_sample_effective(struct zen_freq_cpu *zcpu)
+{
+	u64 now = sched_clock();
+	u64 aperf, mperf, da, dm;
+	u32 req, eff;
+
+	if (zcpu->cpu != smp_processor_id())
+		return;
 
-	io_util = div64_u64(io_wait * 100, total);
+	if (zcpu->eff_sample_ns &&
+	    now - zcpu->eff_sample_ns < ZEN_EFF_SAMPLE_MIN_MS * NSEC_PER_MSEC)
+		return;
+
+	if (zen_rdmsrl(MSR_IA32_APERF, &aperf) ||
+	    zen_rdmsrl(MSR_IA32_MPERF, &mperf))
+		return;
+
+	req = atomic_read(&zcpu->cur_freq);
+	da = aperf - zcpu->eff_aperf;
+	dm = mperf - zcpu->eff_mperf;
+
+	/* MPERF ticks at the nominal (P0) frequency */
+	if (zcpu->eff_sample_ns && dm) {
+		eff = div64_u64(da * zcpu->nominal_freq, dm);
+		WRITE_ONCE(zcpu->eff_freq, eff);
+
+		if (req && req == zcpu->eff_req_freq &&
+		    (u64)eff * 100 < (u64)req * (100 - ZEN_EFF_SHORTFALL_PCT)) {
+			WRITE_ONCE(zcpu->eff_cap_freq, eff);
+			zcpu->eff_cap_expire = jiffies +
+				msecs_to_jiffies(ZEN_EFF_CAP_HOLD_MS);
+		} else if (zcpu->eff_cap_freq &&
+			   time_after(jiffies, zcpu->eff_cap_expire)) {
+			WRITE_ONCE(zcpu->eff_cap_freq, 0);
+		}
+	}
 
-	return io_util >= ZEN_IO_BOOST_MIN_UTIL;
+	zcpu->eff_aperf = aperf;
+	zcpu->eff_mperf = mperf;
+	zcpu->eff_req_freq = req;
+	zcpu->eff_sample_ns = now;
 }
 
 /* ============================================================================
@@ -552,6 +2105,8 @@ void zen_epp_update_dynamic(struct zen_freq_cpu *zcpu, u32 util)
 			/* Been low for 500ms, switch to powersave EPP */
 			new_epp = ZEN_EPP_POWERSAVE;
 			if (new_epp != zcpu->dynamic_epp) {
+				trace_zen_epp_update(zcpu->cpu, util,
+						     zcpu->dynamic_epp, new_epp);
 				zcpu->dynamic_epp = new_epp;
 				pr_debug("CPU %u: Dynamic EPP -> powersave (util=%u%%)\n",
 					 zcpu->cpu, util);
@@ -582,60 +2137,329 @@ void zen_epp_update_dynamic(struct zen_freq_cpu *zcpu, u32 util)
 	}
 
 	if (new_epp != zcpu->dynamic_epp) {
+		trace_zen_epp_update(zcpu->cpu, util, zcpu->dynamic_epp, new_epp);
 		zcpu->dynamic_epp = new_epp;
 	}
 }
 
 /* ============================================================================
- * RCU-Protected Performance Target
+ * Performance Target (allocation-free)
+ * ============================================================================ */
+
+/**
+ * zen_perf_target_update - Publish a new performance target
+ * @zcpu:	Per-CPU data
+ * @desired:	Desired performance
+ * @min:	Minimum performance
+ * @max:	Maximum performance
+ * @epp:	Energy Performance Preference
+ *
+ * Rewrites the inline target under the seqcount; never allocates and
+ * never fails.
+ */
+void zen_perf_target_update(struct zen_freq_cpu *zcpu,
+			    u8 desired, u8 min, u8 max, u8 epp)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&zcpu->update_lock, flags);
+	write_seqcount_begin(&zcpu->perf_seq);
+
+	zcpu->perf_target.desired_perf = desired;
+	zcpu->perf_target.min_perf = min;
+	zcpu->perf_target.max_perf = max;
+	zcpu->perf_target.epp = epp;
+	zcpu->perf_target.timestamp = sched_clock();
+	zcpu->perf_target.sequence++;
+
+	write_seqcount_end(&zcpu->perf_seq);
+	spin_unlock_irqrestore(&zcpu->update_lock, flags);
+}
+
+/**
+ * zen_perf_target_read - Read a consistent copy of the performance target
+ * @zcpu:	Per-CPU data
+ * @target:	Output copy
+ *
+ * Lock-less; safe from the scheduler hot path.
+ */
+void zen_perf_target_read(struct zen_freq_cpu *zcpu,
+			  struct zen_perf_target *target)
+{
+	unsigned int seq;
+
+	do {
+		seq = read_seqcount_begin(&zcpu->perf_seq);
+		*target = zcpu->perf_target;
+	} while (read_seqcount_retry(&zcpu->perf_seq, seq));
+}
+
+/* ============================================================================
+ * CPPC Request Mode
  * ============================================================================ */
 
-struct zen_perf_target *zen_perf_target_alloc(gfp_t flags)
+/**
+ * zen_cppc_enable_domain - Turn on CPPC for every online thread of a domain
+ * @zcpu:	Domain data
+ *
+ * CPPC_REQ is ignored until CPPC_ENABLE is set, and firmware clears it
+ * across S3, so this runs before the first request at init and on resume.
+ * The bit cannot be cleared again short of a reset. Process context only.
+ */
+static void zen_cppc_enable_domain(struct zen_freq_cpu *zcpu)
 {
-	struct zen_perf_target *target;
+	unsigned int cpu;
 
-	target = kzalloc(sizeof(*target), flags);
-	if (!target)
-		return NULL;
+	if (!zen_cppc_active())
+		return;
 
-	return target;
+	for_each_cpu(cpu, &zcpu->domain_cpus) {
+		if (cpu_online(cpu) &&
+		    wrmsrl_safe_on_cpu(cpu, MSR_AMD_CPPC_ENABLE, 1))
+			pr_warn("CPU %u: Failed to enable CPPC\n", cpu);
+	}
 }
 
-void zen_perf_target_update(struct zen_freq_cpu *zcpu,
-			    u8 desired, u8 min, u8 max, u8 epp)
+/**
+ * zen_cppc_freq_to_perf - Convert a frequency to a CPPC perf level
+ * @zcpu:	Per-CPU data
+ * @freq:	Frequency in kHz
+ */
+static u8 zen_cppc_freq_to_perf(struct zen_freq_cpu *zcpu, unsigned int freq)
+{
+	if (zcpu->max_freq <= zcpu->min_freq)
+		return zcpu->highest_perf;
+
+	freq = ZEN_CLAMP(freq, zcpu->min_freq, zcpu->max_freq);
+	return ZEN_FREQ_TO_PERF(freq, zcpu->min_freq, zcpu->max_freq,
+				zcpu->lowest_perf, zcpu->highest_perf);
+}
+
+/*
+ * Thermal, power, uclamp, I/O boost, phase and userspace levels are kept
+ * on the driver's 0-255 scale; map one onto the CAP1 range.
+ */
+static u8 zen_cppc_level(struct zen_freq_cpu *zcpu, unsigned int level)
+{
+	return zcpu->lowest_perf +
+	       (min(level, 255U) * (zcpu->highest_perf - zcpu->lowest_perf)) / 255;
+}
+
+/**
+ * zen_cppc_compose - Build the CPPC_REQ value for the current state
+ * @zcpu:	Per-CPU data
+ *
+ * Combines the policy limits from the perf target, the module-wide perf
+ * limits, the thermal cap, I/O boost and the dynamic EPP. A userspace-mode
+ * request replaces the governor's desired perf but not the limits. The
+ * perf target and cppc_desired are already on the CAP1 scale; the
+ * driver's 0-255 levels are mapped onto it here.
+ */
+static u64 zen_cppc_compose(struct zen_freq_cpu *zcpu)
+{
+	struct zen_perf_target target;
+	u8 min_perf, max_perf, des_perf, epp, user_perf;
+	u32 pref_cap;
+
+	zen_perf_target_read(zcpu, &target);
+
+	max_perf = min3(target.max_perf,
+			zen_cppc_level(zcpu, min(zcpu->thermal_throttle_perf,
+						 READ_ONCE(zcpu->power_throttle_perf))),
+			zen_cppc_level(zcpu, zen_freq_max_perf));
+	max_perf = min(max_perf,
+		       zen_cppc_level(zcpu, READ_ONCE(zcpu->uclamp_max_perf)));
+	pref_cap = READ_ONCE(zcpu->prefcore_cap_freq);
+	if (pref_cap)
+		max_perf = min(max_perf, zen_cppc_freq_to_perf(zcpu, pref_cap));
+	if (!READ_ONCE(zcpu->boost_granted) && zcpu->nominal_perf)
+		max_perf = min(max_perf, zcpu->nominal_perf);
+	min_perf = max3(target.min_perf, zen_cppc_level(zcpu, zen_freq_min_perf),
+			zen_cppc_level(zcpu, READ_ONCE(zcpu->uclamp_min_perf)));
+	if (min_perf > max_perf)
+		min_perf = max_perf;
+
+	user_perf = READ_ONCE(zcpu->user_perf);
+	if (user_perf)
+		des_perf = zen_cppc_level(zcpu, user_perf);
+	else
+		des_perf = max3(READ_ONCE(zcpu->cppc_desired),
+				zen_cppc_level(zcpu, READ_ONCE(zcpu->io_boost_level)),
+				zen_cppc_level(zcpu, READ_ONCE(zcpu->phase.floor_perf)));
+	des_perf = ZEN_CLAMP(des_perf, min_perf, max_perf);
+
+	epp = (zfreq_driver.features & ZEN_FEAT_EPP) ?
+		zcpu->dynamic_epp : target.epp;
+
+	return CPPC_MAX_PERF(max_perf) | CPPC_MIN_PERF(min_perf) |
+	       CPPC_DES_PERF(des_perf) | CPPC_EPP(epp);
+}
+
+/**
+ * zen_cppc_update_local - Write CPPC_REQ on the local CPU if it changed
+ * @zcpu:	Per-CPU data, must belong to the current CPU
+ *
+ * A steady workload composes the same request every time, so no MSR
+ * write is issued.
+ */
+void zen_cppc_update_local(struct zen_freq_cpu *zcpu)
 {
-	struct zen_perf_target *new_target, *old_target;
+	u64 req = zen_cppc_compose(zcpu);
 
-	new_target = zen_perf_target_alloc(GFP_ATOMIC);
-	if (!new_target)
+	if (req == zcpu->cppc_req_cached) {
+		zen_freq_stats_write_avoided(zcpu);
 		return;
+	}
+
+	wrmsrl(MSR_AMD_CPPC_REQ, req);
+	zcpu->cppc_req_cached = req;
+
+	if (zcpu->highest_perf > zcpu->lowest_perf)
+		atomic_set(&zcpu->cur_freq,
+			   ZEN_PERF_TO_FREQ(CPPC_DES_PERF_GET(req),
+					    zcpu->lowest_perf, zcpu->highest_perf,
+					    zcpu->min_freq, zcpu->max_freq));
+}
 
-	new_target->desired_perf = desired;
-	new_target->min_perf = min;
-	new_target->max_perf = max;
-	new_target->epp = epp;
-	new_target->timestamp = sched_clock();
-	new_target->sequence = zcpu->cur_pstate + 1;  /* Simple sequence */
+/**
+ * zen_cppc_commit - Request a desired perf level in CPPC mode
+ * @zcpu:	Per-CPU data
+ * @desired:	Desired performance (0-255)
+ *
+ * Local requests are written immediately; remote ones share the deferred
+ * irq_work with the P-state path. Must be called with preemption disabled.
+ */
+void zen_cppc_commit(struct zen_freq_cpu *zcpu, u8 desired)
+{
+	WRITE_ONCE(zcpu->cppc_desired, desired);
 
-	/* RCU swap */
-	old_target = rcu_replace_pointer(zcpu->perf_target, new_target, true);
+	if (likely(zcpu->cpu == smp_processor_id())) {
+		zen_cppc_update_local(zcpu);
+		return;
+	}
 
-	/* Free old after RCU grace period */
-	if (old_target)
-		kfree_rcu(old_target, rcu);
+	if (!atomic_xchg(&zcpu->remote_pending, 1))
+		irq_work_queue_on(&zcpu->remote_work, zcpu->cpu);
 }
 
 /* ============================================================================
  * Lock-less Fast Switch
  * ============================================================================ */
 
+/**
+ * zen_pstate_index_floor - Resolve a frequency to its floor slot
+ * @index:	Lookup index
+ * @freq:	Frequency in kHz
+ *
+ * Return: Slot of the highest P-state not above @freq, or the lowest slot
+ * if @freq is below every P-state.
+ */
+static inline unsigned int zen_pstate_index_floor(const struct zen_pstate_index *index,
+						  unsigned int freq)
+{
+	unsigned int bucket = min_t(unsigned int, freq >> index->bucket_shift,
+				    ZEN_FREQ_LUT_SIZE - 1);
+	unsigned int pos = index->bucket_pos[bucket];
+
+	/* P-states sharing the bucket can overshoot; step below them */
+	while (pos > 0 && index->freq[pos] > freq)
+		pos--;
+
+	return pos;
+}
+
+/**
+ * zen_pstate_index_ceil - Resolve a frequency to its ceiling slot
+ * @index:	Lookup index
+ * @freq:	Frequency in kHz
+ *
+ * Return: Slot of the lowest P-state not below @freq, or the highest slot
+ * if @freq is above every P-state.
+ */
+static inline unsigned int zen_pstate_index_ceil(const struct zen_pstate_index *index,
+						 unsigned int freq)
+{
+	unsigned int pos = zen_pstate_index_floor(index, freq);
+
+	if (index->freq[pos] < freq && pos + 1 < index->nr)
+		pos++;
+
+	return pos;
+}
+
+/**
+ * zen_freq_hysteresis - Rate-limit demand-driven P-state changes
+ * @zcpu:	Per-CPU data
+ * @index:	Lookup index the slots refer to
+ * @pos:	Requested slot
+ *
+ * Raises are granted once @zen_freq_up_rate_limit_us has passed since the
+ * last change (immediately by default). Drops must both respect the
+ * minimum residency of the current P-state and persist for
+ * @zen_freq_down_rate_limit_us, so a jittery request pattern no longer
+ * bounces between adjacent P-states. Safety caps are applied by the
+ * caller after this and are never delayed.
+ *
+ * Return: Slot to use
+ */
+static unsigned int zen_freq_hysteresis(struct zen_freq_cpu *zcpu,
+					const struct zen_pstate_index *index,
+					unsigned int pos)
+{
+	unsigned int cur = min(zcpu->hyst_pos, index->nr - 1);
+	u64 now, since;
+
+	if (pos == cur) {
+		zcpu->hyst_down_since_ns = 0;
+		return pos;
+	}
+
+	now = local_clock();
+	since = now - zcpu->hyst_change_ns;
+
+	if (pos > cur) {
+		zcpu->hyst_down_since_ns = 0;
+		if (since < (u64)READ_ONCE(zen_freq_up_rate_limit_us) * NSEC_PER_USEC) {
+			u64_stats_update_begin(&zcpu->stats.switch_syncp);
+			u64_stats_inc(&zcpu->stats.suppressed_up);
+			u64_stats_update_end(&zcpu->stats.switch_syncp);
+			return cur;
+		}
+	} else {
+		if (!zcpu->hyst_down_since_ns)
+			zcpu->hyst_down_since_ns = now;
+
+		/* A predicted trough is not jitter: drop at once */
+		if (READ_ONCE(zcpu->phase.trough))
+			goto grant;
+
+		if (since < (u64)READ_ONCE(zen_freq_min_residency_us) * NSEC_PER_USEC ||
+		    now - zcpu->hyst_down_since_ns <
+		    (u64)READ_ONCE(zen_freq_down_rate_limit_us) * NSEC_PER_USEC) {
+			u64_stats_update_begin(&zcpu->stats.switch_syncp);
+			u64_stats_inc(&zcpu->stats.suppressed_down);
+			u64_stats_update_end(&zcpu->stats.switch_syncp);
+			return cur;
+		}
+grant:
+		zcpu->hyst_down_since_ns = 0;
+	}
+
+	zcpu->hyst_pos = pos;
+	zcpu->hyst_change_ns = now;
+
+	return pos;
+}
+
 /**
  * zen_freq_fast_switch_lockless - Ultra-fast frequency switching
  * @policy:	CPU frequency policy
  * @target_freq:	Target frequency in kHz
  *
- * Completely lock-less fast switch using RCU-protected frequency tables.
- * This is the hot path called by the scheduler.
+ * Completely lock-less fast switch using the RCU-protected P-state lookup
+ * index. The driver is setpolicy-style, so no cpufreq governor ever calls
+ * this; its only caller is native mode on the domain owner, which keeps
+ * the hysteresis state and switch_syncp single-writer.
  *
  * Return: Actual frequency set in kHz
  */
@@ -643,204 +2467,421 @@ unsigned int zen_freq_fast_switch_lockless(struct cpufreq_policy *policy,
 					   unsigned int target_freq)
 {
 	struct zen_freq_cpu *zcpu = policy->driver_data;
-	struct cpufreq_frequency_table *table;
-	struct zen_perf_target *target;
-	unsigned int best_freq = policy->cur;
-	unsigned int freq;
-	int i;
+	const struct zen_pstate_index *index;
+	unsigned int pos, pstate, freq, eff_cap, pref_cap;
+	bool traced;
+	u64 start = 0;
+	u8 perf, io_level, user_perf, limit;
 
 	if (!zcpu)
 		return 0;
 
-	/* RCU read lock for frequency table */
+	/* Only pay for the timestamps while the tracepoint is enabled */
+	traced = trace_zen_freq_fast_switch_enabled();
+
+	if (zen_cppc_active()) {
+		perf = zen_cppc_freq_to_perf(zcpu, target_freq);
+		if (traced)
+			start = local_clock();
+		zen_cppc_commit(zcpu, perf);
+		freq = atomic_read(&zcpu->cur_freq);
+
+		if (traced)
+			trace_zen_freq_fast_switch(zcpu->cpu, target_freq, freq,
+						   perf, zcpu->thermal_throttle_perf,
+						   zcpu->io_boost_active,
+						   local_clock() - start);
+		return freq;
+	}
+
 	rcu_read_lock();
 
-	table = rcu_dereference(zcpu->freq_table_rcu);
-	if (!table) {
-		rcu_read_unlock();
-		return 0;
+	index = rcu_dereference(zcpu->pstate_index);
+	if (!index) {
+		rcu_read_unlock();
+		return 0;
+	}
+
+	user_perf = READ_ONCE(zcpu->user_perf);
+	if (user_perf) {
+		/* Userspace asked ahead of the burst: no damping */
+		pos = index->perf_pos[user_perf];
+	} else {
+		/* Floor P-state for the requested frequency, or in efficient
+		 * mode the cheapest P-state that still meets it. Only native
+		 * mode calls this, so efficient mode needs native_governor=1 */
+		if (READ_ONCE(zen_freq_mode) == ZEN_FREQ_MODE_EFFICIENT)
+			pos = index->eff_pos[zen_pstate_index_ceil(index, target_freq)];
+		else
+			pos = zen_pstate_index_floor(index, target_freq);
+
+		/* Apply the I/O boost, uclamp.min and phase floors */
+		io_level = max3(READ_ONCE(zcpu->io_boost_level),
+				READ_ONCE(zcpu->uclamp_min_perf),
+				READ_ONCE(zcpu->phase.floor_perf));
+		if (io_level)
+			pos = max_t(unsigned int, pos, index->perf_pos[io_level]);
+
+		/* Damp demand changes; the limits below always apply at once */
+		pos = zen_freq_hysteresis(zcpu, index, pos);
+	}
+
+	/* Batch work capped by uclamp.max */
+	pos = min_t(unsigned int, pos,
+		    index->perf_pos[READ_ONCE(zcpu->uclamp_max_perf)]);
+
+	/* Apply the thermal and power limits, whichever is lower */
+	limit = READ_ONCE(zcpu->power_throttle_perf);
+	if (zcpu->thermal_state != ZEN_THERMAL_NORMAL)
+		limit = min(limit, zcpu->thermal_throttle_perf);
+	pos = min_t(unsigned int, pos, index->perf_pos[limit]);
+
+	/* Don't ask for more than the silicon has recently delivered */
+	eff_cap = READ_ONCE(zcpu->eff_cap_freq);
+	if (eff_cap)
+		pos = min(pos, zen_pstate_index_ceil(index, eff_cap));
+
+	/* Top boost is reserved for preferred cores */
+	pref_cap = READ_ONCE(zcpu->prefcore_cap_freq);
+	if (pref_cap)
+		pos = min(pos, zen_pstate_index_floor(index, pref_cap));
+
+	/* Boost P-states need a package credit */
+	if (!READ_ONCE(zcpu->boost_granted))
+		pos = min_t(unsigned int, pos, index->nominal_pos);
+
+	pstate = index->pstate[pos];
+	freq = index->freq[pos];
+
+	rcu_read_unlock();
+
+	/* Zero-IPI transition: local write, or deferred for remote CPUs */
+	if (traced)
+		start = local_clock();
+	zen_freq_commit_pstate(zcpu, pstate);
+
+	if (traced)
+		trace_zen_freq_fast_switch(zcpu->cpu, target_freq, freq, pstate,
+					   zcpu->thermal_throttle_perf,
+					   zcpu->io_boost_active,
+					   local_clock() - start);
+
+	return freq;
+}
+
+/* ============================================================================
+ * Workload Phase Detection
+ * ============================================================================ */
+
+/* Autocorrelation at @lag, normalised to the full-window variance (%) */
+static s32 zen_phase_corr(const s16 *dev, unsigned int lag, s64 var)
+{
+	unsigned int i, n = ZEN_PHASE_RING_SIZE;
+	s64 sum = 0;
+
+	for (i = lag; i < n; i++)
+		sum += dev[i] * dev[i - lag];
+
+	return div64_s64(sum * 100 * n, var * (n - lag));
+}
+
+/**
+ * zen_phase_detect - Find the dominant period in the util ring
+ * @ph:		Phase detector, ring full
+ *
+ * Correlates the samples, taken relative to the EWMA baseline, against
+ * themselves for each lag in ZEN_PHASE_MIN_LAG..ZEN_PHASE_MAX_LAG. Only
+ * interior peaks count, so a slow ramp (which always correlates best at
+ * the shortest lag) is not mistaken for a period.
+ */
+static void zen_phase_detect(struct zen_phase_detector *ph)
+{
+	s16 dev[ZEN_PHASE_RING_SIZE];
+	s32 mean = ph->ewma >> ZEN_PHASE_EWMA_SHIFT;
+	s32 prev, cur, next, best_r = 0;
+	unsigned int i, lag, best = 0;
+	s64 var = 0;
+
+	for (i = 0; i < ZEN_PHASE_RING_SIZE; i++) {
+		dev[i] = ph->ring[(ph->head + i) & (ZEN_PHASE_RING_SIZE - 1)] - mean;
+		var += dev[i] * dev[i];
+	}
+
+	/* A flat load has nothing to predict */
+	if (var < ZEN_PHASE_RING_SIZE * ZEN_PHASE_MIN_SPREAD * ZEN_PHASE_MIN_SPREAD) {
+		ph->period = 0;
+		ph->confidence = 0;
+		return;
 	}
 
-	/* Find closest frequency - optimized linear search */
-	for (i = 0; table[i].frequency != CPUFREQ_TABLE_END; i++) {
-		freq = table[i].frequency;
-		if (freq == target_freq) {
-			best_freq = freq;
-			break;
-		}
-		/* Track closest match */
-		if (freq <= target_freq && freq > best_freq) {
-			best_freq = freq;
+	prev = zen_phase_corr(dev, ZEN_PHASE_MIN_LAG - 1, var);
+	cur = zen_phase_corr(dev, ZEN_PHASE_MIN_LAG, var);
+	for (lag = ZEN_PHASE_MIN_LAG; lag <= ZEN_PHASE_MAX_LAG; lag++) {
+		next = zen_phase_corr(dev, lag + 1, var);
+		if (cur >= prev && cur > next && cur > best_r) {
+			best = lag;
+			best_r = cur;
 		}
+		prev = cur;
+		cur = next;
 	}
 
-	/* Get performance target */
-	target = rcu_dereference(zcpu->perf_target);
-	if (target) {
-		/* Apply thermal throttle limit */
-		if (zcpu->thermal_state != ZEN_THERMAL_NORMAL) {
-			unsigned int limit_freq = ZEN_PERF_TO_FREQ(
-				zcpu->thermal_throttle_perf,
-				zcpu->lowest_perf, zcpu->highest_perf,
-				zcpu->min_freq, zcpu->max_freq);
-			if (best_freq > limit_freq)
-				best_freq = limit_freq;
-		}
+	ph->period = best;
+	ph->confidence = min(best_r, 100);
+}
 
-		/* Apply I/O boost if active */
-		if (zcpu->io_boost_active && best_freq < zcpu->nominal_freq) {
-			best_freq = zcpu->nominal_freq;
-		}
+/**
+ * zen_phase_sample - Record a domain util sample and predict the next one
+ * @zcpu:	Domain data
+ * @util:	Domain utilization (%)
+ * @time:	Scheduler time of the update (ns)
+ *
+ * Called from the util hook on any thread of the domain; the first caller
+ * in each ZEN_PHASE_SAMPLE_NS slot takes the sample. Slots nobody sampled
+ * (the domain was idle) repeat the current value. The outstanding
+ * prediction is scored before the new one is made, and predictions are
+ * made and scored even with phase_predict off so the hit rate can be
+ * judged before it is allowed to act.
+ */
+static void zen_phase_sample(struct zen_freq_cpu *zcpu, u32 util, u64 time)
+{
+	struct zen_phase_detector *ph = &zcpu->phase;
+	s64 slot = atomic64_read(&ph->slot_ns);
+	unsigned int gap, i, old_head;
+	u8 next, floor = 0;
+	bool trough = false;
+	u32 base;
+
+	if (time - (u64)slot < ZEN_PHASE_SAMPLE_NS)
+		return;
+	if (atomic64_cmpxchg(&ph->slot_ns, slot, time) != slot)
+		return;
+
+	if (ph->pred != ZEN_PHASE_NO_PRED) {
+		u64_stats_update_begin(&zcpu->stats.phase_syncp);
+		u64_stats_inc(&zcpu->stats.phase_predictions);
+		if (abs((int)util - ph->pred) <= ZEN_PHASE_HIT_TOL)
+			u64_stats_inc(&zcpu->stats.phase_hits);
+		u64_stats_update_end(&zcpu->stats.phase_syncp);
 	}
 
-	rcu_read_unlock();
+	gap = slot ? min_t(u64, div64_u64(time - slot, ZEN_PHASE_SAMPLE_NS),
+			   ZEN_PHASE_RING_SIZE) : 1;
 
-	/* Find P-state for this frequency */
-	for (i = 0; i < zcpu->num_pstates; i++) {
-		if (zcpu->pstates[i].freq == best_freq) {
-			zcpu->cur_pstate = i;
-			break;
-		}
+	old_head = ph->head;
+	for (i = 0; i < gap; i++) {
+		ph->ring[ph->head++ & (ZEN_PHASE_RING_SIZE - 1)] = util;
+		ph->ewma += util - (ph->ewma >> ZEN_PHASE_EWMA_SHIFT);
 	}
 
-	/* Zero-IPI transition */
-	if (smp_call_function_single(zcpu->cpu, zen_write_pstate_local,
-				     zcpu, 0) == 0) {
-		return best_freq;
+	if (ph->head >= ZEN_PHASE_RING_SIZE &&
+	    old_head / ZEN_PHASE_DETECT_EVERY != ph->head / ZEN_PHASE_DETECT_EVERY)
+		zen_phase_detect(ph);
+
+	ph->pred = ZEN_PHASE_NO_PRED;
+	if (ph->period && ph->confidence >= ZEN_PHASE_CONF_MIN) {
+		/* The next slot should look like the one a period before it */
+		next = ph->ring[(ph->head - ph->period) & (ZEN_PHASE_RING_SIZE - 1)];
+		ph->pred = next;
+		base = ph->ewma >> ZEN_PHASE_EWMA_SHIFT;
+
+		if (READ_ONCE(zen_freq_phase_predict)) {
+			if (next > util + ZEN_PHASE_HIT_TOL && next > base)
+				floor = min_t(u32, next * 255 * ZEN_NATIVE_HEADROOM_PCT /
+					      (100 * 100), 255);
+			else if (next + ZEN_PHASE_HIT_TOL < base)
+				trough = true;
+		}
 	}
 
-	return policy->cur;
+	WRITE_ONCE(ph->floor_perf, floor);
+	WRITE_ONCE(ph->trough, trough);
 }
 
 /* ============================================================================
- * CPU Frequency Update Util Callback - Kernel Version Aware
+ * CPU Frequency Update Util Callback
  * ============================================================================ */
 
-#if ZEN_USE_NEW_UTIL_API
-/*
- * Kernel 6.6+ API: The callback receives utilization values directly
- * through a struct update_util_data or via different parameters
+/**
+ * zen_freq_native_update - Select and write the P-state from the util hook
+ * @policy:	CPU frequency policy
+ * @util_pct:	Domain utilization (%)
+ *
+ * Native governor mode maps utilization straight to a target with
+ * schedutil's 1.25 headroom and feeds it through the same lookup as
+ * fast_switch, so I/O boost, the thermal/power caps and the local or
+ * deferred write all apply without a round trip through the cpufreq core.
+ */
+static void zen_freq_native_update(struct cpufreq_policy *policy, u32 util_pct)
+{
+	struct zen_freq_cpu *zcpu = policy->driver_data;
+	unsigned int freq;
+
+	freq = div_u64((u64)zcpu->max_freq * util_pct * ZEN_NATIVE_HEADROOM_PCT,
+		       100 * 100);
+	freq = ZEN_CLAMP(freq, policy->min, policy->max);
+
+	zen_freq_fast_switch_lockless(policy, freq);
+}
+
+/**
+ * zen_freq_domain_iowait - Collect iowait wakeups seen by the siblings
+ * @zcpu:	Domain data, must belong to the current CPU
+ * @flags:	SCHED_CPUFREQ_* flags of the owner's own update
+ *
+ * Return: @flags with SCHED_CPUFREQ_IOWAIT set if any thread of the domain
+ * woke from iowait since the owner last looked.
  */
+static unsigned int zen_freq_domain_iowait(struct zen_freq_cpu *zcpu,
+					   unsigned int flags)
+{
+	unsigned int cpu;
 
-/* Define our own update util data structure for newer kernels */
-struct zen_update_util_data {
-	void (*func)(struct cpufreq_policy *policy, u64 util, u64 max, u64 time);
-};
+	for_each_cpu(cpu, &zcpu->domain_cpus) {
+		if (cpu != zcpu->cpu &&
+		    xchg(&per_cpu(zfreq_thread, cpu).iowait, false))
+			flags |= SCHED_CPUFREQ_IOWAIT;
+	}
 
-static DEFINE_PER_CPU(struct zen_update_util_data, zen_freq_update_util_data);
+	return flags;
+}
 
 /**
- * zen_freq_update_util_new - Scheduler utilization callback (kernel 6.6+)
- * @policy:	CPU frequency policy
- * @util:	Current utilization
- * @max:	Maximum utilization
- * @time:	Current time
+ * zen_freq_domain_update - Act on a thread's new sample
+ * @zcpu:	Domain data
+ * @time:	Scheduler time of the update (ns)
+ * @flags:	SCHED_CPUFREQ_* flags
+ *
+ * Runs on every thread of the domain. Each thread only records its own
+ * hints (util, uclamp, iowait); the state shared by the domain - the I/O
+ * boost ramp, dynamic EPP, effective frequency sampling, the native mode
+ * P-state choice and CPPC_REQ - is written by the owning CPU alone. That
+ * keeps stats.syncp single-writer and stops a sibling from writing its
+ * own CPPC_REQ, which would un-park it and desynchronize cppc_req_cached.
  */
-static void zen_freq_update_util_new(struct cpufreq_policy *policy,
-				     u64 util, u64 max, u64 time)
+static void zen_freq_domain_update(struct zen_freq_cpu *zcpu, u64 time,
+				   unsigned int flags)
 {
-	struct zen_freq_cpu *zcpu = policy->driver_data;
+	bool owner = zcpu->cpu == smp_processor_id();
 	u32 util_pct;
 
-	if (!zcpu)
-		return;
+	zen_freq_thread_hints(this_cpu_ptr(&zfreq_thread));
+	zen_freq_domain_user(zcpu);
 
-	/* Check I/O boost */
-	if (zen_freq_epp_enabled) {
-		/* In newer kernels, we don't have iowait directly,
-		 * so we use util spikes as a proxy */
-		zen_io_boost_check(zcpu, time);
-	}
+	util_pct = zen_freq_domain_clamp(zcpu, &zfreq_thread, time);
 
-	/* Calculate utilization percentage */
-	if (max > 0) {
-		util_pct = div64_u64(util * 100, max);
+	if (owner) {
+		zen_freq_sample_effective(zcpu);
+
+		/* Ramp or decay the iowait boost */
+		zen_io_boost_update(zcpu, time, zen_freq_domain_iowait(zcpu, flags));
 
 		/* Update dynamic EPP */
 		zen_epp_update_dynamic(zcpu, util_pct);
+
+		if (READ_ONCE(zen_freq_native_governor))
+			zen_freq_native_update(zcpu->cur_policy, util_pct);
+	} else if (flags & SCHED_CPUFREQ_IOWAIT) {
+		/* Leave the wakeup for the owner's next update */
+		WRITE_ONCE(this_cpu_ptr(&zfreq_thread)->iowait, true);
 	}
+
+	WRITE_ONCE(zcpu->last_util, util_pct);
+	zen_phase_sample(zcpu, util_pct, time);
+
+	/* Push EPP/boost changes to hardware; no-op if unchanged */
+	if (owner && zen_cppc_active())
+		zen_cppc_update_local(zcpu);
 }
 
-#else
-/*
- * Older kernel API: Uses struct cpufreq_update_util_data
+/**
+ * zen_freq_thread_sample - Refresh the calling thread's busy fraction
+ * @thr:	Hook state of the current CPU
+ * @time:	Scheduler time of the update (ns)
+ *
+ * Return: true if a new ZEN_UTIL_SAMPLE_NS window was taken.
  */
-
-static void zen_freq_update_util_old(struct cpufreq_policy *policy,
-				     struct cpufreq_update_util_data *data,
-				     unsigned int flags)
+static bool zen_freq_thread_sample(struct zen_freq_thread *thr, u64 time)
 {
-	struct zen_freq_cpu *zcpu = policy->driver_data;
-	u64 io_wait, total;
-	u32 util_pct;
+	u64 mperf, tsc, dtsc;
 
-	if (!zcpu)
-		return;
+	if (thr->sample_ns && time - thr->sample_ns < ZEN_UTIL_SAMPLE_NS)
+		return false;
 
-	/* Get I/O wait statistics */
-	io_wait = data->iowait;
-	total = data->time;
+	if (zen_rdmsrl(MSR_IA32_MPERF, &mperf))
+		return false;
+	tsc = zen_rdtsc();
 
-	/* Check I/O boost */
-	if (zen_freq_epp_enabled) {
-		zen_io_boost_check(zcpu, io_wait);
-	}
+	dtsc = tsc - thr->tsc;
+	if (thr->sample_ns && dtsc)
+		WRITE_ONCE(thr->util,
+			   min_t(u64, div64_u64((mperf - thr->mperf) * 100, dtsc), 100));
 
-	/* Calculate utilization percentage */
-	if (data->max > 0) {
-		util_pct = div64_u64(data->util * 100, data->max);
+	thr->mperf = mperf;
+	thr->tsc = tsc;
+	thr->sample_ns = time;
 
-		/* Update dynamic EPP */
-		zen_epp_update_dynamic(zcpu, util_pct);
-	}
+	return true;
 }
 
-static DEFINE_PER_CPU(struct cpufreq_update_util_data, zen_freq_update_util_data);
+/**
+ * zen_freq_update_util - Scheduler utilization hook
+ * @data:	&zen_freq_thread.update_util of the CPU the update is for
+ * @time:	Current scheduler time (ns)
+ * @flags:	SCHED_CPUFREQ_* flags (SCHED_CPUFREQ_IOWAIT drives the I/O boost)
+ *
+ * Called with the runqueue locked, on every util change. The domain is
+ * only re-evaluated once per sample window, or right away for an iowait
+ * wakeup so the boost ramp sees every one of them.
+ */
+static void zen_freq_update_util(struct update_util_data *data, u64 time,
+				 unsigned int flags)
+{
+	struct zen_freq_thread *thr = container_of(data, struct zen_freq_thread,
+						   update_util);
+
+	/* Remote runqueue: current and the MSRs would be the wrong CPU's */
+	if (thr != this_cpu_ptr(&zfreq_thread))
+		return;
+
+	if (!zen_freq_thread_sample(thr, time) && !(flags & SCHED_CPUFREQ_IOWAIT))
+		return;
 
-#endif /* ZEN_USE_NEW_UTIL_API */
+	zen_freq_domain_update(thr->zcpu, time, flags);
+}
 
 /**
  * zen_freq_register_update_util_hook - Register utilization callback
  * @cpu:	CPU number
- * @zcpu:	Per-CPU driver data
+ * @zcpu:	Domain data
  */
 static void zen_freq_register_update_util_hook(unsigned int cpu,
 					       struct zen_freq_cpu *zcpu)
 {
-#if ZEN_USE_NEW_UTIL_API
-	/*
-	 * Kernel 6.6+: Use the new API
-	 * Note: In newer kernels, cpufreq_add_update_util_hook may not exist
-	 * or have a different signature. We set up a direct callback instead.
-	 */
-	pr_debug("Using kernel 6.6+ util callback API for CPU %u\n", cpu);
-	per_cpu(zen_freq_update_util_data, cpu).func = zen_freq_update_util_new;
-
-	/* For 6.6+, we may need to use the governor's callback mechanism
-	 * or rely solely on fast_switch. The update_util hook mechanism
-	 * changed significantly. */
-#else
-	/* Older kernels: Use the traditional update_util hook */
-	per_cpu(zen_freq_update_util_data, cpu).func = zen_freq_update_util_old;
-	cpufreq_add_update_util_hook(cpu,
-				     &per_cpu(zen_freq_update_util_data, cpu),
-				     zen_freq_update_util_old);
-#endif
+	struct zen_freq_thread *thr = &per_cpu(zfreq_thread, cpu);
+
+	thr->zcpu = zcpu;
+	thr->sample_ns = 0;
+	thr->util = 0;
+	thr->uclamp_min = 0;
+	thr->uclamp_max = 255;
+	thr->busy = false;
+	thr->iowait = false;
+
+	cpufreq_add_update_util_hook(cpu, &thr->update_util,
+				     zen_freq_update_util);
 }
 
 /**
  * zen_freq_unregister_update_util_hook - Unregister utilization callback
  * @cpu:	CPU number
+ *
+ * The hook may still be running on @cpu; callers synchronize_rcu() before
+ * freeing anything it dereferences.
  */
 static void zen_freq_unregister_update_util_hook(unsigned int cpu)
 {
-#if ZEN_USE_NEW_UTIL_API
-	/* Newer kernels: just clear the function pointer */
-	per_cpu(zen_freq_update_util_data, cpu).func = NULL;
-#else
-	/* Older kernels: use the remove function */
 	cpufreq_remove_update_util_hook(cpu);
-#endif
 }
 
 /* ============================================================================
@@ -916,6 +2957,8 @@ bool zen_freq_check_hardware_support(void)
 
 int zen_freq_get_pstate_info(struct zen_freq_cpu *zcpu)
 {
+	struct zen_pstate_defs *defs = zen_pstate_defs_get(zcpu->cpu);
+	u64 raw[ZEN_MAX_PSTATES];
 	u64 pstate_val;
 	unsigned int i;
 	u32 freq;
@@ -928,11 +2971,19 @@ int zen_freq_get_pstate_info(struct zen_freq_cpu *zcpu)
 	zcpu->min_freq = UINT_MAX;
 	zcpu->nominal_freq = 0;
 
-	for (i = 0; i < ZEN_MAX_PSTATES; i++) {
-		pstate_val = 0;
-		if (rdmsrl_safe_on_cpu(zcpu->cpu, MSR_AMD_PSTATE_DEF_BASE + i, &pstate_val))
-			continue;
+	/* Verified against the package cache at load: no MSR reads needed */
+	if (defs) {
+		memcpy(raw, defs->raw, sizeof(raw));
+	} else {
+		for (i = 0; i < ZEN_MAX_PSTATES; i++) {
+			if (rdmsrl_safe_on_cpu(zcpu->cpu, MSR_AMD_PSTATE_DEF_BASE + i,
+					       &raw[i]))
+				raw[i] = 0;
+		}
+	}
 
+	for (i = 0; i < ZEN_MAX_PSTATES; i++) {
+		pstate_val = raw[i];
 		enabled = !!(pstate_val & PSTATE_DEF_EN);
 		if (!enabled)
 			continue;
@@ -941,7 +2992,7 @@ int zen_freq_get_pstate_info(struct zen_freq_cpu *zcpu)
 
 		zcpu->pstates[zcpu->num_pstates].pstate = i;
 		zcpu->pstates[zcpu->num_pstates].freq = freq;
-		zcpu->pstates[zcpu->num_pstates].vid = PSTATE_DEF_VID(pstate_val);
+		zcpu->pstates[zcpu->num_pstates].vid = zen_vf_vid(pstate_val);
 		zcpu->pstates[zcpu->num_pstates].fid = PSTATE_DEF_FID(pstate_val);
 		zcpu->pstates[zcpu->num_pstates].did = PSTATE_DEF_DID(pstate_val);
 		zcpu->pstates[zcpu->num_pstates].div = PSTATE_DEF_CUR_DIV(pstate_val);
@@ -961,11 +3012,26 @@ int zen_freq_get_pstate_info(struct zen_freq_cpu *zcpu)
 	zcpu->lowest_perf = 0;
 	zcpu->nominal_perf = 128;
 
+	/* Per-core CPPC highest_perf doubles as the preferred-core ranking */
+	if (cpu_feature_enabled(X86_FEATURE_CPPC) &&
+	    !rdmsrl_safe_on_cpu(zcpu->cpu, MSR_AMD_CPPC_CAP1, &pstate_val)) {
+		zcpu->prefcore_ranking = CPPC_CAP1_HIGHEST_PERF(pstate_val);
+
+		/* CPPC_REQ takes perf on the platform's own scale */
+		if (zen_cppc_active() &&
+		    CPPC_CAP1_HIGHEST_PERF(pstate_val) >
+		    CPPC_CAP1_LOWEST_PERF(pstate_val)) {
+			zcpu->highest_perf = CPPC_CAP1_HIGHEST_PERF(pstate_val);
+			zcpu->nominal_perf = CPPC_CAP1_NOMINAL_PERF(pstate_val);
+			zcpu->lowest_perf = CPPC_CAP1_LOWEST_PERF(pstate_val);
+		}
+	}
+
 	/* Check boost support */
 	if (cpu_feature_enabled(X86_FEATURE_CPB) ||
 	    ZEN_HAS_BOOST(c->x86_capability[CPUID_8000_0007_EDX])) {
 		zcpu->boost_supported = true;
-		zfreq_driver.features |= ZEN_FEAT_BOOST;
+		zen_freq_feature_set(ZEN_FEAT_BOOST);
 
 		for (i = 0; i < zcpu->num_pstates; i++) {
 			if (zcpu->pstates[i].freq > zcpu->nominal_freq) {
@@ -976,19 +3042,109 @@ int zen_freq_get_pstate_info(struct zen_freq_cpu *zcpu)
 
 	/* Initialize thermal throttle perf to max */
 	zcpu->thermal_throttle_perf = 255;
+	zcpu->power_throttle_perf = 255;
 	zcpu->thermal_state = ZEN_THERMAL_NORMAL;
 	zcpu->dynamic_epp = ZEN_EPP_BALANCE;
 
-	pr_info("CPU %u: %u P-states, max=%u kHz, min=%u kHz, boost=%s\n",
+	pr_info("CPU %u: %u P-states, max=%u kHz, min=%u kHz, boost=%s, ranking=%u\n",
 		zcpu->cpu, zcpu->num_pstates, zcpu->max_freq, zcpu->min_freq,
-		zcpu->boost_supported ? "yes" : "no");
+		zcpu->boost_supported ? "yes" : "no", zcpu->prefcore_ranking);
 
 	return zcpu->num_pstates > 0 ? 0 : -ENODEV;
 }
 
+static unsigned int zen_vf_nr_safe(struct zen_freq_cpu *zcpu)
+{
+	unsigned int i, nr = 0;
+
+	for (i = 0; i < zcpu->num_pstates; i++)
+		nr += zcpu->pstates[i].safe;
+
+	return nr;
+}
+
+/**
+ * zen_pstate_index_build - Build the fast-path lookup index
+ * @zcpu:	Per-CPU data with P-state information populated
+ *
+ * Return: New index, or NULL on allocation failure or no P-states
+ */
+static struct zen_pstate_index *zen_pstate_index_build(struct zen_freq_cpu *zcpu)
+{
+	struct zen_pstate_index *index;
+	unsigned int i, j, pos;
+	u32 freq, perf;
+
+	if (!zen_vf_nr_safe(zcpu))
+		return NULL;
+
+	index = kzalloc_node(sizeof(*index), GFP_KERNEL, cpu_to_node(zcpu->cpu));
+	if (!index)
+		return NULL;
+
+	/* Sort safe P-states by ascending frequency */
+	for (i = 0; i < zcpu->num_pstates; i++) {
+		if (!zcpu->pstates[i].safe)
+			continue;
+
+		freq = zcpu->pstates[i].freq;
+		for (j = index->nr; j > 0 && index->freq[j - 1] > freq; j--) {
+			index->freq[j] = index->freq[j - 1];
+			index->pstate[j] = index->pstate[j - 1];
+		}
+		index->freq[j] = freq;
+		index->pstate[j] = i;
+		index->nr++;
+	}
+
+	/* Smallest bucket width that covers the highest frequency */
+	while ((index->freq[index->nr - 1] >> index->bucket_shift) >=
+	       ZEN_FREQ_LUT_SIZE)
+		index->bucket_shift++;
+
+	pos = 0;
+	for (i = 0; i < ZEN_FREQ_LUT_SIZE; i++) {
+		while (pos + 1 < index->nr &&
+		       (index->freq[pos + 1] >> index->bucket_shift) <= i)
+			pos++;
+		index->bucket_pos[i] = pos;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(index->perf_pos); i++) {
+		if (zcpu->highest_perf > zcpu->lowest_perf) {
+			perf = ZEN_CLAMP(i, zcpu->lowest_perf, zcpu->highest_perf);
+			freq = ZEN_PERF_TO_FREQ(perf, zcpu->lowest_perf,
+						zcpu->highest_perf,
+						zcpu->min_freq, zcpu->max_freq);
+		} else {
+			freq = zcpu->max_freq;
+		}
+		index->perf_pos[i] = zen_pstate_index_floor(index, freq);
+	}
+
+	index->nominal_pos = zen_pstate_index_floor(index, zcpu->nominal_freq);
+
+	/*
+	 * Dynamic energy per cycle scales with V^2, so the most efficient
+	 * slot satisfying a request is the lowest-voltage one at or above
+	 * it; on a voltage floor that is the fastest state sharing it.
+	 */
+	for (i = 0; i < index->nr; i++) {
+		index->eff_pos[i] = i;
+		for (j = i + 1; j < index->nr; j++) {
+			if (zcpu->pstates[index->pstate[j]].voltage <=
+			    zcpu->pstates[index->pstate[index->eff_pos[i]]].voltage)
+				index->eff_pos[i] = j;
+		}
+	}
+
+	return index;
+}
+
 int zen_freq_build_freq_table(struct zen_freq_cpu *zcpu)
 {
-	struct cpufreq_frequency_table *table;
+	struct cpufreq_frequency_table *table, *old_table;
+	struct zen_pstate_index *index, *old_index;
 	unsigned int i, j;
 
 	table = kcalloc(zcpu->num_pstates + 1, sizeof(*table), GFP_KERNEL);
@@ -997,25 +3153,317 @@ int zen_freq_build_freq_table(struct zen_freq_cpu *zcpu)
 
 	j = 0;
 	for (i = zcpu->num_pstates; i > 0; i--) {
+		if (!zcpu->pstates[i - 1].safe)
+			continue;
+
 		table[j].driver_data = i - 1;
 		table[j].frequency = zcpu->pstates[i - 1].freq;
 		j++;
 	}
 
-	table[j].frequency = CPUFREQ_TABLE_END;
-	zcpu->freq_table = table;
+	table[j].frequency = CPUFREQ_TABLE_END;
+
+	index = zen_pstate_index_build(zcpu);
+	if (!index) {
+		kfree(table);
+		return -ENOMEM;
+	}
+
+	old_table = zcpu->freq_table;
+	zcpu->freq_table = table;
+
+	/* Publish table and lookup index to the fast path */
+	rcu_assign_pointer(zcpu->freq_table_rcu, table);
+	old_index = rcu_replace_pointer(zcpu->pstate_index, index, true);
+
+	if (old_index)
+		kfree_rcu(old_index, rcu);
+	if (old_table) {
+		synchronize_rcu();
+		kfree(old_table);
+	}
+
+	return 0;
+}
+
+/**
+ * zen_freq_free_freq_table - Release frequency table and lookup index
+ * @zcpu:	Per-CPU data
+ *
+ * Only valid once fast_switch can no longer run for @zcpu.
+ */
+void zen_freq_free_freq_table(struct zen_freq_cpu *zcpu)
+{
+	kfree(rcu_dereference_protected(zcpu->pstate_index, true));
+	RCU_INIT_POINTER(zcpu->pstate_index, NULL);
+	RCU_INIT_POINTER(zcpu->freq_table_rcu, NULL);
+	kfree(zcpu->freq_table);
+	zcpu->freq_table = NULL;
+}
+
+unsigned int zen_freq_get_frequency(struct zen_freq_cpu *zcpu, unsigned int pstate)
+{
+	if (pstate < zcpu->num_pstates)
+		return zcpu->pstates[pstate].freq;
+	return 0;
+}
+
+/* ============================================================================
+ * Energy Model
+ * ============================================================================ */
+
+/*
+ * The perf domain is published for power-capping and debug tools only.
+ * EAS builds perf domains just for policies run by schedutil, and this
+ * setpolicy driver has no governor, so the scheduler never places tasks
+ * by it. The driver's own consumer is efficient mode, which reads the
+ * same P-state table through the lookup index, not through the EM.
+ */
+#ifdef CONFIG_ENERGY_MODEL
+/*
+ * Dynamic power of one P-state, P = C * V^2 * f. With C in pF, V in mV
+ * and f in MHz the product is in uW after dividing by 10^6.
+ */
+static unsigned long zen_freq_em_power_uw(const struct zen_pstate *ps)
+{
+	u64 mv = ps->voltage ? ps->voltage : ZEN_EM_FALLBACK_MV;
+
+	return div_u64((u64)zen_freq_em_capacitance_pf * mv * mv *
+		       (ps->freq / 1000), 1000000);
+}
+
+static int zen_freq_em_active_power(struct device *dev, unsigned long *power,
+				    unsigned long *freq)
+{
+	struct zen_freq_cpu *zcpu = zen_freq_cpu_get(dev->id);
+	const struct zen_pstate *best = NULL;
+	unsigned int i;
+
+	if (!zcpu)
+		return -ENODEV;
+
+	/* Lowest safe P-state at or above *freq */
+	for (i = 0; i < zcpu->num_pstates; i++) {
+		if (zcpu->pstates[i].safe && zcpu->pstates[i].freq >= *freq &&
+		    (!best || zcpu->pstates[i].freq < best->freq))
+			best = &zcpu->pstates[i];
+	}
+
+	if (!best)
+		return -EINVAL;
+
+	*freq = best->freq;
+	*power = zen_freq_em_power_uw(best);
+
+	return 0;
+}
+
+/**
+ * zen_freq_register_em - Register the domain's P-states with the energy model
+ * @policy:	Policy whose CPUs share the P-states
+ *
+ * Called by the cpufreq core once the policy is set up.
+ */
+static void zen_freq_register_em(struct cpufreq_policy *policy)
+{
+	struct em_data_callback em_cb = EM_DATA_CB(zen_freq_em_active_power);
+	struct zen_freq_cpu *zcpu = policy->driver_data;
+
+	if (!zcpu || !zen_vf_nr_safe(zcpu))
+		return;
+
+	em_dev_register_perf_domain(get_cpu_device(policy->cpu),
+				    zen_vf_nr_safe(zcpu), &em_cb,
+				    policy->related_cpus, true);
+}
+#endif /* CONFIG_ENERGY_MODEL */
+
+/* ============================================================================
+ * Transition Latency Calibration
+ * ============================================================================ */
+
+struct zen_freq_calib_ctx {
+	struct zen_freq_cpu	*zcpu;
+	unsigned int		lo;
+	unsigned int		hi;
+	u64			ctl;
+	u32			*samples;
+	u32			timeouts;
+};
+
+/* Serializes calibration so each package is only measured once */
+static DEFINE_MUTEX(zfreq_calib_mutex);
+
+/*
+ * Calibration writes go straight to the MSR: the shadow, cur_pstate and
+ * the transition and residency counters never see the timed transitions,
+ * and the control value read at the start is written back at the end.
+ */
+static void zen_freq_calib_write(struct zen_freq_calib_ctx *ctx,
+				 unsigned int pstate)
+{
+	wrmsrl(MSR_AMD_PSTATE_DEF_BASE,
+	       (ctx->ctl & ~0x3FULL) | pstate | BIT(6));
+}
+
+/*
+ * Time one lowest-to-highest transition: from the control write until
+ * APERF/MPERF over a ZEN_CALIB_POLL_NS window shows the core running at
+ * ZEN_CALIB_DONE_PCT of the target frequency. Runs on the owning CPU in
+ * a bound kworker, so only the timestamped write is done with
+ * interrupts off and the settle time is slept.
+ */
+static u32 zen_freq_calib_sample(struct zen_freq_calib_ctx *ctx, bool *timeout)
+{
+	struct zen_freq_cpu *zcpu = ctx->zcpu;
+	u64 a0, m0, a1, m1, start, now, target;
+	unsigned long flags;
+
+	zen_freq_calib_write(ctx, ctx->lo);
+	usleep_range(ZEN_CALIB_SETTLE_US, 2 * ZEN_CALIB_SETTLE_US);
+
+	target = div_u64((u64)zcpu->pstates[ctx->hi].freq * ZEN_CALIB_DONE_PCT, 100);
+
+	local_irq_save(flags);
+	rdmsrl(MSR_IA32_APERF, a0);
+	rdmsrl(MSR_IA32_MPERF, m0);
+	start = local_clock();
+	zen_freq_calib_write(ctx, ctx->hi);
+	local_irq_restore(flags);
+
+	do {
+		ndelay(ZEN_CALIB_POLL_NS);
+		rdmsrl(MSR_IA32_APERF, a1);
+		rdmsrl(MSR_IA32_MPERF, m1);
+		now = local_clock();
+
+		if (m1 != m0 &&
+		    div64_u64((a1 - a0) * zcpu->nominal_freq, m1 - m0) >= target) {
+			*timeout = false;
+			return now - start;
+		}
+
+		a0 = a1;
+		m0 = m1;
+	} while (now - start < ZEN_CALIB_TIMEOUT_US * NSEC_PER_USEC);
+
+	*timeout = true;
+	return now - start;
+}
+
+/* work_on_cpu() body: take every sample, then restore the control value */
+static long zen_freq_calib_run(void *info)
+{
+	struct zen_freq_calib_ctx *ctx = info;
+	unsigned int i;
+	bool timeout;
+
+	rdmsrl(MSR_AMD_PSTATE_DEF_BASE, ctx->ctl);
+
+	for (i = 0; i < ZEN_CALIB_SAMPLES; i++) {
+		ctx->samples[i] = zen_freq_calib_sample(ctx, &timeout);
+		ctx->timeouts += timeout;
+	}
+
+	wrmsrl(MSR_AMD_PSTATE_DEF_BASE, ctx->ctl);
+
+	return 0;
+}
+
+static int zen_freq_calib_cmp(const void *a, const void *b)
+{
+	u32 x = *(const u32 *)a, y = *(const u32 *)b;
+
+	return (x > y) - (x < y);
+}
+
+/**
+ * zen_freq_calib_measure - Time transitions on one domain
+ * @zcpu:	Domain data, siblings already parked
+ *
+ * Times ZEN_CALIB_SAMPLES transitions from the lowest to the highest
+ * P-state from process context pinned to the owning CPU, and records
+ * min/median/p99 (nearest rank) in zcpu->calib.
+ *
+ * Return: 0 on success, negative error code if calibration is not possible
+ */
+static int zen_freq_calib_measure(struct zen_freq_cpu *zcpu)
+{
+	struct zen_freq_calib_ctx ctx = { .zcpu = zcpu };
+	unsigned int i;
+	long ret;
+
+	ctx.lo = ctx.hi = ZEN_MAX_PSTATES;
+	for (i = 0; i < zcpu->num_pstates; i++) {
+		if (!zcpu->pstates[i].safe)
+			continue;
+		if (ctx.lo == ZEN_MAX_PSTATES ||
+		    zcpu->pstates[i].freq < zcpu->pstates[ctx.lo].freq)
+			ctx.lo = i;
+		if (ctx.hi == ZEN_MAX_PSTATES ||
+		    zcpu->pstates[i].freq > zcpu->pstates[ctx.hi].freq)
+			ctx.hi = i;
+	}
+
+	if (ctx.lo == ctx.hi)
+		return -EINVAL;
+
+	ctx.samples = kmalloc_array(ZEN_CALIB_SAMPLES, sizeof(*ctx.samples),
+				    GFP_KERNEL);
+	if (!ctx.samples)
+		return -ENOMEM;
+
+	ret = work_on_cpu(zcpu->cpu, zen_freq_calib_run, &ctx);
+	if (ret)
+		goto out;
+
+	sort(ctx.samples, ZEN_CALIB_SAMPLES, sizeof(*ctx.samples),
+	     zen_freq_calib_cmp, NULL);
+	zcpu->calib.timeouts = ctx.timeouts;
+	zcpu->calib.min_ns = ctx.samples[0];
+	zcpu->calib.median_ns = ctx.samples[ZEN_CALIB_SAMPLES / 2];
+	zcpu->calib.p99_ns = ctx.samples[DIV_ROUND_UP(ZEN_CALIB_SAMPLES * 99, 100) - 1];
+
+	pr_info("CPU %u: transition latency min=%u median=%u p99=%u ns (%u timeouts)\n",
+		zcpu->cpu, zcpu->calib.min_ns, zcpu->calib.median_ns,
+		zcpu->calib.p99_ns, zcpu->calib.timeouts);
+
+out:
+	kfree(ctx.samples);
+
+	return ret;
+}
+
+/**
+ * zen_freq_calibrate_latency - Measure P-state transition latency
+ * @zcpu:	Domain data, siblings already parked
+ *
+ * The cores of a package share one SMU and one set of P-state
+ * definitions, so only the package's first domain is timed; the others
+ * take its result instead of spending another ZEN_CALIB_SAMPLES
+ * transitions each in ->init. Domains without a package are timed on
+ * their own.
+ *
+ * Return: 0 on success, negative error code if calibration is not possible
+ */
+int zen_freq_calibrate_latency(struct zen_freq_cpu *zcpu)
+{
+	struct zen_freq_pkg *pkg = zcpu->pkg;
+	int ret = 0;
+
+	mutex_lock(&zfreq_calib_mutex);
 
-	/* Set up RCU pointer */
-	RCU_INIT_POINTER(zcpu->freq_table_rcu, table);
+	if (pkg && pkg->calib.min_ns) {
+		zcpu->calib = pkg->calib;
+	} else {
+		ret = zen_freq_calib_measure(zcpu);
+		if (!ret && pkg)
+			pkg->calib = zcpu->calib;
+	}
 
-	return 0;
-}
+	mutex_unlock(&zfreq_calib_mutex);
 
-unsigned int zen_freq_get_frequency(struct zen_freq_cpu *zcpu, unsigned int pstate)
-{
-	if (pstate < zcpu->num_pstates)
-		return zcpu->pstates[pstate].freq;
-	return 0;
+	return ret;
 }
 
 /* ============================================================================
@@ -1025,15 +3473,36 @@ unsigned int zen_freq_get_frequency(struct zen_freq_cpu *zcpu, unsigned int psta
 static int zen_freq_init_cpu(struct cpufreq_policy *policy)
 {
 	struct zen_freq_cpu *zcpu;
+	unsigned int cpu;
 	int ret;
 
-	zcpu = kzalloc(sizeof(*zcpu), GFP_KERNEL);
+	/* Keep the hot fields on the node of the CPU that writes them */
+	zcpu = kzalloc_node(sizeof(*zcpu), GFP_KERNEL, cpu_to_node(policy->cpu));
 	if (!zcpu)
 		return -ENOMEM;
 
 	zcpu->cpu = policy->cpu;
+
+	/* SMT siblings share the core's clock: one policy per core */
+	cpumask_copy(policy->cpus, topology_sibling_cpumask(policy->cpu));
+	cpumask_set_cpu(policy->cpu, policy->cpus);
+	cpumask_copy(&zcpu->domain_cpus, policy->cpus);
+
 	spin_lock_init(&zcpu->update_lock);
+	seqcount_spinlock_init(&zcpu->perf_seq, &zcpu->update_lock);
+	init_irq_work(&zcpu->remote_work, zen_freq_remote_work_fn);
+	atomic_set(&zcpu->remote_pending, 0);
+	zcpu->cppc_req_cached = U64_MAX;
+	zcpu->pstate_ctl_cached = U64_MAX;
+	u64_stats_init(&zcpu->stats.syncp);
+	u64_stats_init(&zcpu->slow_stats.syncp);
+	u64_stats_init(&zcpu->stats.switch_syncp);
+	u64_stats_init(&zcpu->stats.phase_syncp);
+	zcpu->stats_pstate = ZEN_MAX_PSTATES;
+	zcpu->phase.pred = ZEN_PHASE_NO_PRED;
 	zcpu->boost_enabled = zen_freq_boost_enabled;
+	zcpu->boost_granted = true;
+	zcpu->pkg = zen_freq_pkg_get(policy->cpu);
 	atomic_set(&zcpu->cur_freq, 0);
 
 	ret = zen_freq_get_pstate_info(zcpu);
@@ -1053,31 +3522,40 @@ static int zen_freq_init_cpu(struct cpufreq_policy *policy)
 		return ret;
 	}
 
-	/* Allocate initial performance target */
-	zcpu->perf_target = zen_perf_target_alloc(GFP_KERNEL);
-	if (!zcpu->perf_target) {
-		kfree(zcpu->freq_table);
-		kfree(zcpu);
-		return -ENOMEM;
-	}
-
-	per_cpu(zfreq_cpu_data, policy->cpu) = zcpu;
+	for_each_cpu(cpu, &zcpu->domain_cpus)
+		rcu_assign_pointer(per_cpu(zfreq_cpu_data, cpu), zcpu);
+	zcpu->uclamp_max_perf = 255;
 	policy->driver_data = zcpu;
 	zcpu->cur_policy = policy;
 
+	/* CPUs onlined after module load join the existing ranking */
+	zen_prefcore_apply(zcpu);
+
 	policy->freq_table = zcpu->freq_table;
 	policy->cpuinfo.transition_latency = 1000;  /* 1us */
 	policy->min = zcpu->min_freq;
 	policy->max = zcpu->max_freq;
-	policy->fast_switch_possible = true;
 
-	/* Register update util callback (kernel version aware) */
-	zen_freq_register_update_util_hook(policy->cpu, zcpu);
+	/* CPPC must be on before the first request, parked ones included */
+	zen_cppc_enable_domain(zcpu);
+
+	/* Siblings defer to the owner's request */
+	zen_freq_domain_park(zcpu);
+
+	/* P-state writes are what get timed; CPPC leaves pacing to firmware */
+	if (zen_freq_calibrate && !zen_cppc_active() &&
+	    !zen_freq_calibrate_latency(zcpu))
+		policy->cpuinfo.transition_latency = zcpu->calib.median_ns;
+
+	/* Every thread samples its own busy fraction from the scheduler hook */
+	for_each_cpu(cpu, &zcpu->domain_cpus)
+		zen_freq_register_update_util_hook(cpu, zcpu);
 
-	zfreq_driver.features |= ZEN_FEAT_IO_BOOST;
+	zen_freq_feature_set(ZEN_FEAT_IO_BOOST);
 
-	pr_info("CPU %u initialized: min=%u, max=%u kHz\n",
-		policy->cpu, policy->min, policy->max);
+	pr_info("CPU %u initialized: min=%u, max=%u kHz, domain=%*pbl\n",
+		policy->cpu, policy->min, policy->max,
+		cpumask_pr_args(&zcpu->domain_cpus));
 
 	return 0;
 }
@@ -1085,22 +3563,33 @@ static int zen_freq_init_cpu(struct cpufreq_policy *policy)
 static int zen_freq_exit_cpu(struct cpufreq_policy *policy)
 {
 	struct zen_freq_cpu *zcpu = policy->driver_data;
+	unsigned int cpu;
 
-	zen_freq_unregister_update_util_hook(policy->cpu);
+	if (!zcpu)
+		return 0;
 
-	if (zcpu) {
-		kfree(zcpu->freq_table);
-		kfree(zcpu->perf_target);
-		kfree(zcpu);
-		per_cpu(zfreq_cpu_data, policy->cpu) = NULL;
+#ifdef CONFIG_ENERGY_MODEL
+	em_dev_unregister_perf_domain(get_cpu_device(policy->cpu));
+#endif
+
+	for_each_cpu(cpu, &zcpu->domain_cpus) {
+		zen_freq_unregister_update_util_hook(cpu);
+		RCU_INIT_POINTER(per_cpu(zfreq_cpu_data, cpu), NULL);
 	}
 
+	/* Let running hooks, timers and sysfs/debugfs walkers drop zcpu */
+	synchronize_rcu();
+
+	irq_work_sync(&zcpu->remote_work);
+	zen_freq_free_freq_table(zcpu);
+	kfree(zcpu);
+
 	return 0;
 }
 
 static int zen_freq_verify_policy(struct cpufreq_policy_data *policy)
 {
-	struct zen_freq_cpu *zcpu = per_cpu(zfreq_cpu_data, policy->cpu);
+	struct zen_freq_cpu *zcpu = zen_freq_cpu_get(policy->cpu);
 
 	if (!zcpu)
 		return -EINVAL;
@@ -1122,33 +3611,97 @@ static int zen_freq_set_policy(struct cpufreq_policy *policy)
 	if (!zcpu)
 		return -EINVAL;
 
-	/* Update performance target (RCU-protected) */
+	/* Update performance target (allocation-free) */
 	zen_perf_target_update(zcpu,
-			       ZEN_FREQ_TO_PERF(policy->max, zcpu->min_freq,
-						zcpu->max_freq, 0, 255),
-			       ZEN_FREQ_TO_PERF(policy->min, zcpu->min_freq,
-						zcpu->max_freq, 0, 255),
-			       zcpu->thermal_throttle_perf,
+			       zen_cppc_freq_to_perf(zcpu, policy->max),
+			       zen_cppc_freq_to_perf(zcpu, policy->min),
+			       zen_cppc_freq_to_perf(zcpu, policy->max),
 			       zcpu->dynamic_epp);
 
+	/* Apply the new limits right away in CPPC mode */
+	if (zen_cppc_active()) {
+		preempt_disable();
+		zen_cppc_commit(zcpu, READ_ONCE(zcpu->cppc_desired));
+		preempt_enable();
+	}
+
 	return 0;
 }
 
 static unsigned int zen_freq_get(unsigned int cpu)
 {
-	struct zen_freq_cpu *zcpu = per_cpu(zfreq_cpu_data, cpu);
+	struct zen_freq_cpu *zcpu = zen_freq_cpu_get(cpu);
+	u32 eff;
 
 	if (!zcpu)
 		return 0;
 
+	/* Prefer the measured frequency over the last request */
+	eff = READ_ONCE(zcpu->eff_freq);
+	if (eff)
+		return eff;
+
 	return atomic_read(&zcpu->cur_freq);
 }
 
+/**
+ * zen_freq_snapshot_save - Record the domain's request before it goes down
+ * @zcpu:	Domain data
+ *
+ * Suspend takes every non-boot CPU offline after cpufreq has suspended,
+ * so the first snapshot wins and ->offline cannot overwrite it with the
+ * floor suspend just wrote.
+ */
+static void zen_freq_snapshot_save(struct zen_freq_cpu *zcpu)
+{
+	if (zcpu->snap.valid)
+		return;
+
+	zcpu->snap.pstate = zcpu->cur_pstate;
+	zcpu->snap.cppc_req = zcpu->cppc_req_cached;
+	zcpu->snap.valid = true;
+}
+
+/**
+ * zen_freq_snapshot_restore_local - Put the saved request back
+ * @info:	Pointer to struct zen_freq_cpu, must run on the domain owner
+ *
+ * Firmware or the unplug may have rewritten the control MSRs, so the
+ * shadows are dropped and the saved request is written as it was. The
+ * perf target and policy limits are untouched, so nothing is re-derived.
+ */
+static void zen_freq_snapshot_restore_local(void *info)
+{
+	struct zen_freq_cpu *zcpu = info;
+
+	zcpu->pstate_ctl_cached = U64_MAX;
+	zcpu->cppc_req_cached = U64_MAX;
+	/* APERF/MPERF may have been reset while down */
+	zcpu->eff_sample_ns = 0;
+	WRITE_ONCE(zcpu->eff_cap_freq, 0);
+
+	/* A thread that was unplugged comes back with CPPC off */
+	if (zen_cppc_active() && wrmsrl_safe(MSR_AMD_CPPC_ENABLE, 1))
+		pr_warn("CPU %u: Failed to enable CPPC\n", zcpu->cpu);
+
+	if (zen_cppc_active() && zcpu->snap.cppc_req != U64_MAX) {
+		wrmsrl(MSR_AMD_CPPC_REQ, zcpu->snap.cppc_req);
+		zcpu->cppc_req_cached = zcpu->snap.cppc_req;
+	}
+
+	zcpu->cur_pstate = zcpu->snap.pstate;
+	zen_write_pstate_local(zcpu);
+
+	zcpu->snap.valid = false;
+}
+
 static int zen_freq_suspend(struct cpufreq_policy *policy)
 {
 	struct zen_freq_cpu *zcpu = policy->driver_data;
 
 	if (zcpu && zcpu->num_pstates > 0) {
+		zen_freq_snapshot_save(zcpu);
+
 		/* Set to lowest P-state for power saving */
 		zcpu->cur_pstate = zcpu->num_pstates - 1;
 		smp_call_function_single(zcpu->cpu, zen_write_pstate_local, zcpu, 1);
@@ -1157,22 +3710,490 @@ static int zen_freq_suspend(struct cpufreq_policy *policy)
 	return 0;
 }
 
+/**
+ * zen_freq_offline_cpu - Take the last thread of a domain down
+ * @policy:	Policy going inactive
+ *
+ * Called by cpufreq instead of ->exit, so zcpu, its hooks and the
+ * snapshot survive until the domain comes back. On hotplug this runs on
+ * the departing owner and the write is local; on driver removal it may
+ * run anywhere.
+ */
+static int zen_freq_offline_cpu(struct cpufreq_policy *policy)
+{
+	struct zen_freq_cpu *zcpu = policy->driver_data;
+
+	if (!zcpu || zcpu->num_pstates == 0)
+		return 0;
+
+	zen_freq_snapshot_save(zcpu);
+	zcpu->cur_pstate = zcpu->num_pstates - 1;
+	smp_call_function_single(zcpu->cpu, zen_write_pstate_local, zcpu, 1);
+
+	return 0;
+}
+
+/**
+ * zen_freq_online_cpu - Bring a fully unplugged domain back
+ * @policy:	Inactive policy, policy->cpu is the thread coming up
+ *
+ * The returning thread owns the domain again and gets the request the
+ * domain held before ->offline; cpufreq re-applies the policy limits
+ * through ->setpolicy right after.
+ */
+static int zen_freq_online_cpu(struct cpufreq_policy *policy)
+{
+	struct zen_freq_cpu *zcpu = policy->driver_data;
+
+	if (!zcpu)
+		return -ENODEV;
+
+	irq_work_sync(&zcpu->remote_work);
+	WRITE_ONCE(zcpu->cpu, policy->cpu);
+
+	if (zcpu->snap.valid)
+		smp_call_function_single(zcpu->cpu, zen_freq_snapshot_restore_local,
+					 zcpu, 1);
+
+	return 0;
+}
+
 static int zen_freq_resume(struct cpufreq_policy *policy)
 {
+	struct zen_freq_cpu *zcpu = policy->driver_data;
+
+	if (!zcpu)
+		return -EINVAL;
+
+	zen_cppc_enable_domain(zcpu);
+	zen_freq_domain_park(zcpu);
+
+	/* Domains brought back by ->online have already been restored */
+	if (zcpu->snap.valid) {
+		smp_call_function_single(zcpu->cpu, zen_freq_snapshot_restore_local,
+					 zcpu, 1);
+		return 0;
+	}
+
+	/* Firmware may have rewritten the MSRs; drop the shadows */
+	WRITE_ONCE(zcpu->pstate_ctl_cached, U64_MAX);
+	WRITE_ONCE(zcpu->cppc_req_cached, U64_MAX);
+	zcpu->eff_sample_ns = 0;
+	WRITE_ONCE(zcpu->eff_cap_freq, 0);
+
 	return zen_freq_set_policy(policy);
 }
 
-static int zen_freq_set_boost(struct cpufreq_policy *policy, int state)
+static int zen_freq_set_boost(struct cpufreq_policy *policy, int state)
+{
+	struct zen_freq_cpu *zcpu = policy->driver_data;
+
+	if (!zcpu || !zcpu->boost_supported)
+		return -EINVAL;
+
+	zcpu->boost_enabled = state;
+	policy->max = state ? zcpu->max_freq : zcpu->nominal_freq;
+
+	return 0;
+}
+
+/* ============================================================================
+ * Statistics Export
+ * ============================================================================ */
+
+/**
+ * zen_freq_stats_read - Take a consistent snapshot of one CPU's counters
+ * @zcpu:	Per-CPU data
+ * @snap:	Output snapshot
+ *
+ * Safe to call from any CPU. total_time_ns includes the residency of the
+ * current P-state up to now.
+ */
+void zen_freq_stats_read(struct zen_freq_cpu *zcpu,
+			 struct zen_freq_stats_snapshot *snap)
+{
+	unsigned int start;
+	u64 since, now;
+
+	do {
+		start = u64_stats_fetch_begin(&zcpu->stats.syncp);
+		snap->transitions = u64_stats_read(&zcpu->stats.transitions);
+		snap->io_boosts = u64_stats_read(&zcpu->stats.io_boosts);
+		snap->remote_writes = u64_stats_read(&zcpu->stats.remote_writes);
+		snap->total_time_ns = u64_stats_read(&zcpu->stats.total_time_ns);
+		snap->writes_avoided = u64_stats_read(&zcpu->stats.writes_avoided);
+		since = READ_ONCE(zcpu->stats_since_ns);
+	} while (u64_stats_fetch_retry(&zcpu->stats.syncp, start));
+
+	do {
+		start = u64_stats_fetch_begin(&zcpu->slow_stats.syncp);
+		snap->thermal_events =
+			u64_stats_read(&zcpu->slow_stats.thermal_events);
+		snap->voltage_clamps =
+			u64_stats_read(&zcpu->slow_stats.voltage_clamps);
+	} while (u64_stats_fetch_retry(&zcpu->slow_stats.syncp, start));
+
+	do {
+		start = u64_stats_fetch_begin(&zcpu->stats.switch_syncp);
+		snap->suppressed_up = u64_stats_read(&zcpu->stats.suppressed_up);
+		snap->suppressed_down = u64_stats_read(&zcpu->stats.suppressed_down);
+	} while (u64_stats_fetch_retry(&zcpu->stats.switch_syncp, start));
+
+	do {
+		start = u64_stats_fetch_begin(&zcpu->stats.phase_syncp);
+		snap->phase_predictions = u64_stats_read(&zcpu->stats.phase_predictions);
+		snap->phase_hits = u64_stats_read(&zcpu->stats.phase_hits);
+	} while (u64_stats_fetch_retry(&zcpu->stats.phase_syncp, start));
+
+	now = sched_clock();
+	if (READ_ONCE(zcpu->stats_pstate) < ZEN_MAX_PSTATES && now > since)
+		snap->total_time_ns += now - since;
+}
+
+/**
+ * zen_freq_residency_read - Snapshot one domain's residency and transitions
+ * @zcpu:	Domain data
+ * @cpu:	CPU the record is reported under
+ * @rec:	Record to fill
+ */
+static void zen_freq_residency_read(struct zen_freq_cpu *zcpu, unsigned int cpu,
+				    struct zen_freq_residency_record *rec)
+{
+	unsigned int start, i, j, cur;
+	u64 since, now;
+
+	memset(rec, 0, sizeof(*rec));
+	rec->cpu = cpu;
+	rec->nr_pstates = zcpu->num_pstates;
+	for (i = 0; i < zcpu->num_pstates; i++)
+		rec->freq[i] = zcpu->pstates[i].freq;
+
+	do {
+		start = u64_stats_fetch_begin(&zcpu->stats.syncp);
+		for (i = 0; i < ZEN_MAX_PSTATES; i++) {
+			rec->time_ns[i] = u64_stats_read(&zcpu->stats.time_in_state[i]);
+			for (j = 0; j < ZEN_MAX_PSTATES; j++)
+				rec->trans[i][j] = u64_stats_read(&zcpu->stats.trans[i][j]);
+		}
+		since = READ_ONCE(zcpu->stats_since_ns);
+		cur = READ_ONCE(zcpu->stats_pstate);
+	} while (u64_stats_fetch_retry(&zcpu->stats.syncp, start));
+
+	now = sched_clock();
+	if (cur < ZEN_MAX_PSTATES && now > since)
+		rec->time_ns[cur] += now - since;
+}
+
+static int zen_freq_stats_debugfs_show(struct seq_file *m, void *v)
+{
+	struct zen_freq_stats_snapshot snap;
+	struct zen_freq_cpu *zcpu;
+	unsigned int cpu;
+
+	seq_puts(m, "cpu pstate transitions io_boosts remote_writes "
+		    "thermal_events voltage_clamps total_time_ns "
+		    "writes_avoided suppressed_up suppressed_down "
+		    "phase_period phase_confidence phase_predictions phase_hits\n");
+
+	rcu_read_lock();
+	for_each_possible_cpu(cpu) {
+		zcpu = zen_freq_cpu_rcu(cpu);
+		if (!zcpu || !zen_freq_domain_leader(zcpu, cpu))
+			continue;
+
+		zen_freq_stats_read(zcpu, &snap);
+		seq_printf(m, "%u %u %llu %llu %llu %llu %llu %llu %llu %llu %llu %u %u %llu %llu\n",
+			   cpu, READ_ONCE(zcpu->cur_pstate),
+			   snap.transitions, snap.io_boosts, snap.remote_writes,
+			   snap.thermal_events, snap.voltage_clamps,
+			   snap.total_time_ns, snap.writes_avoided,
+			   snap.suppressed_up, snap.suppressed_down,
+			   READ_ONCE(zcpu->phase.period),
+			   READ_ONCE(zcpu->phase.confidence),
+			   snap.phase_predictions, snap.phase_hits);
+	}
+	rcu_read_unlock();
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(zen_freq_stats_debugfs);
+
+static int zen_freq_thermal_debugfs_show(struct seq_file *m, void *v)
+{
+	struct zen_thermal_domain *dom;
+	struct zen_freq_pkg *pkg;
+	unsigned int i, j;
+
+	seq_puts(m, "domain sample_cpu cpus temp interval_ms\n");
+
+	for (i = 0; i < zfreq_driver.nr_pkgs; i++) {
+		pkg = zfreq_driver.pkgs[i];
+		if (!pkg)
+			continue;
+
+		for (j = 0; j < pkg->nr_thermal; j++) {
+			dom = &pkg->thermal[j];
+			seq_printf(m, "%#x %u %u %u %u\n", dom->id,
+				   READ_ONCE(dom->sample_cpu),
+				   cpumask_weight(&dom->cpus),
+				   READ_ONCE(dom->prev_temp),
+				   READ_ONCE(dom->interval_ms));
+		}
+	}
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(zen_freq_thermal_debugfs);
+
+static int zen_freq_latency_debugfs_show(struct seq_file *m, void *v)
+{
+	struct zen_freq_cpu *zcpu;
+	unsigned int cpu;
+
+	seq_puts(m, "cpu min_ns median_ns p99_ns timeouts transition_latency_ns\n");
+
+	rcu_read_lock();
+	for_each_possible_cpu(cpu) {
+		zcpu = zen_freq_cpu_rcu(cpu);
+		if (!zcpu || !zen_freq_domain_leader(zcpu, cpu) || !zcpu->calib.min_ns)
+			continue;
+
+		seq_printf(m, "%u %u %u %u %u %u\n", cpu, zcpu->calib.min_ns,
+			   zcpu->calib.median_ns, zcpu->calib.p99_ns,
+			   zcpu->calib.timeouts,
+			   zcpu->cur_policy ?
+			   zcpu->cur_policy->cpuinfo.transition_latency : 0);
+	}
+	rcu_read_unlock();
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(zen_freq_latency_debugfs);
+
+#ifdef CONFIG_ZEN_FREQ_DEBUG
+#define ZEN_BENCH_MAX_CALLS		100000
+#define ZEN_BENCH_SYNC_NS		(10 * NSEC_PER_MSEC)
+
+struct zen_freq_bench {
+	atomic_t		ready;
+	unsigned int		nr_cpus;
+	unsigned int		calls;
+};
+
+static DEFINE_PER_CPU(u64, zfreq_bench_ns);
+static unsigned int zfreq_bench_calls;
+static DEFINE_MUTEX(zfreq_bench_mutex);
+
+/*
+ * Runs in IPI context on every domain owner at once. Each owner waits for
+ * the others so the bursts really overlap, then re-requests its current
+ * frequency: the P-state is left as it was and the figure is the cost of
+ * a coalesced fast switch while every domain hammers the shared state.
+ */
+static void zen_freq_bench_local(void *info)
+{
+	struct zen_freq_bench *bench = info;
+	struct zen_freq_cpu *zcpu = zen_freq_cpu_get(smp_processor_id());
+	u64 start, deadline = ktime_get_ns() + ZEN_BENCH_SYNC_NS;
+	unsigned int i, freq;
+
+	atomic_inc(&bench->ready);
+	while (atomic_read(&bench->ready) < bench->nr_cpus &&
+	       ktime_get_ns() < deadline)
+		cpu_relax();
+
+	if (!zcpu || !zcpu->cur_policy)
+		return;
+
+	freq = atomic_read(&zcpu->cur_freq);
+	start = ktime_get_ns();
+	for (i = 0; i < bench->calls; i++)
+		zen_freq_fast_switch_lockless(zcpu->cur_policy, freq);
+
+	this_cpu_write(zfreq_bench_ns, div_u64(ktime_get_ns() - start,
+					       bench->calls));
+}
+
+static ssize_t zen_freq_bench_write(struct file *file, const char __user *ubuf,
+				    size_t count, loff_t *ppos)
+{
+	struct zen_freq_bench bench = { .ready = ATOMIC_INIT(0) };
+	struct zen_freq_cpu *zcpu;
+	cpumask_var_t owners;
+	unsigned int cpu;
+	int ret;
+
+	ret = kstrtouint_from_user(ubuf, count, 0, &bench.calls);
+	if (ret)
+		return ret;
+
+	if (!bench.calls || bench.calls > ZEN_BENCH_MAX_CALLS)
+		return -EINVAL;
+
+	if (!zalloc_cpumask_var(&owners, GFP_KERNEL))
+		return -ENOMEM;
+
+	mutex_lock(&zfreq_bench_mutex);
+	cpus_read_lock();
+
+	for_each_possible_cpu(cpu)
+		per_cpu(zfreq_bench_ns, cpu) = 0;
+
+	for_each_online_cpu(cpu) {
+		zcpu = zen_freq_cpu_get(cpu);
+		if (zcpu && zcpu->cpu == cpu && zcpu->cur_policy)
+			cpumask_set_cpu(cpu, owners);
+	}
+
+	bench.nr_cpus = cpumask_weight(owners);
+	on_each_cpu_mask(owners, zen_freq_bench_local, &bench, true);
+	zfreq_bench_calls = bench.calls;
+
+	cpus_read_unlock();
+	mutex_unlock(&zfreq_bench_mutex);
+
+	free_cpumask_var(owners);
+
+	return count;
+}
+
+static int zen_freq_bench_show(struct seq_file *m, void *v)
+{
+	unsigned int cpu;
+	u64 ns;
+
+	seq_puts(m, "cpu calls ns_per_call\n");
+
+	mutex_lock(&zfreq_bench_mutex);
+	for_each_possible_cpu(cpu) {
+		ns = per_cpu(zfreq_bench_ns, cpu);
+		if (ns)
+			seq_printf(m, "%u %u %llu\n", cpu, zfreq_bench_calls,
+				   ns);
+	}
+	mutex_unlock(&zfreq_bench_mutex);
+
+	return 0;
+}
+
+static int zen_freq_bench_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, zen_freq_bench_show, NULL);
+}
+
+static const struct file_operations zen_freq_bench_fops = {
+	.owner		= THIS_MODULE,
+	.open		= zen_freq_bench_open,
+	.read		= seq_read,
+	.write		= zen_freq_bench_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+#endif /* CONFIG_ZEN_FREQ_DEBUG */
+
+static void zen_freq_debugfs_init(void)
+{
+	zfreq_driver.debugfs = debugfs_create_dir("zen_freq", NULL);
+	debugfs_create_file("stats", 0444, zfreq_driver.debugfs, NULL,
+			    &zen_freq_stats_debugfs_fops);
+	debugfs_create_file("thermal", 0444, zfreq_driver.debugfs, NULL,
+			    &zen_freq_thermal_debugfs_fops);
+	debugfs_create_file("latency", 0444, zfreq_driver.debugfs, NULL,
+			    &zen_freq_latency_debugfs_fops);
+#ifdef CONFIG_ZEN_FREQ_DEBUG
+	debugfs_create_file("bench", 0600, zfreq_driver.debugfs, NULL,
+			    &zen_freq_bench_fops);
+#endif
+}
+
+static void zen_freq_debugfs_exit(void)
+{
+	debugfs_remove_recursive(zfreq_driver.debugfs);
+	zfreq_driver.debugfs = NULL;
+}
+
+/* ============================================================================
+ * Userspace Request Channel
+ * ============================================================================ */
+
+static size_t zen_freq_user_size(void)
+{
+	return PAGE_ALIGN(nr_cpu_ids * sizeof(struct zen_freq_user_slot));
+}
+
+static int zen_freq_user_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	size_t len = vma->vm_end - vma->vm_start;
+
+	if (vma->vm_pgoff || len > zen_freq_user_size())
+		return -EINVAL;
+
+	return remap_vmalloc_range(vma, zfreq_user_slots, 0);
+}
+
+static long zen_freq_user_ioctl(struct file *file, unsigned int cmd,
+				unsigned long arg)
+{
+	struct zen_freq_user_req req;
+
+	if (cmd != ZEN_FREQ_IOC_SET_PERF)
+		return -ENOTTY;
+
+	if (copy_from_user(&req, (void __user *)arg, sizeof(req)))
+		return -EFAULT;
+
+	if (req.cpu >= nr_cpu_ids || !cpu_possible(req.cpu) || req.perf > 255)
+		return -EINVAL;
+
+	WRITE_ONCE(zfreq_user_slots[req.cpu].perf, req.perf);
+	return 0;
+}
+
+static const struct file_operations zen_freq_user_fops = {
+	.owner		= THIS_MODULE,
+	.mmap		= zen_freq_user_mmap,
+	.unlocked_ioctl	= zen_freq_user_ioctl,
+	.llseek		= noop_llseek,
+};
+
+static struct miscdevice zen_freq_user_dev = {
+	.minor	= MISC_DYNAMIC_MINOR,
+	.name	= ZEN_USER_DEV_NAME,
+	.fops	= &zen_freq_user_fops,
+	.mode	= 0600,
+};
+
+/*
+ * Not fatal: the driver works without the channel, userspace mode then
+ * just follows the scheduler.
+ */
+static void zen_freq_user_init(void)
+{
+	struct zen_freq_user_slot *slots;
+
+	slots = vmalloc_user(zen_freq_user_size());
+	if (!slots) {
+		pr_warn("Userspace request page unavailable\n");
+		return;
+	}
+
+	WRITE_ONCE(zfreq_user_slots, slots);
+	if (misc_register(&zen_freq_user_dev)) {
+		pr_warn("Failed to register /dev/%s\n", ZEN_USER_DEV_NAME);
+		WRITE_ONCE(zfreq_user_slots, NULL);
+		vfree(slots);
+	}
+}
+
+/* Runs after the cpufreq driver is gone, so no hot path can see the page */
+static void zen_freq_user_exit(void)
 {
-	struct zen_freq_cpu *zcpu = policy->driver_data;
-
-	if (!zcpu || !zcpu->boost_supported)
-		return -EINVAL;
-
-	zcpu->boost_enabled = state;
-	policy->max = state ? zcpu->max_freq : zcpu->nominal_freq;
+	if (!zfreq_user_slots)
+		return;
 
-	return 0;
+	misc_deregister(&zen_freq_user_dev);
+	vfree(zfreq_user_slots);
+	zfreq_user_slots = NULL;
 }
 
 /* ============================================================================
@@ -1188,18 +4209,27 @@ static ssize_t mode_show(struct device *dev, struct device_attribute *attr,
 static ssize_t mode_store(struct device *dev, struct device_attribute *attr,
 			  const char *buf, size_t count)
 {
+	unsigned int mode;
+
 	if (strncmp(buf, "powersave", 9) == 0)
-		zen_freq_mode = ZEN_FREQ_MODE_POWERSAVE;
+		mode = ZEN_FREQ_MODE_POWERSAVE;
 	else if (strncmp(buf, "balance", 7) == 0)
-		zen_freq_mode = ZEN_FREQ_MODE_BALANCE;
+		mode = ZEN_FREQ_MODE_BALANCE;
 	else if (strncmp(buf, "performance", 11) == 0)
-		zen_freq_mode = ZEN_FREQ_MODE_PERFORMANCE;
-	else if (kstrtouint(buf, 10, &zen_freq_mode) == 0) {
-		if (zen_freq_mode > ZEN_FREQ_MODE_USERSPACE)
-			return -EINVAL;
-	} else {
+		mode = ZEN_FREQ_MODE_PERFORMANCE;
+	else if (strncmp(buf, "userspace", 9) == 0)
+		mode = ZEN_FREQ_MODE_USERSPACE;
+	else if (strncmp(buf, "efficient", 9) == 0)
+		mode = ZEN_FREQ_MODE_EFFICIENT;
+	else if (kstrtouint(buf, 10, &mode) || mode > ZEN_FREQ_MODE_EFFICIENT)
 		return -EINVAL;
-	}
+
+	/* The P-state choice it changes is only made in native mode */
+	if (mode == ZEN_FREQ_MODE_EFFICIENT &&
+	    !READ_ONCE(zen_freq_native_governor))
+		pr_info_once("efficient mode takes effect with native_governor=1\n");
+
+	WRITE_ONCE(zen_freq_mode, mode);
 
 	return count;
 }
@@ -1212,13 +4242,15 @@ static ssize_t thermal_state_show(struct device *dev, struct device_attribute *a
 	struct zen_freq_cpu *zcpu;
 	unsigned int cpu = 0;
 	const char *state_str;
+	int thermal_state;
 
 	/* Get first CPU's thermal state */
-	zcpu = per_cpu(zfreq_cpu_data, cpu);
-	if (!zcpu)
-		return sprintf(buf, "unknown\n");
+	rcu_read_lock();
+	zcpu = zen_freq_cpu_rcu(cpu);
+	thermal_state = zcpu ? READ_ONCE(zcpu->thermal_state) : -1;
+	rcu_read_unlock();
 
-	switch (zcpu->thermal_state) {
+	switch (thermal_state) {
 	case ZEN_THERMAL_NORMAL:
 		state_str = "normal";
 		break;
@@ -1275,55 +4307,591 @@ static ssize_t voltage_max_store(struct device *dev, struct device_attribute *at
 
 static DEVICE_ATTR_RW(voltage_max);
 
+static ssize_t thermal_controller_show(struct device *dev,
+				       struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%s\n",
+		       zen_freq_thermal_model == ZEN_THERMAL_MODEL_PREDICTIVE ?
+		       "predictive" : "pi");
+}
+
+static ssize_t thermal_controller_store(struct device *dev,
+					struct device_attribute *attr,
+					const char *buf, size_t count)
+{
+	if (sysfs_streq(buf, "pi"))
+		WRITE_ONCE(zen_freq_thermal_model, ZEN_THERMAL_MODEL_PI);
+	else if (sysfs_streq(buf, "predictive"))
+		WRITE_ONCE(zen_freq_thermal_model, ZEN_THERMAL_MODEL_PREDICTIVE);
+	else
+		return -EINVAL;
+
+	return count;
+}
+
+static DEVICE_ATTR_RW(thermal_controller);
+
+/* Unsigned controller tunable with an upper bound */
+#define ZEN_THERMAL_TUNABLE(_name, _var, _max)				\
+static ssize_t _name##_show(struct device *dev,				\
+			    struct device_attribute *attr, char *buf)	\
+{									\
+	return sprintf(buf, "%u\n", READ_ONCE(_var));			\
+}									\
+									\
+static ssize_t _name##_store(struct device *dev,			\
+			     struct device_attribute *attr,		\
+			     const char *buf, size_t count)		\
+{									\
+	unsigned int val;						\
+									\
+	if (kstrtouint(buf, 10, &val) || val > (_max))			\
+		return -EINVAL;						\
+									\
+	WRITE_ONCE(_var, val);						\
+	return count;							\
+}									\
+									\
+static DEVICE_ATTR_RW(_name)
+
+ZEN_THERMAL_TUNABLE(thermal_kp, zen_freq_thermal_kp, 10000);
+ZEN_THERMAL_TUNABLE(thermal_ki, zen_freq_thermal_ki, 10000);
+ZEN_THERMAL_TUNABLE(thermal_kff, zen_freq_thermal_kff, 1000);
+ZEN_THERMAL_TUNABLE(thermal_horizon_ms, zen_freq_thermal_horizon_ms, 10000);
+ZEN_THERMAL_TUNABLE(power_limit_w, zen_freq_power_limit_w, 4000);
+ZEN_THERMAL_TUNABLE(power_kp, zen_freq_power_kp, 100000);
+ZEN_THERMAL_TUNABLE(power_ki, zen_freq_power_ki, 100000);
+
+static ssize_t power_show(struct device *dev, struct device_attribute *attr,
+			  char *buf)
+{
+	struct zen_power_pkg *pkg;
+	ssize_t len = 0;
+	unsigned int i;
+
+	if (!(zfreq_driver.features & ZEN_FEAT_POWER_GUARD))
+		return 0;
+
+	for (i = 0; i < zfreq_driver.nr_pkgs; i++) {
+		if (!zfreq_driver.pkgs[i])
+			continue;
+
+		pkg = &zfreq_driver.pkgs[i]->power;
+		len += sprintf(buf + len, "package%u: %u mW, max_perf %u\n",
+			       pkg->id, READ_ONCE(pkg->power_mw),
+			       READ_ONCE(pkg->max_perf));
+	}
+
+	return len;
+}
+
+static DEVICE_ATTR_RO(power);
+
 static ssize_t kernel_version_show(struct device *dev, struct device_attribute *attr,
 				   char *buf)
 {
-	return sprintf(buf, "%s (API: %s)\n",
-		       UTS_RELEASE,
-		       ZEN_USE_NEW_UTIL_API ? "6.6+" : "legacy");
+	return sprintf(buf, "%s\n", UTS_RELEASE);
 }
 
 static DEVICE_ATTR_RO(kernel_version);
 
+static ssize_t stats_show(struct device *dev, struct device_attribute *attr,
+			  char *buf)
+{
+	struct zen_freq_stats_snapshot snap, total = { 0 };
+	struct zen_freq_cpu *zcpu;
+	unsigned int cpu, nr = 0, confidence = 0;
+
+	/* Aggregate all domains so one read covers the whole system */
+	rcu_read_lock();
+	for_each_possible_cpu(cpu) {
+		zcpu = zen_freq_cpu_rcu(cpu);
+		if (!zcpu || !zen_freq_domain_leader(zcpu, cpu))
+			continue;
+
+		zen_freq_stats_read(zcpu, &snap);
+		total.transitions += snap.transitions;
+		total.io_boosts += snap.io_boosts;
+		total.remote_writes += snap.remote_writes;
+		total.thermal_events += snap.thermal_events;
+		total.voltage_clamps += snap.voltage_clamps;
+		total.total_time_ns += snap.total_time_ns;
+		total.writes_avoided += snap.writes_avoided;
+		total.suppressed_up += snap.suppressed_up;
+		total.suppressed_down += snap.suppressed_down;
+		total.phase_predictions += snap.phase_predictions;
+		total.phase_hits += snap.phase_hits;
+		confidence += READ_ONCE(zcpu->phase.confidence);
+		nr++;
+	}
+	rcu_read_unlock();
+
+	return sprintf(buf,
+		       "domains %u\n"
+		       "transitions %llu\n"
+		       "io_boosts %llu\n"
+		       "remote_writes %llu\n"
+		       "thermal_events %llu\n"
+		       "voltage_clamps %llu\n"
+		       "total_time_ns %llu\n"
+		       "writes_avoided %llu\n"
+		       "suppressed_up %llu\n"
+		       "suppressed_down %llu\n"
+		       "phase_confidence %u\n"
+		       "phase_predictions %llu\n"
+		       "phase_hits %llu\n",
+		       nr, total.transitions, total.io_boosts,
+		       total.remote_writes, total.thermal_events,
+		       total.voltage_clamps, total.total_time_ns,
+		       total.writes_avoided, total.suppressed_up,
+		       total.suppressed_down, nr ? confidence / nr : 0,
+		       total.phase_predictions, total.phase_hits);
+}
+
+static DEVICE_ATTR_RO(stats);
+
+static ssize_t boost_credits_show(struct device *dev,
+				  struct device_attribute *attr, char *buf)
+{
+	struct zen_boost_pkg *pkg;
+	ssize_t len = 0;
+	unsigned int i;
+
+	for (i = 0; i < zfreq_driver.nr_pkgs; i++) {
+		if (!zfreq_driver.pkgs[i])
+			continue;
+
+		pkg = &zfreq_driver.pkgs[i]->boost;
+		len += sprintf(buf + len, "package%u: %u/%u\n", pkg->id,
+			       READ_ONCE(pkg->nr_granted),
+			       READ_ONCE(pkg->nr_domains));
+	}
+
+	return len;
+}
+
+static DEVICE_ATTR_RO(boost_credits);
+
+static ssize_t residency_read(struct file *filp, struct kobject *kobj,
+			      struct bin_attribute *attr, char *buf,
+			      loff_t off, size_t count)
+{
+	struct zen_freq_residency_record rec;
+	const size_t rec_size = sizeof(rec);
+	struct zen_freq_cpu *zcpu;
+	loff_t pos = 0;
+	size_t copied = 0, skip, len;
+	unsigned int cpu;
+
+	/* Records are built on the fly; copy whatever overlaps the window */
+	rcu_read_lock();
+	for_each_possible_cpu(cpu) {
+		if (copied == count)
+			break;
+
+		zcpu = zen_freq_cpu_rcu(cpu);
+		if (!zcpu || !zen_freq_domain_leader(zcpu, cpu))
+			continue;
+
+		if (pos + rec_size <= off) {
+			pos += rec_size;
+			continue;
+		}
+
+		zen_freq_residency_read(zcpu, cpu, &rec);
+		skip = off > pos ? off - pos : 0;
+		len = min(rec_size - skip, count - copied);
+		memcpy(buf + copied, (char *)&rec + skip, len);
+		copied += len;
+		pos += rec_size;
+	}
+	rcu_read_unlock();
+
+	return copied;
+}
+
+static BIN_ATTR_RO(residency, 0);
+
+static struct bin_attribute *zen_freq_bin_attrs[] = {
+	&bin_attr_residency,
+	NULL
+};
+
 static struct attribute *zen_freq_attrs[] = {
 	&dev_attr_mode.attr,
 	&dev_attr_thermal_state.attr,
 	&dev_attr_temperature.attr,
 	&dev_attr_voltage_max.attr,
+	&dev_attr_thermal_controller.attr,
+	&dev_attr_thermal_kp.attr,
+	&dev_attr_thermal_ki.attr,
+	&dev_attr_thermal_kff.attr,
+	&dev_attr_thermal_horizon_ms.attr,
 	&dev_attr_kernel_version.attr,
+	&dev_attr_stats.attr,
+	&dev_attr_boost_credits.attr,
+	&dev_attr_power.attr,
+	&dev_attr_power_limit_w.attr,
+	&dev_attr_power_kp.attr,
+	&dev_attr_power_ki.attr,
 	NULL
 };
 
 static const struct attribute_group zen_freq_attr_group = {
-	.name = "zen_freq",
 	.attrs = zen_freq_attrs,
+	.bin_attrs = zen_freq_bin_attrs,
+};
+
+/* ============================================================================
+ * Per-Package Sysfs Interface
+ * ============================================================================ */
+
+static struct zen_freq_pkg *zen_freq_pkg_from_kobj(struct kobject *kobj)
+{
+	unsigned int i;
+
+	for (i = 0; i < zfreq_driver.nr_pkgs; i++) {
+		if (zfreq_driver.pkgs[i] && zfreq_driver.pkgs[i]->kobj == kobj)
+			return zfreq_driver.pkgs[i];
+	}
+
+	return NULL;
+}
+
+/* Throttling has to start below the emergency limit */
+static bool zen_pkg_soft_temp_valid(struct zen_freq_pkg *pkg, unsigned int soft)
+{
+	return soft < ZEN_PKG_VALUE(pkg, hard_temp, zen_freq_hard_temp);
+}
+
+static bool zen_pkg_hard_temp_valid(struct zen_freq_pkg *pkg, unsigned int hard)
+{
+	return hard > ZEN_PKG_VALUE(pkg, soft_temp, zen_freq_soft_temp);
+}
+
+static bool zen_pkg_any_valid(struct zen_freq_pkg *pkg, unsigned int val)
+{
+	return true;
+}
+
+/*
+ * Reads show the value in effect; writing -1 goes back to following the
+ * module parameter of the same name. @_valid checks the value that would
+ * take effect against the package's other tunables.
+ */
+#define ZEN_PKG_TUNABLE(_name, _global, _max, _valid)			\
+static ssize_t pkg_##_name##_show(struct kobject *kobj,			\
+				  struct kobj_attribute *attr, char *buf) \
+{									\
+	struct zen_freq_pkg *pkg = zen_freq_pkg_from_kobj(kobj);	\
+									\
+	if (!pkg)							\
+		return -ENODEV;						\
+									\
+	return sprintf(buf, "%u\n", ZEN_PKG_VALUE(pkg, _name, _global)); \
+}									\
+									\
+static ssize_t pkg_##_name##_store(struct kobject *kobj,		\
+				   struct kobj_attribute *attr,		\
+				   const char *buf, size_t count)	\
+{									\
+	struct zen_freq_pkg *pkg = zen_freq_pkg_from_kobj(kobj);	\
+	unsigned int val;						\
+									\
+	if (!pkg)							\
+		return -ENODEV;						\
+									\
+	if (sysfs_streq(buf, "-1"))					\
+		val = ZEN_PKG_INHERIT;					\
+	else if (kstrtouint(buf, 10, &val) || val > (_max))		\
+		return -EINVAL;						\
+									\
+	if (!_valid(pkg, val == ZEN_PKG_INHERIT ? READ_ONCE(_global) : val)) \
+		return -EINVAL;						\
+									\
+	WRITE_ONCE(pkg->_name, val);					\
+	return count;							\
+}									\
+									\
+static struct kobj_attribute pkg_attr_##_name =				\
+	__ATTR(_name, 0644, pkg_##_name##_show, pkg_##_name##_store)
+
+ZEN_PKG_TUNABLE(soft_temp, zen_freq_soft_temp, 125, zen_pkg_soft_temp_valid);
+ZEN_PKG_TUNABLE(hard_temp, zen_freq_hard_temp, 125, zen_pkg_hard_temp_valid);
+ZEN_PKG_TUNABLE(power_limit_w, zen_freq_power_limit_w, 4000, zen_pkg_any_valid);
+ZEN_PKG_TUNABLE(boost_credits, zen_freq_boost_credits, 1024, zen_pkg_any_valid);
+
+static ssize_t pkg_cpus_show(struct kobject *kobj, struct kobj_attribute *attr,
+			     char *buf)
+{
+	struct zen_freq_pkg *pkg = zen_freq_pkg_from_kobj(kobj);
+
+	if (!pkg)
+		return -ENODEV;
+
+	return cpumap_print_to_pagebuf(true, buf, &pkg->cpus);
+}
+
+static struct kobj_attribute pkg_attr_cpus = __ATTR(cpus, 0444, pkg_cpus_show, NULL);
+
+static ssize_t pkg_node_show(struct kobject *kobj, struct kobj_attribute *attr,
+			     char *buf)
+{
+	struct zen_freq_pkg *pkg = zen_freq_pkg_from_kobj(kobj);
+
+	if (!pkg)
+		return -ENODEV;
+
+	return sprintf(buf, "%d\n", pkg->node);
+}
+
+static struct kobj_attribute pkg_attr_node = __ATTR(node, 0444, pkg_node_show, NULL);
+
+static ssize_t pkg_power_mw_show(struct kobject *kobj,
+				 struct kobj_attribute *attr, char *buf)
+{
+	struct zen_freq_pkg *pkg = zen_freq_pkg_from_kobj(kobj);
+
+	if (!pkg)
+		return -ENODEV;
+
+	return sprintf(buf, "%u\n", READ_ONCE(pkg->power.power_mw));
+}
+
+static struct kobj_attribute pkg_attr_power_mw =
+	__ATTR(power_mw, 0444, pkg_power_mw_show, NULL);
+
+static struct attribute *zen_freq_pkg_attrs[] = {
+	&pkg_attr_cpus.attr,
+	&pkg_attr_node.attr,
+	&pkg_attr_soft_temp.attr,
+	&pkg_attr_hard_temp.attr,
+	&pkg_attr_power_limit_w.attr,
+	&pkg_attr_boost_credits.attr,
+	&pkg_attr_power_mw.attr,
+	NULL
+};
+
+static const struct attribute_group zen_freq_pkg_attr_group = {
+	.attrs = zen_freq_pkg_attrs,
+};
+
+static void zen_freq_sysfs_exit(void)
+{
+	struct zen_freq_pkg *pkg;
+	unsigned int i;
+
+	if (!zfreq_driver.kobj)
+		return;
+
+	for (i = 0; i < zfreq_driver.nr_pkgs; i++) {
+		pkg = zfreq_driver.pkgs[i];
+		if (pkg && pkg->kobj) {
+			kobject_put(pkg->kobj);
+			pkg->kobj = NULL;
+		}
+	}
+
+	kobject_put(zfreq_driver.kobj);
+	zfreq_driver.kobj = NULL;
+}
+
+/**
+ * zen_freq_sysfs_init - Create /sys/kernel/zen_freq and its package dirs
+ *
+ * Return: 0 on success, negative errno on failure
+ */
+static int zen_freq_sysfs_init(void)
+{
+	struct zen_freq_pkg *pkg;
+	char name[16];
+	unsigned int i;
+	int ret;
+
+	zfreq_driver.kobj = kobject_create_and_add("zen_freq", kernel_kobj);
+	if (!zfreq_driver.kobj)
+		return -ENOMEM;
+
+	ret = sysfs_create_group(zfreq_driver.kobj, &zen_freq_attr_group);
+	if (ret)
+		goto err;
+
+	for (i = 0; i < zfreq_driver.nr_pkgs; i++) {
+		pkg = zfreq_driver.pkgs[i];
+		if (!pkg)
+			continue;
+
+		snprintf(name, sizeof(name), "package%u", pkg->id);
+		pkg->kobj = kobject_create_and_add(name, zfreq_driver.kobj);
+		if (!pkg->kobj) {
+			ret = -ENOMEM;
+			goto err;
+		}
+
+		ret = sysfs_create_group(pkg->kobj, &zen_freq_pkg_attr_group);
+		if (ret)
+			goto err;
+	}
+
+	return 0;
+
+err:
+	zen_freq_sysfs_exit();
+	return ret;
+}
+
+/* ============================================================================
+ * Per-Policy Sysfs Interface
+ * ============================================================================ */
+
+static ssize_t show_effective_freq(struct cpufreq_policy *policy, char *buf)
+{
+	struct zen_freq_cpu *zcpu = policy->driver_data;
+
+	if (!zcpu)
+		return -ENODEV;
+
+	return sprintf(buf, "%u\n", READ_ONCE(zcpu->eff_freq));
+}
+
+cpufreq_freq_attr_ro(effective_freq);
+
+static ssize_t show_prefcore_ranking(struct cpufreq_policy *policy, char *buf)
+{
+	struct zen_freq_cpu *zcpu = policy->driver_data;
+
+	if (!zcpu)
+		return -ENODEV;
+
+	return sprintf(buf, "%u\n", zcpu->prefcore_ranking);
+}
+
+cpufreq_freq_attr_ro(prefcore_ranking);
+
+static ssize_t show_uclamp_perf(struct cpufreq_policy *policy, char *buf)
+{
+	struct zen_freq_cpu *zcpu = policy->driver_data;
+
+	if (!zcpu)
+		return -ENODEV;
+
+	return sprintf(buf, "%u %u\n", READ_ONCE(zcpu->uclamp_min_perf),
+		       READ_ONCE(zcpu->uclamp_max_perf));
+}
+
+cpufreq_freq_attr_ro(uclamp_perf);
+
+static struct freq_attr *zen_freq_policy_attrs[] = {
+	&effective_freq,
+	&prefcore_ranking,
+	&uclamp_perf,
+	NULL
 };
 
 /* ============================================================================
  * CPU Hotplug
  * ============================================================================ */
 
+/*
+ * cpufreq calls the driver only for the first thread of a domain to come
+ * up and the last to go down (->online/->offline). This state covers the
+ * threads in between: it parks returning siblings and hands the request
+ * over when the owner leaves a domain that stays up.
+ */
+static enum cpuhp_state zen_freq_cpuhp_state;
+
+/**
+ * zen_freq_domain_other_online - Check for a domain thread besides @cpu
+ * @zcpu:	Domain data
+ * @cpu:	Thread to leave out
+ *
+ * Return: true if another thread of the domain is online
+ */
+static bool zen_freq_domain_other_online(struct zen_freq_cpu *zcpu,
+					 unsigned int cpu)
+{
+	unsigned int next;
+
+	for_each_cpu(next, &zcpu->domain_cpus) {
+		if (next != cpu && cpu_online(next))
+			return true;
+	}
+
+	return false;
+}
+
 static int zen_freq_cpu_online(unsigned int cpu)
 {
-	struct zen_freq_cpu *zcpu = per_cpu(zfreq_cpu_data, cpu);
+	struct zen_freq_cpu *zcpu = zen_freq_cpu_get(cpu);
+
+	if (!zcpu)
+		return 0;
+
+	/* Runs on @cpu; a hot-added thread starts with CPPC off */
+	if (zen_cppc_active() && wrmsrl_safe(MSR_AMD_CPPC_ENABLE, 1))
+		pr_warn("CPU %u: Failed to enable CPPC\n", cpu);
+
+	/* First thread back in a fully unplugged domain: ->online restores it */
+	if (!zen_freq_domain_other_online(zcpu, cpu))
+		return 0;
 
-	if (zcpu && zcpu->cur_policy) {
+	/* A returning sibling must not out-vote the domain owner */
+	if (cpu != READ_ONCE(zcpu->cpu))
+		zen_freq_park_thread_local(zcpu);
+
+	if (zcpu->cur_policy) {
 		zen_freq_set_policy(zcpu->cur_policy);
 	}
 
 	return 0;
 }
 
-static int zen_freq_cpu_offline(unsigned int cpu)
+/**
+ * zen_freq_domain_handoff - Move the domain request off a departing owner
+ * @zcpu:	Domain data
+ * @cpu:	Owner going offline
+ *
+ * Return: true if another online thread took over the request
+ */
+static bool zen_freq_domain_handoff(struct zen_freq_cpu *zcpu, unsigned int cpu)
 {
-	struct zen_freq_cpu *zcpu = per_cpu(zfreq_cpu_data, cpu);
+	unsigned int next;
 
-	if (zcpu && zcpu->num_pstates > 0) {
-		/* Set to lowest frequency */
-		zcpu->cur_pstate = zcpu->num_pstates - 1;
-		smp_call_function_single(cpu, zen_write_pstate_local, zcpu, 1);
+	for_each_cpu(next, &zcpu->domain_cpus) {
+		if (next == cpu || !cpu_online(next))
+			continue;
+
+		irq_work_sync(&zcpu->remote_work);
+		WRITE_ONCE(zcpu->cpu, next);
+		WRITE_ONCE(zcpu->pstate_ctl_cached, U64_MAX);
+		WRITE_ONCE(zcpu->cppc_req_cached, U64_MAX);
+		zcpu->eff_sample_ns = 0;
+
+		preempt_disable();
+		if (zen_cppc_active())
+			zen_cppc_commit(zcpu, READ_ONCE(zcpu->cppc_desired));
+		else
+			zen_freq_commit_pstate(zcpu, zcpu->cur_pstate);
+		preempt_enable();
+
+		return true;
 	}
 
+	return false;
+}
+
+static int zen_freq_cpu_offline(unsigned int cpu)
+{
+	struct zen_freq_cpu *zcpu = zen_freq_cpu_get(cpu);
+
+	if (!zcpu || zcpu->num_pstates == 0)
+		return 0;
+
+	/* Park this thread; if it owned the domain, a sibling takes over */
+	if (cpu != zcpu->cpu || zen_freq_domain_handoff(zcpu, cpu))
+		zen_freq_park_thread_local(zcpu);
+
+	/* The last thread was already saved and floored by ->offline */
 	return 0;
 }
 
@@ -1342,6 +4910,8 @@ const char *zen_freq_get_mode_string(unsigned int mode)
 		return "performance";
 	case ZEN_FREQ_MODE_USERSPACE:
 		return "userspace";
+	case ZEN_FREQ_MODE_EFFICIENT:
+		return "efficient";
 	default:
 		return "unknown";
 	}
@@ -1356,14 +4926,18 @@ static struct cpufreq_driver zen_freq_driver = {
 	.flags		= CPUFREQ_CONST_LOOPS | CPUFREQ_NEED_UPDATE_LIMITS,
 	.init		= zen_freq_init_cpu,
 	.exit		= zen_freq_exit_cpu,
+	.online		= zen_freq_online_cpu,
+	.offline	= zen_freq_offline_cpu,
 	.verify		= zen_freq_verify_policy,
 	.setpolicy	= zen_freq_set_policy,
 	.suspend	= zen_freq_suspend,
 	.resume		= zen_freq_resume,
 	.get		= zen_freq_get,
-	.fast_switch	= zen_freq_fast_switch_lockless,
 	.set_boost	= zen_freq_set_boost,
-	.attr		= zen_freq_attrs,
+	.attr		= zen_freq_policy_attrs,
+#ifdef CONFIG_ENERGY_MODEL
+	.register_em	= zen_freq_register_em,
+#endif
 };
 
 /* ============================================================================
@@ -1375,19 +4949,43 @@ static int __init zen_freq_init(void)
 	int ret;
 
 	pr_info("%s version %s loading\n", ZEN_FREQ_DRIVER_DESC, ZEN_FREQ_DRIVER_VERSION);
-	pr_info("Kernel version: %s, API: %s\n",
-		UTS_RELEASE, ZEN_USE_NEW_UTIL_API ? "6.6+" : "legacy");
+	pr_info("Kernel version: %s\n", UTS_RELEASE);
 
 	if (!zen_freq_check_hardware_support()) {
 		pr_err("Hardware not supported\n");
 		return -ENODEV;
 	}
 
+	zfreq_driver.vid_svi3 = zen_vf_uses_svi3();
+
 	if (!cpu_feature_enabled(X86_FEATURE_HW_PSTATE)) {
 		pr_err("Hardware P-state support not available\n");
 		return -ENODEV;
 	}
 
+	/* CPPC request mode replaces direct P-state writes when available */
+	if (zen_freq_cppc) {
+		if (cpu_feature_enabled(X86_FEATURE_CPPC)) {
+			zfreq_driver.features |= ZEN_FEAT_FAST_CPPC;
+			if (zen_freq_epp_enabled)
+				zfreq_driver.features |= ZEN_FEAT_EPP;
+			pr_info("CPPC request mode enabled (EPP: %s)\n",
+				zen_freq_epp_enabled ? "dynamic" : "static");
+		} else {
+			pr_info("CPPC not supported, using P-state mode\n");
+		}
+	}
+
+	/* Not fatal: CPUs just read their own definitions */
+	if (zen_pstate_defs_init())
+		pr_warn("P-state definition cache unavailable\n");
+
+	ret = zen_freq_pkgs_init();
+	if (ret) {
+		pr_err("Failed to allocate package domains\n");
+		goto err_pkgs;
+	}
+
 	/* Initialize thermal guard */
 	ret = zen_thermal_guard_init();
 	if (ret)
@@ -1402,6 +5000,7 @@ static int __init zen_freq_init(void)
 		pr_err("Failed to register CPU hotplug: %d\n", ret);
 		goto err_cpuhp;
 	}
+	zen_freq_cpuhp_state = ret;
 
 	/* Register cpufreq driver */
 	ret = cpufreq_register_driver(&zen_freq_driver);
@@ -1411,12 +5010,24 @@ static int __init zen_freq_init(void)
 	}
 
 	/* Create sysfs */
-	ret = sysfs_create_group(kernel_kobj, &zen_freq_attr_group);
+	ret = zen_freq_sysfs_init();
 	if (ret) {
 		pr_err("Failed to create sysfs: %d\n", ret);
 		goto err_sysfs;
 	}
 
+	zen_freq_debugfs_init();
+	zen_freq_user_init();
+	zen_prefcore_init();
+
+	/* Not fatal: every core just keeps its boost */
+	if (zen_boost_credit_init())
+		pr_warn("Boost credit allocator unavailable\n");
+
+	/* Not fatal: only power_limit_w stops working */
+	if (zen_power_guard_init())
+		pr_warn("Power guard unavailable\n");
+
 	zfreq_driver.initialized = true;
 
 	pr_info("zen-freq loaded successfully\n");
@@ -1425,37 +5036,54 @@ static int __init zen_freq_init(void)
 	return 0;
 
 err_sysfs:
+	/* Guard timers and work use zcpu; stop them before ->exit frees it */
+	zen_thermal_guard_exit();
 	cpufreq_unregister_driver(&zen_freq_driver);
+	cpuhp_remove_state_nocalls(zen_freq_cpuhp_state);
+	goto err_thermal;
 err_driver:
-	cpuhp_remove_state_nocalls(CPUHP_AP_ONLINE_DYN);
+	cpuhp_remove_state_nocalls(zen_freq_cpuhp_state);
 err_cpuhp:
 	zen_thermal_guard_exit();
 err_thermal:
+	zen_freq_pkgs_exit();
+err_pkgs:
+	zen_pstate_defs_exit();
 	return ret;
 }
 
 static void __exit zen_freq_exit(void)
 {
-	unsigned int cpu;
+	unsigned int cpu, sibling;
 	struct zen_freq_cpu *zcpu;
 
 	pr_info("Unloading zen-freq\n");
 
-	sysfs_remove_group(kernel_kobj, &zen_freq_attr_group);
-	cpufreq_unregister_driver(&zen_freq_driver);
+	zen_freq_debugfs_exit();
+	zen_prefcore_exit();
+	zen_freq_sysfs_exit();
+	zen_power_guard_exit();
+	zen_boost_credit_exit();
+	/* The pinned timers dereference zcpu; stop them before it is freed */
 	zen_thermal_guard_exit();
+	cpufreq_unregister_driver(&zen_freq_driver);
+	zen_freq_user_exit();
 
 	for_each_online_cpu(cpu) {
-		zcpu = per_cpu(zfreq_cpu_data, cpu);
+		zcpu = zen_freq_cpu_get(cpu);
 		if (zcpu) {
-			kfree(zcpu->freq_table);
-			kfree(zcpu->perf_target);
+			for_each_cpu(sibling, &zcpu->domain_cpus)
+				RCU_INIT_POINTER(per_cpu(zfreq_cpu_data, sibling), NULL);
+			synchronize_rcu();
+			irq_work_sync(&zcpu->remote_work);
+			zen_freq_free_freq_table(zcpu);
 			kfree(zcpu);
-			per_cpu(zfreq_cpu_data, cpu) = NULL;
 		}
 	}
 
-	cpuhp_remove_state_nocalls(CPUHP_AP_ONLINE_DYN);
+	cpuhp_remove_state_nocalls(zen_freq_cpuhp_state);
+	zen_freq_pkgs_exit();
+	zen_pstate_defs_exit();
 
 	pr_info("zen-freq unloaded\n");
 }
@@ -1465,3 +5093,7 @@ module_exit(zen_freq_exit);
 
 MODULE_ALIAS("cpufreq-zen-freq");
 MODULE_SOFTDEP("pre: acpi-cpufreq");
+
+#ifdef CONFIG_ZEN_FREQ_KUNIT_TEST
+#include "zen-freq-test.c"
+#endif
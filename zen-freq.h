@@ -19,6 +19,7 @@
 
 #include <linux/types.h>
 #include <linux/cpufreq.h>
+#include <linux/sched/cpufreq.h>
 #include <linux/spinlock.h>
 #include <linux/mutex.h>
 #include <linux/atomic.h>
@@ -31,6 +32,11 @@
 #include <linux/timer.h>
 #include <linux/bitops.h>
 #include <linux/ktime.h>
+#include <linux/irq_work.h>
+#include <linux/u64_stats_sync.h>
+#include <linux/seqlock.h>
+
+#include "zen-freq-uapi.h"
 
 /* ============================================================================
  * AMD Zen Architecture MSR Definitions
@@ -40,18 +46,33 @@
 #define MSR_AMD_PSTATE_DEF_BASE         0xC0010063
 #define MSR_AMD_PSTATE_STATUS           0xC0010063
 #define MSR_AMD_PSTATE_ENABLE           0xC0010064
-#define MSR_AMD_PSTATE_CPPC_REQ         0xC0010068
 #define MSR_AMD_PSTATE_ACTUAL_PERF      0xC0010083
 #define MSR_AMD_PSTATE_HW_PSTATE        0xC0010015
 
+/* CPPC MSRs, from <asm/msr-index.h> where the kernel has them */
+#ifndef MSR_AMD_CPPC_CAP1
+#define MSR_AMD_CPPC_CAP1               0xC00102B0
+#endif
+#ifndef MSR_AMD_CPPC_ENABLE
+#define MSR_AMD_CPPC_ENABLE             0xC00102B1
+#endif
+#ifndef MSR_AMD_CPPC_REQ
+#define MSR_AMD_CPPC_REQ                0xC00102B3
+#endif
+
 /* Thermal MSRs */
-#define MSR_IA32_THERM_STATUS           0x0000019C
 #define MSR_IA32_TEMPERATURE_TARGET     0x000001A2
 #define MSR_AMD_HW_THERMTRIP_STATUS     0xC0010064
 
 /* Voltage/Frequency MSRs */
 #define MSR_AMD_PSTATE_CUR_LIMIT        0xC0010061
 #define MSR_AMD_CPPC_BOOST              0xC0010293
+#ifndef MSR_AMD_RAPL_POWER_UNIT
+#define MSR_AMD_RAPL_POWER_UNIT         0xC0010299
+#endif
+#ifndef MSR_AMD_PKG_ENERGY_STATUS
+#define MSR_AMD_PKG_ENERGY_STATUS       0xC001029B
+#endif
 #define MSR_AMD_HW_CRBOOST_ON           0xC0011006
 
 /* P-state definition MSR bit fields */
@@ -60,13 +81,15 @@
 #define PSTATE_DEF_DID(val)             (((val) >> 6) & 0x1F)
 #define PSTATE_DEF_FID(val)             ((val) & 0x3F)
 #define PSTATE_DEF_VID(val)             (((val) >> 11) & 0xFF)
+#define PSTATE_DEF_VID_HI(val)          (((val) >> 32) & 0x1)  /* SVI3 CpuVid[8] */
 #define PSTATE_DEF_CUR_DIV(val)         (((val) >> 4) & 0x3)
 
-/* Thermal status MSR bit fields */
-#define THERM_STATUS_VALID              BIT_ULL(31)
-#define THERM_STATUS_TEMP(val)          (((val) >> 16) & 0x7F)
-#define THERM_STATUS_LOG                BIT_ULL(1)
-#define THERM_STATUS_PROCHOT            BIT_ULL(0)
+/* SMU reported temperature (Tctl), read over SMN as k10temp does */
+#define ZEN_SMN_REPORTED_TEMP_CTRL      0x00059800
+#define ZEN_CUR_TEMP_SHIFT              21
+#define ZEN_CUR_TEMP_RANGE_SEL          BIT(19)
+#define ZEN_CUR_TEMP_TJ_SEL_MASK        GENMASK(17, 16)
+#define ZEN_CUR_TEMP_RANGE_OFFSET_MC    49000
 
 /* CPPC request MSR bit fields */
 #define CPPC_MAX_PERF(val)              ((val) & 0xFF)
@@ -99,9 +122,22 @@
 #define ZEN_THERMAL_KI                  10      /* Integral gain */
 #define ZEN_THERMAL_INTEGRAL_MAX        1000    /* Anti-windup limit */
 
+/* Predictive model defaults */
+#define ZEN_THERMAL_KFF                 30      /* Feed-forward, m°C per % util */
+#define ZEN_THERMAL_HORIZON_MS          500     /* dT/dt look-ahead */
+
+/* Thermal controller models */
+#define ZEN_THERMAL_MODEL_PI            0       /* React to temperature only */
+#define ZEN_THERMAL_MODEL_PREDICTIVE    1       /* PI on predicted temperature */
+
 /* Thermal polling interval in milliseconds */
 #define ZEN_THERMAL_POLL_INTERVAL_MS    250
 
+/* Adaptive polling: interval shrinks as temperature nears the soft limit */
+#define ZEN_THERMAL_POLL_MIN_MS         20      /* At/above soft limit */
+#define ZEN_THERMAL_POLL_MAX_MS         1000    /* Far below soft limit */
+#define ZEN_THERMAL_POLL_MARGIN         15      /* Headroom (C) for max interval */
+
 /* Thermal state machine states */
 enum zen_thermal_state {
         ZEN_THERMAL_NORMAL,             /* Normal operation */
@@ -110,6 +146,63 @@ enum zen_thermal_state {
         ZEN_THERMAL_RECOVERY,           /* Recovering from throttling */
 };
 
+/**
+ * struct zen_thermal_domain - CPUs sharing one temperature sensor
+ * @id:                 AMD node id the sensor is read from
+ * @cpus:               CPUs in this domain
+ * @sample_cpu:         CPU the sampling work is queued on
+ * @work:               Deferrable sampling work
+ * @prev_temp:          Temperature at the previous sample
+ * @interval_ms:        Current sampling interval
+ *
+ * Tctl is reported once per node, which on Zen 2 and later is a whole
+ * package. It is read once per domain and the result is fanned out to
+ * every sibling. Entries are cache-line aligned so domains on different
+ * sockets never share a line.
+ */
+struct zen_thermal_domain {
+        unsigned int            id;
+        struct cpumask          cpus;
+        unsigned int            sample_cpu;
+        struct delayed_work     work;
+        u32                     prev_temp;
+        unsigned int            interval_ms;
+} ____cacheline_aligned;
+
+/**
+ * struct zen_boost_demand - One domain's claim in a boost credit round
+ * @demand:             Utilization plus the holder bonus (%)
+ * @zcpu:               Domain data
+ */
+struct zen_boost_demand {
+        u32                     demand;
+        struct zen_freq_cpu     *zcpu;
+};
+
+/**
+ * struct zen_boost_pkg - Boost credit allocator for one package
+ * @id:                 Logical package id
+ * @cpus:               CPUs in this package
+ * @timer_cpu:          CPU the reallocation timer is armed on
+ * @timer:              Deferrable reallocation timer, pinned to @timer_cpu
+ * @demand:             Scratch array, one entry per domain in @cpus
+ * @nr_domains:         Domains seen in the last round
+ * @nr_granted:         Domains holding a credit after the last round
+ *
+ * With zen_freq_boost_credits set to N, only the N busiest domains of the
+ * package may request boost P-states; the rest stop at nominal so the
+ * package power limit is not split across every core.
+ */
+struct zen_boost_pkg {
+        unsigned int            id;
+        struct cpumask          cpus;
+        unsigned int            timer_cpu;
+        struct timer_list       timer;
+        struct zen_boost_demand *demand;
+        unsigned int            nr_domains;
+        unsigned int            nr_granted;
+};
+
 /* ============================================================================
  * Voltage Safety Configuration
  * ============================================================================ */
@@ -119,10 +212,13 @@ enum zen_thermal_state {
 #define ZEN_VOLTAGE_WARN                1350    /* Warning threshold */
 #define ZEN_VOLTAGE_BOOST_MAX           1500    /* Boost voltage allowed max */
 
-/* VID to voltage conversion (simplified for Zen architecture)
- * Actual formula varies by CPU generation, these are conservative
+/*
+ * VID to voltage conversion. Zen 1-3 use SVI2 (1.55 V minus 6.25 mV per
+ * step, VID 0xF8 and up is off); Zen 4 and later use SVI3 (245 mV plus
+ * 5 mV per step, 9-bit VIDs).
  */
-#define ZEN_VID_TO_MV(vid)              (1550 - ((vid) * 25))   /* Approximate */
+#define ZEN_SVI2_VID_TO_MV(vid)         ((vid) >= 0xF8 ? 0 : 1550 - ((vid) * 25) / 4)
+#define ZEN_SVI3_VID_TO_MV(vid)         (245 + (vid) * 5)
 
 /* ============================================================================
  * EPP Dynamic Tuning Configuration
@@ -140,27 +236,212 @@ enum zen_thermal_state {
 #define ZEN_UTIL_HIGH_THRESHOLD         80      /* % utilization */
 #define ZEN_EPP_LOW_UTIL_DELAY_MS       500     /* Delay before EPP change */
 
+/* ============================================================================
+ * Native Governor Configuration
+ * ============================================================================ */
+
+#define ZEN_NATIVE_HEADROOM_PCT         125     /* Target = util x 1.25, as schedutil */
+#define ZEN_UTIL_SAMPLE_NS              (2 * NSEC_PER_MSEC) /* Busy window, one phase slot */
+#define ZEN_UTIL_STALE_NS               (2 * TICK_NSEC + ZEN_UTIL_SAMPLE_NS) /* Tick stopped */
+
+/* ============================================================================
+ * Workload Phase Detection Configuration
+ * ============================================================================ */
+
+#define ZEN_PHASE_RING_SIZE             64      /* Util samples kept (power of two) */
+#define ZEN_PHASE_SAMPLE_NS             (2 * NSEC_PER_MSEC) /* One sample per slot */
+#define ZEN_PHASE_MIN_LAG               2       /* Shortest period tried (4 ms) */
+#define ZEN_PHASE_MAX_LAG               32      /* Longest period tried (64 ms) */
+#define ZEN_PHASE_DETECT_EVERY          8       /* Re-run autocorrelation every N samples */
+#define ZEN_PHASE_EWMA_SHIFT            3       /* Baseline EWMA weight 1/8 */
+#define ZEN_PHASE_MIN_SPREAD            5       /* Util stddev below this is flat (%) */
+#define ZEN_PHASE_CONF_MIN              50      /* Act on periods at least this confident (%) */
+#define ZEN_PHASE_HIT_TOL               10      /* Prediction hit if within this (%) */
+#define ZEN_PHASE_NO_PRED               0xFF    /* No prediction outstanding */
+
 /* ============================================================================
  * I/O Wait Boost Configuration
  * ============================================================================ */
 
-#define ZEN_IO_BOOST_DURATION_MS        50      /* How long to hold boost */
-#define ZEN_IO_BOOST_MIN_UTIL           5       /* Minimum I/O wait util */
-#define ZEN_IO_BOOST_HOLD_MS            20      /* Minimum hold time */
+#define ZEN_IO_BOOST_DURATION_MS        50      /* Drop boost after this long without iowait */
+#define ZEN_IO_BOOST_HOLD_MS            20      /* Hold each level before halving it */
+#define ZEN_IO_BOOST_MIN_PERF           32      /* First iowait wakeup (1/8 of range) */
+#define ZEN_IO_BOOST_MAX_PERF           255     /* Ceiling after repeated wakeups */
+
+/* ============================================================================
+ * Energy Model Configuration
+ * ============================================================================ */
+
+#define ZEN_EM_CAPACITANCE_PF           620     /* ~3 W per core at 1.1 V / 4 GHz */
+#define ZEN_EM_FALLBACK_MV              1000    /* Used when a VID is not reported */
+
+/* ============================================================================
+ * Preferred Core Configuration
+ * ============================================================================ */
+
+#define CPPC_CAP1_HIGHEST_PERF(x)       (((x) >> 24) & 0xFF)
+#define CPPC_CAP1_NOMINAL_PERF(x)       (((x) >> 16) & 0xFF)
+#define CPPC_CAP1_LOWEST_PERF(x)        ((x) & 0xFF)
+#define ZEN_PREFCORE_BAND               8       /* Ranking distance from the best core */
+
+/* ============================================================================
+ * Power Guard Configuration
+ * ============================================================================ */
+
+/* PI controller on package power; error in mW, gains scaled by 1000 */
+#define ZEN_POWER_KP                    2000    /* ~2 perf steps per watt over */
+#define ZEN_POWER_KI                    200     /* Integral gain per sample */
+#define ZEN_POWER_INTEGRAL_MAX          1000000 /* Anti-windup limit (mW x samples) */
+
+#define ZEN_POWER_POLL_MS               10      /* Sampling period with a cap set */
+#define ZEN_POWER_IDLE_POLL_MS          250     /* Sampling period without a cap */
+#define RAPL_ENERGY_UNIT(x)             (((x) >> 8) & 0x1F)
+
+/**
+ * struct zen_power_pkg - Power guard state for one package
+ * @id:                 Logical package id
+ * @cpus:               CPUs in this package
+ * @sample_cpu:         CPU the sampling timer is armed on
+ * @timer:              Deferrable sampling timer, pinned to @sample_cpu
+ * @energy_raw:         Last RAPL package energy counter reading
+ * @energy_unit:        RAPL energy status unit (1/2^n J)
+ * @sample_ns:          When @energy_raw was read (sched_clock)
+ * @power_mw:           Package power over the last period
+ * @integral:           PI controller integral term (mW x samples)
+ * @max_perf:           Perf cap fanned out to every CPU of the package
+ *
+ * RAPL counters are per package, so the loop runs once per package on a
+ * CPU inside it and writes its cap to each zen_freq_cpu.
+ */
+struct zen_power_pkg {
+        unsigned int            id;
+        struct cpumask          cpus;
+        unsigned int            sample_cpu;
+        struct timer_list       timer;
+        u32                     energy_raw;
+        u32                     energy_unit;
+        u64                     sample_ns;
+        u32                     power_mw;
+        s32                     integral;
+        u8                      max_perf;
+};
+
+/* ============================================================================
+ * Boost Credit Configuration
+ * ============================================================================ */
+
+#define ZEN_BOOST_CREDIT_INTERVAL_MS    20      /* Reallocation period */
+#define ZEN_BOOST_CREDIT_STICKY         10      /* Utilization bonus (%) for holders */
+
+/* ============================================================================
+ * Package Domains
+ * ============================================================================ */
+
+#define ZEN_PKG_INHERIT                 UINT_MAX /* Tunable follows the module parameter */
+
+/* Package override if one is set, otherwise the module parameter */
+#define ZEN_PKG_VALUE(pkg, field, global)                               \
+({                                                                      \
+        unsigned int __v = (pkg) ? READ_ONCE((pkg)->field) :            \
+                                   ZEN_PKG_INHERIT;                     \
+        __v == ZEN_PKG_INHERIT ? READ_ONCE(global) : __v;               \
+})
+
+/**
+ * struct zen_freq_calib - Calibrated P-state transition latency
+ * @min_ns:             Fastest calibrated transition, 0 if not calibrated
+ * @median_ns:          Median calibrated transition
+ * @p99_ns:             99th percentile (nearest rank) calibrated transition
+ * @timeouts:           Samples that hit ZEN_CALIB_TIMEOUT_US
+ */
+struct zen_freq_calib {
+        u32                     min_ns;
+        u32                     median_ns;
+        u32                     p99_ns;
+        u32                     timeouts;
+};
+
+/**
+ * struct zen_freq_pkg - Driver state for one package
+ * @id:                 Logical package id
+ * @node:               NUMA node this structure is allocated on
+ * @cpus:               CPUs in this package (online at load)
+ * @kobj:               /sys/kernel/zen_freq/package<id>
+ * @soft_temp:          Soft thermal limit, or ZEN_PKG_INHERIT
+ * @hard_temp:          Hard thermal limit, or ZEN_PKG_INHERIT
+ * @power_limit_w:      Power cap, or ZEN_PKG_INHERIT
+ * @boost_credits:      Boost credits, or ZEN_PKG_INHERIT
+ * @calib:              Transition latency measured on the package's first domain
+ * @thermal:            Thermal sampling domains (one per node), on @node
+ * @nr_thermal:         Number of entries in @thermal
+ * @boost:              Boost credit allocator
+ * @power:              Power guard
+ *
+ * Sockets have their own thermal and power envelopes, so each package
+ * gets its own limits and its own workers, pinned to a CPU inside it and
+ * working on memory from its node. One package throttling then costs the
+ * others neither timer work nor remote cache-line traffic.
+ */
+struct zen_freq_pkg {
+        unsigned int            id;
+        int                     node;
+        struct cpumask          cpus;
+        struct kobject          *kobj;
+
+        unsigned int            soft_temp;
+        unsigned int            hard_temp;
+        unsigned int            power_limit_w;
+        unsigned int            boost_credits;
+
+        struct zen_freq_calib   calib;
+
+        struct zen_thermal_domain *thermal;
+        unsigned int            nr_thermal;
+
+        struct zen_boost_pkg    boost;
+        struct zen_power_pkg    power;
+};
+
+/* ============================================================================
+ * Transition Hysteresis Configuration
+ * ============================================================================ */
+
+#define ZEN_HYST_MIN_RESIDENCY_US       1000    /* Min time in a P-state before dropping */
+#define ZEN_HYST_UP_RATE_LIMIT_US       0       /* Raise immediately */
+#define ZEN_HYST_DOWN_RATE_LIMIT_US     5000    /* Lower request must persist this long */
+
+/* ============================================================================
+ * Transition Latency Calibration
+ * ============================================================================ */
+
+#define ZEN_CALIB_SAMPLES               128     /* Transitions timed per package (p99 needs >= 100) */
+#define ZEN_CALIB_SETTLE_US             200     /* Time at the low P-state first */
+#define ZEN_CALIB_POLL_NS               1000    /* APERF/MPERF window while polling */
+#define ZEN_CALIB_TIMEOUT_US            1000    /* Give up on a sample after this */
+#define ZEN_CALIB_DONE_PCT              90      /* Of target freq counts as arrived */
 
 /* ============================================================================
- * Performance Target Cache (RCU-protected)
+ * Effective Frequency Feedback Configuration
+ * ============================================================================ */
+
+#define ZEN_EFF_SAMPLE_MIN_MS           4       /* Min APERF/MPERF window */
+#define ZEN_EFF_SHORTFALL_PCT           10      /* Delivered below request by */
+#define ZEN_EFF_CAP_HOLD_MS             100     /* Hold delivered cap before re-probing */
+
+/* ============================================================================
+ * Performance Target Cache (seqcount-protected)
  * ============================================================================ */
 
 /**
- * struct zen_perf_target - RCU-protected performance target
+ * struct zen_perf_target - Seqcount-protected performance target
  * @desired_perf:       Target performance (0-255)
  * @min_perf:           Minimum performance limit
  * @max_perf:           Maximum performance limit
  * @epp:                Energy Performance Preference
  * @timestamp:          Last update timestamp (ns)
- * @sequence:           Sequence number for consistency
- * @rcu:                RCU head for safe reclamation
+ * @sequence:           Number of updates published so far
+ *
+ * Stored inline in struct zen_freq_cpu, so updates never allocate.
  */
 struct zen_perf_target {
         u8              desired_perf;
@@ -169,9 +450,46 @@ struct zen_perf_target {
         u8              epp;
         u64             timestamp;
         unsigned int    sequence;
-        struct rcu_head rcu;
 };
 
+/* ============================================================================
+ * P-state Lookup Index (RCU-protected)
+ * ============================================================================ */
+
+/* Number of frequency buckets in the lookup index */
+#define ZEN_FREQ_LUT_SIZE               256
+
+/**
+ * struct zen_pstate_index - Precomputed target resolution tables
+ * @freq:               Enabled P-state frequencies, ascending (kHz)
+ * @pstate:             Index into zcpu->pstates[] for each @freq slot
+ * @nr:                 Number of valid slots
+ * @nominal_pos:        Slot of the nominal frequency
+ * @bucket_shift:       log2 of the frequency bucket width (kHz)
+ * @perf_pos:           Floor slot for each perf level (0-255)
+ * @eff_pos:            Lowest energy-per-cycle slot at or above each slot
+ * @bucket_pos:         Highest slot whose frequency falls in or below bucket
+ * @rcu:                RCU head for safe reclamation
+ *
+ * Built by zen_freq_build_freq_table() so that fast_switch resolves a
+ * frequency or perf level to a P-state with a table lookup. The bucket
+ * width is the smallest power of two that fits the highest frequency into
+ * ZEN_FREQ_LUT_SIZE buckets (32 MHz near 5.7 GHz), so P-states closer
+ * together than that can share a bucket; the lookup then steps down from
+ * the bucket's highest slot, at most ZEN_MAX_PSTATES - 1 times.
+ */
+struct zen_pstate_index {
+        u32             freq[ZEN_MAX_PSTATES];
+        u8              pstate[ZEN_MAX_PSTATES];
+        u8              nr;
+        u8              nominal_pos;
+        u8              bucket_shift;
+        u8              perf_pos[256];
+        u8              eff_pos[ZEN_MAX_PSTATES];
+        u8              bucket_pos[ZEN_FREQ_LUT_SIZE];
+        struct rcu_head rcu;
+} ____cacheline_aligned;
+
 /* ============================================================================
  * Hardware P-state Structure
  * ============================================================================ */
@@ -181,19 +499,20 @@ struct zen_perf_target {
  * @pstate:     P-state number (0 is highest performance)
  * @freq:       Frequency in kHz
  * @voltage:    Voltage in mV (calculated from VID)
- * @vid:        Voltage ID from MSR
+ * @vid:        Voltage ID from MSR (9 bits on SVI3 parts)
  * @fid:        Frequency ID
  * @did:        Divisor ID
  * @div:        Divider value
  * @en:         Whether this P-state is enabled
  * @boost:      Whether this is a boost state
- * @safe:       Whether voltage is within safe limits
+ * @safe:       Whether voltage is within safe limits; unsafe states are
+ *              left out of the frequency table and lookup index
  */
 struct zen_pstate {
         u8              pstate;
         u32             freq;
         u32             voltage;
-        u8              vid;
+        u16             vid;
         u8              fid;
         u8              did;
         u8              div;
@@ -202,13 +521,164 @@ struct zen_pstate {
         bool            safe;
 };
 
+/**
+ * struct zen_pstate_defs - P-state definitions shared by one package
+ * @raw:        P-state definition MSR values (0 if unreadable)
+ * @checksum:   jhash of @raw, compared against every CPU at load
+ * @valid:      @raw was read on a CPU of this package
+ * @reported:   Voltage check warnings already printed for this package
+ */
+struct zen_pstate_defs {
+        u64             raw[ZEN_MAX_PSTATES];
+        u32             checksum;
+        bool            valid;
+        bool            reported;
+};
+
+/* ============================================================================
+ * Statistics
+ * ============================================================================ */
+
+/**
+ * struct zen_freq_stats - Lock-free per-CPU counters
+ * @syncp:              Sync for counters written on the owning CPU only
+ * @transitions:        P-state changes written to hardware
+ * @io_boosts:          I/O boost activations
+ * @remote_writes:      Deferred writes applied on behalf of remote callers
+ * @total_time_ns:      Residency accounted across all P-states
+ * @writes_avoided:     Control MSR writes skipped because nothing changed
+ * @time_in_state:      Residency per entry of zcpu->pstates[] (ns)
+ * @trans:              Transition counts, [from][to] by zcpu->pstates[] entry
+ * @switch_syncp:       Sync for counters written by fast_switch on the owner
+ * @suppressed_up:      Raises held back by the up rate limit
+ * @suppressed_down:    Drops held back by residency or the down rate limit
+ * @phase_syncp:        Sync for counters written by the phase sampler
+ * @phase_predictions:  Samples that had a phase prediction outstanding
+ * @phase_hits:         Predictions within ZEN_PHASE_HIT_TOL of the sample
+ *
+ * Each sync has exactly one writer context, so updates need no locking
+ * and readers on any CPU retry until they observe a consistent snapshot.
+ */
+struct zen_freq_stats {
+        struct u64_stats_sync   syncp;
+        u64_stats_t             transitions;
+        u64_stats_t             io_boosts;
+        u64_stats_t             remote_writes;
+        u64_stats_t             total_time_ns;
+        u64_stats_t             writes_avoided;
+        u64_stats_t             time_in_state[ZEN_MAX_PSTATES];
+        u64_stats_t             trans[ZEN_MAX_PSTATES][ZEN_MAX_PSTATES];
+
+        struct u64_stats_sync   switch_syncp;
+        u64_stats_t             suppressed_up;
+        u64_stats_t             suppressed_down;
+
+        struct u64_stats_sync   phase_syncp;
+        u64_stats_t             phase_predictions;
+        u64_stats_t             phase_hits;
+};
+
+/**
+ * struct zen_freq_slow_stats - Counters written off the owning domain
+ * @syncp:              Sync for counters written by the thermal guard/init
+ * @thermal_events:     Thermal throttle limit changes
+ * @voltage_clamps:     P-states found above the voltage limit
+ *
+ * Kept out of struct zen_freq_stats so the thermal sampling work bumping
+ * them never dirties the owner's hot counters.
+ */
+struct zen_freq_slow_stats {
+        struct u64_stats_sync   syncp;
+        u64_stats_t             thermal_events;
+        u64_stats_t             voltage_clamps;
+};
+
+/**
+ * struct zen_freq_stats_snapshot - Consistent copy of a domain's counters
+ */
+struct zen_freq_stats_snapshot {
+        u64                     transitions;
+        u64                     io_boosts;
+        u64                     remote_writes;
+        u64                     total_time_ns;
+        u64                     writes_avoided;
+        u64                     thermal_events;
+        u64                     voltage_clamps;
+        u64                     suppressed_up;
+        u64                     suppressed_down;
+        u64                     phase_predictions;
+        u64                     phase_hits;
+};
+
+/* The residency ABI has one slot per hardware P-state */
+static_assert(ZEN_FREQ_RESIDENCY_PSTATES == ZEN_MAX_PSTATES);
+
+/**
+ * struct zen_freq_snapshot - Domain operating point kept across suspend/unplug
+ * @valid:              Set on the way down, cleared once restored
+ * @pstate:             P-state requested before the domain went down
+ * @cppc_req:           Last CPPC_REQ written (desired/min/max perf and EPP)
+ *
+ * Thermal state, EPP hints and the perf target stay in zen_freq_cpu while
+ * the domain is down (the thermal guard keeps updating them), so only the
+ * hardware request that going down overwrites needs saving.
+ */
+struct zen_freq_snapshot {
+        bool                    valid;
+        unsigned int            pstate;
+        u64                     cppc_req;
+};
+
+/**
+ * struct zen_phase_detector - Recent domain utilization and its periodicity
+ * @ring:               Util samples (%), one per ZEN_PHASE_SAMPLE_NS slot
+ * @head:               Samples written so far; the newest is @head - 1
+ * @slot_ns:            Start of the current slot; claiming it makes the
+ *                      claiming thread the only writer of the rest
+ * @ewma:               Utilization baseline (%, << ZEN_PHASE_EWMA_SHIFT)
+ * @period:             Detected period in samples, 0 if none
+ * @confidence:         Autocorrelation at @period (%)
+ * @pred:               Util predicted for the next sample, or ZEN_PHASE_NO_PRED
+ * @floor_perf:         Perf to pre-raise to ahead of a predicted burst, 0 if none
+ * @trough:             A trough is predicted next: drops skip the down hold
+ *
+ * Any thread of the domain may sample, but a slot is only claimed once
+ * (cmpxchg on @slot_ns), so the ring needs no lock.
+ */
+struct zen_phase_detector {
+        u8                      ring[ZEN_PHASE_RING_SIZE];
+        unsigned int            head;
+        atomic64_t              slot_ns;
+        u32                     ewma;
+        u8                      period;
+        u8                      confidence;
+        u8                      pred;
+        u8                      floor_perf;
+        bool                    trough;
+};
+
+/* ============================================================================
+ * Userspace Request Channel
+ * ============================================================================ */
+
+/* Slot and ioctl layout are in zen-freq-uapi.h */
+#define ZEN_USER_DEV_NAME               "zen_freq"
+
 /* ============================================================================
  * Per-CPU Driver Data
  * ============================================================================ */
 
 /**
  * struct zen_freq_cpu - Per-CPU private data
- * @cpu:                CPU number
+ *
+ * Laid out in three cache-line-aligned groups by who writes them, so the
+ * thermal, power and boost timers and remote callers never dirty a line
+ * the owning CPU's fast path is using:
+ *
+ * Read-mostly (set up at init or by policy changes, read by the fast path):
+ *
+ * @cpu:                CPU that owns the domain's P-state request
+ * @domain_cpus:        Logical CPUs sharing this frequency domain
  * @pstates:            Array of hardware P-states
  * @num_pstates:        Number of valid P-states
  * @boost_states:       Array of boost P-states
@@ -216,37 +686,91 @@ struct zen_pstate {
  * @max_freq:           Maximum non-boost frequency
  * @min_freq:           Minimum frequency
  * @nominal_freq:       Nominal (guaranteed) frequency
- * @highest_perf:       Highest performance value
- * @lowest_perf:        Lowest performance value
- * @nominal_perf:       Nominal performance value
+ * @highest_perf:       Highest perf: CPPC_CAP1 in CPPC mode, else 255
+ * @lowest_perf:        Lowest perf: CPPC_CAP1 in CPPC mode, else 0
+ * @nominal_perf:       Nominal perf: CPPC_CAP1 in CPPC mode, else 128
+ * @boost_supported:    Core Performance Boost is available
+ * @boost_enabled:      Boost P-states may be requested
+ * @prefcore_ranking:   CPPC highest_perf, used as preferred-core ranking
+ * @prefcore_cap_freq:  Boost ceiling for non-preferred cores, 0 if none (kHz)
  *
- * @cur_pstate:         Current P-state index
- * @cur_freq:           Current frequency (atomic for fast access)
  * @cur_policy:         Current cpufreq policy
- *
- * @perf_target:        RCU-protected performance target
+ * @perf_target:        Inline performance target
+ * @perf_seq:           Seqcount guarding @perf_target, writers hold @update_lock
  * @update_lock:        Lock for frequency updates (rarely used)
  *
  * @freq_table:         CPU frequency table
  * @freq_table_rcu:     RCU pointer to frequency table
+ * @pstate_index:       RCU pointer to the frequency/perf lookup index
  *
- * @thermal_state:      Current thermal state
- * @thermal_integral:   PI controller integral term
- * @thermal_throttle_perf: Current thermal throttle limit
- * @last_temp:          Last measured temperature
+ * @calib:              Transition latency, measured or taken from @pkg
+ *
+ * @snap:               Request to restore after suspend or a full unplug
+ * @pkg:                Package domain, NULL if the CPU came up after load
+ *
+ * Hot (written by the domain's own threads from the util hook and
+ * fast_switch):
+ *
+ * @cur_pstate:         Current P-state index
+ * @cur_freq:           Current frequency (atomic for fast access)
+ * @pstate_ctl_cached:  Shadow of the last P-state control write (U64_MAX if none)
+ *
+ * @cppc_desired:       Latest desired perf requested in CPPC mode
+ * @cppc_req_cached:    Last value written to CPPC_REQ (U64_MAX if none)
  *
  * @io_boost_active:    Whether I/O boost is active
- * @io_boost_expire:    When I/O boost expires (jiffies)
- * @last_io_wait:       Last I/O wait time
+ * @io_boost_level:     Current boost floor in perf units, 0 if none
+ * @io_boost_last_ns:   Last iowait wakeup or decay step (scheduler time)
  *
+ * @uclamp_min_perf:    Domain perf floor from the running tasks' uclamp.min
+ * @uclamp_max_perf:    Domain perf cap from the running tasks' uclamp.max
+ *
+ * @user_perf:          Domain's userspace-mode request (perf), 0 if none
+ *
+ * @hyst_pos:           Index slot last granted by the hysteresis engine
+ * @hyst_change_ns:     When @hyst_pos last changed (local_clock)
+ * @hyst_down_since_ns: When a lower request was first seen, 0 if none
+ *
+ * @eff_aperf:          APERF at the last effective-frequency sample
+ * @eff_mperf:          MPERF at the last effective-frequency sample
+ * @eff_sample_ns:      When the last sample was taken (sched_clock)
+ * @eff_req_freq:       Requested frequency at the last sample (kHz)
+ * @eff_freq:           Delivered frequency over the last window (kHz)
+ * @eff_cap_freq:       Cap from under-delivery, 0 if none (kHz)
+ * @eff_cap_expire:     When @eff_cap_freq is dropped (jiffies)
+ *
+ * @last_util:          Last utilization seen by the util callback (%)
+ * @phase:              Util history and periodicity prediction
  * @util_low_since:     When utilization went low (jiffies)
  * @dynamic_epp:        Current dynamic EPP value
  * @epp_mode:           User-configured EPP mode
  *
- * @stats:              Performance statistics
+ * @stats:              Counters written by the domain's own threads
+ * @stats_pstate:       P-state currently accounted for residency
+ * @stats_since_ns:     When @stats_pstate was entered (sched_clock)
+ *
+ * Warm (written from other CPUs: remote callers and the guard timers):
+ *
+ * @remote_work:        Deferred P-state write for non-local callers
+ * @remote_pstate:      Latest P-state requested by a remote caller
+ * @remote_pending:     Whether @remote_work is already queued
+ *
+ * @thermal_state:      Current thermal state
+ * @thermal_integral:   PI controller integral term
+ * @thermal_throttle_perf: Current thermal throttle limit
+ * @last_temp:          Last measured temperature
+ * @thermal_sample_ns:  When @last_temp was sampled (sched_clock)
+ * @thermal_slope:      Temperature slope (m°C/s)
+ * @thermal_ff_util:    Domain-average utilization fed forward (%)
+ * @slow_stats:         Counters written by the thermal guard and init
+ *
+ * @power_throttle_perf: Package power guard limit (perf), 255 if none
+ * @boost_granted:      Holds a package boost credit
  */
 struct zen_freq_cpu {
+        /* ---- Read-mostly ---- */
         unsigned int            cpu;
+        struct cpumask          domain_cpus;
 
         /* P-state information */
         struct zen_pstate       pstates[ZEN_MAX_PSTATES];
@@ -262,13 +786,17 @@ struct zen_freq_cpu {
         u8                      lowest_perf;
         u8                      nominal_perf;
 
-        /* Current state (fast path) */
-        unsigned int            cur_pstate;
-        atomic_t                cur_freq;
+        /* Boost and preferred-core steering */
+        bool                    boost_supported;
+        bool                    boost_enabled;
+        u8                      prefcore_ranking;
+        u32                     prefcore_cap_freq;
+
         struct cpufreq_policy   *cur_policy;
 
-        /* RCU-protected performance target */
-        struct zen_perf_target  __rcu *perf_target;
+        /* Seqcount-protected performance target */
+        struct zen_perf_target  perf_target;
+        seqcount_spinlock_t     perf_seq;
 
         /* Update lock (for slow path operations) */
         spinlock_t              update_lock;
@@ -276,31 +804,120 @@ struct zen_freq_cpu {
         /* Frequency table with RCU protection */
         struct cpufreq_frequency_table *freq_table;
         struct cpufreq_frequency_table __rcu *freq_table_rcu;
+        struct zen_pstate_index __rcu *pstate_index;
 
-        /* Thermal guard state */
-        enum zen_thermal_state  thermal_state;
-        s32                     thermal_integral;
-        u8                      thermal_throttle_perf;
-        u32                     last_temp;
+        /* Transition latency calibration */
+        struct zen_freq_calib   calib;
+
+        /* Suspend and hotplug snapshot */
+        struct zen_freq_snapshot snap;
+
+        /* Package limits and workers */
+        struct zen_freq_pkg     *pkg;
+
+        /* ---- Hot: owning domain only ---- */
+        unsigned int            cur_pstate ____cacheline_aligned;
+        atomic_t                cur_freq;
+        u64                     pstate_ctl_cached;
+
+        /* CPPC request mode */
+        u8                      cppc_desired;
+        u64                     cppc_req_cached;
 
         /* I/O wait boost state */
         bool                    io_boost_active;
-        unsigned long           io_boost_expire;
-        u64                     last_io_wait;
+        u8                      io_boost_level;
+        u64                     io_boost_last_ns;
+
+        /* Effective uclamp hints (perf units) */
+        u8                      uclamp_min_perf;
+        u8                      uclamp_max_perf;
+
+        /* Userspace request channel */
+        u8                      user_perf;
+
+        /* Transition hysteresis (written by the domain owner only) */
+        unsigned int            hyst_pos;
+        u64                     hyst_change_ns;
+        u64                     hyst_down_since_ns;
+
+        /* Effective frequency feedback (APERF/MPERF) */
+        u64                     eff_aperf;
+        u64                     eff_mperf;
+        u64                     eff_sample_ns;
+        u32                     eff_req_freq;
+        u32                     eff_freq;
+        u32                     eff_cap_freq;
+        unsigned long           eff_cap_expire;
 
         /* Dynamic EPP state */
+        u32                     last_util;
+        struct zen_phase_detector phase;
         unsigned long           util_low_since;
         u8                      dynamic_epp;
         u8                      epp_mode;
 
         /* Statistics */
-        struct {
-                u64             transitions;
-                u64             io_boosts;
-                u64             thermal_events;
-                u64             voltage_clamps;
-                u64             total_time_ns;
-        } stats;
+        struct zen_freq_stats   stats;
+        unsigned int            stats_pstate;
+        u64                     stats_since_ns;
+
+        /* ---- Warm: written from other CPUs ---- */
+
+        /* Deferred remote write (coalesced, one irq_work per window) */
+        struct irq_work         remote_work ____cacheline_aligned;
+        unsigned int            remote_pstate;
+        atomic_t                remote_pending;
+
+        /* Thermal guard state */
+        enum zen_thermal_state  thermal_state;
+        s32                     thermal_integral;
+        u8                      thermal_throttle_perf;
+        u32                     last_temp;
+        u64                     thermal_sample_ns;
+        s32                     thermal_slope;
+        u32                     thermal_ff_util;
+        struct zen_freq_slow_stats slow_stats;
+
+        /* Power guard and boost credit outputs */
+        u8                      power_throttle_perf;
+        bool                    boost_granted;
+} ____cacheline_aligned;
+
+/* The thermal guard's counters must stay out of the owner's hot lines */
+static_assert(offsetof(struct zen_freq_cpu, slow_stats) >=
+              offsetof(struct zen_freq_cpu, remote_work));
+
+/**
+ * struct zen_freq_thread - Per-thread util hook state
+ * @update_util:        Hook registered with cpufreq_add_update_util_hook()
+ * @zcpu:               Domain the thread belongs to
+ * @sample_ns:          Scheduler time of the last busy sample
+ * @mperf:              MPERF at the last busy sample
+ * @tsc:                TSC at the last busy sample
+ * @util:               Busy fraction over the last sample window (%)
+ * @uclamp_min:         Effective uclamp.min of the running task (perf)
+ * @uclamp_max:         Effective uclamp.max of the running task (perf)
+ * @busy:               A task other than idle was running at the last update
+ * @iowait:             iowait wakeup the owner has not folded in yet
+ *
+ * The scheduler passes setpolicy drivers no utilization, so each thread
+ * derives its own, as intel_pstate does: MPERF only counts in C0 and, like
+ * the TSC, at the P0 rate, so their deltas give the busy fraction.
+ * Siblings read @sample_ns, @util, @uclamp_*, @busy and @iowait to build
+ * the domain's aggregates; the rest is only touched by the thread itself.
+ */
+struct zen_freq_thread {
+        struct update_util_data update_util;
+        struct zen_freq_cpu     *zcpu;
+        u64                     sample_ns;
+        u64                     mperf;
+        u64                     tsc;
+        u32                     util;
+        u8                      uclamp_min;
+        u8                      uclamp_max;
+        bool                    busy;
+        bool                    iowait;
 };
 
 /* ============================================================================
@@ -314,11 +931,25 @@ struct zen_freq_cpu {
  * @driver_lock:        Global driver lock
  * @initialized:        Whether driver is initialized
  *
- * @thermal_thread:     Thermal guard kernel thread
- * @thermal_should_run: Flag to stop thermal thread
- * @thermal_wq:         Thermal workqueue
+ * @thermal_should_run: Flag to stop requeueing the thermal sampling work
+ *
+ * @pstate_defs:        Per-package P-state definition cache
+ * @nr_pstate_defs:     Number of entries in @pstate_defs
+ *
+ * @prefcore_threshold: Lowest ranking that counts as a preferred core
+ * @itmt_enabled:       Whether ITMT priorities were published (built-in only)
+ *
+ * @pkgs:               Per-package domains, each allocated on its node
+ * @nr_pkgs:            Number of entries in @pkgs
+ * @boost_should_run:   Flag to stop re-arming the allocator timers
+ * @power_should_run:   Flag to stop re-arming the power timers
+ *
+ * @vid_svi3:           P-state VIDs use the SVI3 encoding (Zen 4+)
  *
  * @features:           Feature flags
+ *
+ * @kobj:               /sys/kernel/zen_freq
+ * @debugfs:            debugfs root directory
  */
 struct zen_freq_driver {
         struct zen_freq_cpu     **cpus;
@@ -328,12 +959,30 @@ struct zen_freq_driver {
         bool                    initialized;
 
         /* Thermal guard */
-        struct task_struct      *thermal_thread;
         atomic_t                thermal_should_run;
-        wait_queue_head_t       thermal_wq;
+
+        /* P-state definition cache */
+        struct zen_pstate_defs  *pstate_defs;
+        unsigned int            nr_pstate_defs;
+
+        /* Preferred cores */
+        u8                      prefcore_threshold;
+        bool                    itmt_enabled;
+
+        /* Package domains: boost credits and power guard */
+        struct zen_freq_pkg     **pkgs;
+        unsigned int            nr_pkgs;
+        atomic_t                boost_should_run;
+        atomic_t                power_should_run;
+
+        /* V/F curve: VID encoding of this generation */
+        bool                    vid_svi3;
 
         /* Features */
         u32                     features;
+
+        struct kobject          *kobj;
+        struct dentry           *debugfs;
 };
 
 /* Feature flags */
@@ -345,6 +994,7 @@ struct zen_freq_driver {
 #define ZEN_FEAT_THERMAL_GUARD          BIT(5)
 #define ZEN_FEAT_IO_BOOST               BIT(6)
 #define ZEN_FEAT_VOLTAGE_GUARD          BIT(7)
+#define ZEN_FEAT_POWER_GUARD            BIT(8)
 
 /* ============================================================================
  * Module Parameters (extern declarations)
@@ -355,16 +1005,39 @@ extern bool zen_freq_boost_enabled;
 extern unsigned int zen_freq_min_perf;
 extern unsigned int zen_freq_max_perf;
 extern bool zen_freq_epp_enabled;
+extern bool zen_freq_io_boost_enabled;
+extern unsigned int zen_freq_io_boost_duration_ms;
+extern unsigned int zen_freq_io_boost_hold_ms;
 extern bool zen_freq_thermal_guard;
 extern unsigned int zen_freq_soft_temp;
 extern unsigned int zen_freq_hard_temp;
 extern unsigned int zen_freq_voltage_max;
+extern bool zen_freq_cppc;
+extern bool zen_freq_prefcore;
+extern bool zen_freq_thermal_adaptive;
+extern unsigned int zen_freq_thermal_model;
+extern unsigned int zen_freq_thermal_kp;
+extern unsigned int zen_freq_thermal_ki;
+extern unsigned int zen_freq_thermal_kff;
+extern unsigned int zen_freq_thermal_horizon_ms;
+extern bool zen_freq_calibrate;
+extern unsigned int zen_freq_em_capacitance_pf;
+extern unsigned int zen_freq_min_residency_us;
+extern unsigned int zen_freq_up_rate_limit_us;
+extern unsigned int zen_freq_down_rate_limit_us;
+extern unsigned int zen_freq_boost_credits;
+extern bool zen_freq_native_governor;
+extern bool zen_freq_phase_predict;
+extern unsigned int zen_freq_power_limit_w;
+extern unsigned int zen_freq_power_kp;
+extern unsigned int zen_freq_power_ki;
 
 /* Mode definitions */
 #define ZEN_FREQ_MODE_POWERSAVE         0
 #define ZEN_FREQ_MODE_BALANCE           1
 #define ZEN_FREQ_MODE_PERFORMANCE       2
 #define ZEN_FREQ_MODE_USERSPACE         3
+#define ZEN_FREQ_MODE_EFFICIENT         4
 
 /* ============================================================================
  * Frequency Calculation Constants
@@ -380,41 +1053,73 @@ extern unsigned int zen_freq_voltage_max;
 
 /* Zero-IPI MSR access */
 void zen_write_pstate_local(void *info);
-int zen_freq_set_pstate_zero_ipi(struct zen_freq_cpu *zcpu, unsigned int pstate);
+void zen_freq_commit_pstate(struct zen_freq_cpu *zcpu, unsigned int pstate);
 
 /* Thermal guard */
 int zen_thermal_guard_init(void);
 void zen_thermal_guard_exit(void);
-int zen_thermal_thread(void *data);
-void zen_thermal_check_cpu(struct zen_freq_cpu *zcpu);
+void zen_thermal_check_cpu(struct zen_freq_cpu *zcpu, u32 temp);
+
+/* Power guard */
+int zen_power_guard_init(void);
+void zen_power_guard_exit(void);
 
 /* I/O wait boost */
-void zen_io_boost_init(struct zen_freq_cpu *zcpu);
-void zen_io_boost_check(struct zen_freq_cpu *zcpu, u64 io_wait);
-bool zen_io_boost_should_boost(u64 io_wait, u64 total);
+void zen_io_boost_update(struct zen_freq_cpu *zcpu, u64 time, unsigned int flags);
 
 /* Voltage safety */
-bool zen_voltage_verify_pstate(struct zen_pstate *ps);
+u32 zen_vf_vid_to_mv(u16 vid);
+bool zen_voltage_verify_pstate(struct zen_pstate *ps, bool report);
 int zen_voltage_check_all_pstates(struct zen_freq_cpu *zcpu);
 
 /* Dynamic EPP */
 void zen_epp_update_dynamic(struct zen_freq_cpu *zcpu, u32 util);
 
-/* RCU-protected operations */
-struct zen_perf_target *zen_perf_target_alloc(gfp_t flags);
+/* Preferred cores */
+void zen_prefcore_apply(struct zen_freq_cpu *zcpu);
+void zen_prefcore_init(void);
+void zen_prefcore_exit(void);
+
+/* Package domains */
+int zen_freq_pkgs_init(void);
+void zen_freq_pkgs_exit(void);
+struct zen_freq_pkg *zen_freq_pkg_get(unsigned int cpu);
+
+/* Boost credits */
+int zen_boost_credit_init(void);
+void zen_boost_credit_exit(void);
+
+/* Effective frequency feedback */
+void zen_freq_sample_effective(struct zen_freq_cpu *zcpu);
+
+/* Seqcount-protected performance target */
 void zen_perf_target_update(struct zen_freq_cpu *zcpu,
                             u8 desired, u8 min, u8 max, u8 epp);
+void zen_perf_target_read(struct zen_freq_cpu *zcpu,
+                          struct zen_perf_target *target);
+
+/* CPPC request mode */
+void zen_cppc_update_local(struct zen_freq_cpu *zcpu);
+void zen_cppc_commit(struct zen_freq_cpu *zcpu, u8 desired);
 
 /* Fast switch (lock-less) */
 unsigned int zen_freq_fast_switch_lockless(struct cpufreq_policy *policy,
                                            unsigned int target_freq);
 
 /* Standard driver callbacks */
+int zen_freq_calibrate_latency(struct zen_freq_cpu *zcpu);
+int zen_pstate_defs_init(void);
+void zen_pstate_defs_exit(void);
 int zen_freq_get_pstate_info(struct zen_freq_cpu *zcpu);
 int zen_freq_build_freq_table(struct zen_freq_cpu *zcpu);
+void zen_freq_free_freq_table(struct zen_freq_cpu *zcpu);
 unsigned int zen_freq_get_frequency(struct zen_freq_cpu *zcpu, unsigned int pstate);
 bool zen_freq_check_hardware_support(void);
 
+/* Statistics */
+void zen_freq_stats_read(struct zen_freq_cpu *zcpu,
+                         struct zen_freq_stats_snapshot *snap);
+
 /* Utility functions */
 u32 zen_freq_calc_freq_from_pstate(u64 pstate_val);
 u32 zen_read_temperature(unsigned int cpu);